@@ -9,6 +9,8 @@
 #include "services/gatt/ble_svc_gatt.h"
 
 #include "nvs_blob_example_main.h"
+#include "sched_trace.h"
+#include "BLE_functions_mair.h"
 
 #define DEVICE_NAME "MY BLE DEVICE"
 uint8_t ble_addr_type;
@@ -17,18 +19,32 @@ void ble_app_advertise(void);
 #define DEVICE_INFO_SERVICE 0x180A
 #define MANUFACTURER_NAME 0x2A29
 
-static char *BLEMessageRec = NULL;
+/* Received commands are copied into a small ring of static buffers and
+   queued in order. While the command task is busy, up to
+   BLE_MESSAGE_QUEUE_LEN commands wait; a write arriving when the queue is
+   full is refused with an ATT error, so the sender retries it and no
+   command is ever dropped or overwritten. The buffer the command task is
+   processing is never reused before it takes the next one.
+ */
+static char BLEMessageBuffers[BLE_MESSAGE_BUFFERS][CONFIG_SCHED_MAX_COMMAND_LEN + 1];
+static uint8_t BLEMessageNext = 0;
 
 static int device_write(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
     //printf("incoming message: %.*s\n", ctxt->om->om_len, ctxt->om->om_data);
     int dataLenght =  ctxt->om->om_len;
-    free(BLEMessageRec);
-    BLEMessageRec = (char *) malloc((dataLenght + 1) * sizeof(char));
-    memset(BLEMessageRec, 0, dataLenght);
-    strncpy(BLEMessageRec, (char *) ctxt->om->om_data, dataLenght);
+    if (dataLenght > CONFIG_SCHED_MAX_COMMAND_LEN) {
+        printf("Command of %d bytes rejected, CONFIG_SCHED_MAX_COMMAND_LEN is %d.\n", dataLenght, CONFIG_SCHED_MAX_COMMAND_LEN);
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    // The only producer, so the space cannot be taken before the send
+    if (uxQueueSpacesAvailable(xQueue_BLE_Received_Data) == 0) return BLE_ATT_ERR_INSUFFICIENT_RES;
+    char *BLEMessageRec = BLEMessageBuffers[BLEMessageNext];
+    BLEMessageNext = (BLEMessageNext + 1) % BLE_MESSAGE_BUFFERS;
+    memcpy(BLEMessageRec, ctxt->om->om_data, dataLenght);
     BLEMessageRec[dataLenght] = '\0';
-    xQueueOverwrite(xQueue_BLE_Received_Data, (void *) &BLEMessageRec);
+    sched_trace_mark_received();
+    xQueueSend(xQueue_BLE_Received_Data, (void *) &BLEMessageRec, 0);
     return 0;
 }
 
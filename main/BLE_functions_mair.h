@@ -1,6 +1,12 @@
 #ifndef BLE_FUNCTIONS_MAIR_H_
 #define BLE_FUNCTIONS_MAIR_H_
 
+#include "sdkconfig.h"
+
+// Static buffers the received commands are copied into: the queued ones and the one being processed
+#define BLE_MESSAGE_BUFFERS 4
+#define BLE_MESSAGE_QUEUE_LEN (BLE_MESSAGE_BUFFERS - 1)
+#define BLE_MESSAGE_RAM_BYTES (BLE_MESSAGE_BUFFERS * (CONFIG_SCHED_MAX_COMMAND_LEN + 1))
 
 void initializaton_BLE_function(void);
 
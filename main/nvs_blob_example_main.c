@@ -10,9 +10,11 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <stdio.h>
+#include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "nvs.h"
 #include "driver/gpio.h"
@@ -28,94 +30,291 @@
 
 #include "nvs_blob_example_main.h"
 #include "BLE_functions_mair.h"
+#include "time_service.h"
+#include "sched_queue.h"
+#include "sched_snapshot.h"
+#include "nvs_storage.h"
+#include "sched_trace.h"
+#include "sched_log.h"
+#include "sched_benchmark.h"
+#include "sched_recorder.h"
+#include "sched_heap.h"
+#include "sched_stack.h"
+#include "sched_fixed.h"
+#include "sched_loads.h"
+#include "sched_query.h"
+#include "sched_compact.h"
+#include "sched_image.h"
+#include "sched_transfer.h"
+#include "sched_window.h"
+#include "sched_cache.h"
 
 #define STORAGE_NAMESPACE "Storage"
-#define SCHEDULES_STORAGE_NAMESPACE "schedList"
-#define LOADS_STORAGE_NAMESPACE "loadList"
 
-uint8_t numberOfLoadsGlobal;
+#if CONFIG_FREERTOS_UNICORE
+#define COMMAND_TASK_CORE 0
+#define SCHEDULER_TASK_CORE 0
+#else
+#define COMMAND_TASK_CORE CONFIG_SCHED_COMMAND_TASK_CORE
+#define SCHEDULER_TASK_CORE CONFIG_SCHED_SCHEDULER_TASK_CORE
+#endif
 
-typedef struct events_dates_and_reps
-{
-    uint8_t repetions;
-    uint64_t date;
-}Date_and_Reps;
+#if !CONFIG_FREERTOS_SUPPORT_STATIC_ALLOCATION
+#error "Tasks and queues are statically allocated, enable CONFIG_FREERTOS_SUPPORT_STATIC_ALLOCATION"
+#endif
 
-typedef struct events_of_load
-{
-  char loadName[20];
-  uint8_t pinNumber;
-  Date_and_Reps* eventsON;
-  Date_and_Reps* eventsOFF;
-  uint8_t numOfEventsON;
-  uint8_t numOfEventsOFF;
+TaskHandle_t scheduleTaskHandle = NULL;
 
-} LoadEvent;
+/* Everything the scheduler needs is reserved at build time, sized by the
+   Kconfig limits, so running out of memory shows up as a build error
+   against CONFIG_SCHED_RAM_BUDGET instead of a failed malloc in the field.
+ */
+static StackType_t commandTaskStack[CONFIG_SCHED_COMMAND_TASK_STACK];
+static StaticTask_t commandTaskBuffer;
+static StackType_t schedulerTaskStack[CONFIG_SCHED_SCHEDULER_TASK_STACK];
+static StaticTask_t schedulerTaskBuffer;
+static uint8_t bleQueueStorage[BLE_MESSAGE_QUEUE_LEN * sizeof(char *)];
+static StaticQueue_t bleQueueBuffer;
+
+// Table returned by return_sched_from_NVS, its lists point into the loader arena
+static LoadEvent loadTable[CONFIG_SCHED_MAX_LOADS];
+// Boot image of the table (see sched_image.h): read as one blob, or assembled from every ON/OFF key
+static uint64_t loaderArena[SCHED_IMAGE_MAX_BYTES / sizeof(uint64_t)];
+
+// One ON or OFF list being read or rewritten, used by the command task only
+FIXED_LIST_TYPE(Sched_List, Date_and_Reps, CONFIG_SCHED_MAX_EVENTS_PER_LOAD);
+static Sched_List schedScratch;
+// The list of the other state, read to validate a new event against it
+static Sched_List otherScratch;
+_Static_assert(CONFIG_SCHED_MAX_LOADS <= UINT8_MAX, "load counts are 8 bits");
+_Static_assert(2 * sizeof(schedScratch.items) <= STORAGE_TXN_DATA_BYTES, "a transaction must hold both lists of a load");
+
+#define SCHED_STATIC_RAM_BYTES (CONFIG_SCHED_COMMAND_TASK_STACK + CONFIG_SCHED_SCHEDULER_TASK_STACK + 2 * sizeof(StaticTask_t) \
+                              + sizeof(bleQueueStorage) + sizeof(StaticQueue_t) + sizeof(loadTable) + sizeof(loaderArena) + 2 * sizeof(schedScratch) \
+                              + SCHED_SNAPSHOT_RAM_BYTES + SCHED_HEAP_RAM_BYTES + SCHED_LOG_RAM_BYTES + SCHED_TRACE_RAM_BYTES \
+                              + SCHED_RECORDER_RAM_BYTES + STORAGE_RAM_BYTES + BLE_MESSAGE_RAM_BYTES + SCHED_STACK_RAM_BYTES \
+                              + SCHED_LOADS_RAM_BYTES + SCHED_TRANSFER_RAM_BYTES + SCHED_CACHE_RAM_BYTES \
+                              + sizeof(schedPurgeQueue))
+
+// Scheduler task -> command task: fired events to purge from NVS
+SPSC_QUEUE_DEFINE(schedPurgeQueue, Sched_Purge, CONFIG_SCHED_PURGE_QUEUE_LEN);
+
+_Static_assert(SCHED_STATIC_RAM_BYTES <= CONFIG_SCHED_RAM_BUDGET, "Static RAM exceeds CONFIG_SCHED_RAM_BUDGET, lower the Kconfig limits");
 
 void print_nvs_stats(char* partitionName)
 {
+    TRACE_START(start);
     nvs_stats_t nvs_stats;
     nvs_get_stats(partitionName, &nvs_stats);
     printf("Count: UsedEntries = (%d), FreeEntries = (%d), AllEntries = (%d), NameSpacesCount = %d\n",
     nvs_stats.used_entries, nvs_stats.free_entries, nvs_stats.total_entries, nvs_stats.namespace_count);
+    TRACE_END(TRACE_PRINT, start);
+}
+
+/* Return how many events of a list sorted by date are due at "now"
+   (date <= now), which is also the position where a new date equal
+   to "now" would be inserted to keep the list sorted.
+ */
+uint16_t count_due_events(const Date_and_Reps* schedList, uint16_t numOfEvents, uint64_t now)
+{
+    uint16_t low = 0;
+    uint16_t high = numOfEvents;
+    while(low < high)
+    {
+        uint16_t middle = low + (high - low) / 2;
+        if(schedList[middle].date <= now) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+/* Sort a schedule list by date. Lists are kept sorted by save_schedule_time,
+   this only fixes blobs written by older firmware (insertion sort, so it is
+   linear for lists that are already sorted).
+ */
+void sort_sched_list(Date_and_Reps* schedList, uint16_t numOfEvents)
+{
+    for(int i = 1; i < numOfEvents; i++)
+    {
+        Date_and_Reps aux = schedList[i];
+        int j = i - 1;
+        while(j >= 0 && schedList[j].date > aux.date)
+        {
+            schedList[j + 1] = schedList[j];
+            j--;
+        }
+        schedList[j + 1] = aux;
+    }
+}
+
+/* Read the ON or OFF list of a load into "list", through the list cache.
+   A missing key reads as an empty list; a list longer than the scratch
+   buffer is an error.
+ */
+static esp_err_t read_sched_list(nvs_handle_t handle, const char* loadKey, Sched_List* list)
+{
+    size_t required_size = sizeof(list->items);
+    list->count = 0;
+    esp_err_t err = sched_cache_read(handle, loadKey, list->items, &required_size);
+    if (err == ESP_ERR_NVS_NOT_FOUND) return ESP_OK;
+    if (err == ESP_ERR_NVS_INVALID_LENGTH) {
+        required_size = 0;
+        sched_cache_read(handle, loadKey, NULL, &required_size);
+        SCHED_LOG("%s holds %d bytes, more than CONFIG_SCHED_MAX_EVENTS_PER_LOAD allows!\n", loadKey, required_size);
+    }
+    if (err == ESP_OK) list->count = required_size / sizeof(Date_and_Reps);
+    return err;
+}
+
+/* Read both lists of a load into the scratch lists, sorted. The lists of
+   "load" point into them, so they are valid until the next NVS change. */
+esp_err_t read_load_lists(uint8_t loadNumber, LoadEvent* load)
+{
+    char loadKey[SCHED_LOAD_KEY_LEN];
+    nvs_handle_t my_handle;
+    const Load_Record* record = sched_loads_get(loadNumber);
+    if (record == NULL) return ESP_ERR_NOT_FOUND;
+
+    esp_err_t err = storage_open(SCHEDULES_STORAGE_NAMESPACE, &my_handle);
+    if (err != ESP_OK) return err;
+    sched_loads_sched_key(loadNumber, 1, loadKey);
+    err = read_sched_list(my_handle, loadKey, &schedScratch);
+    sched_loads_sched_key(loadNumber, 0, loadKey);
+    if (err == ESP_OK) err = read_sched_list(my_handle, loadKey, &otherScratch);
+    storage_close(my_handle);
+    if (err != ESP_OK) return err;
+    sort_sched_list(schedScratch.items, schedScratch.count);
+    sort_sched_list(otherScratch.items, otherScratch.count);
+
+    memset(load, 0, sizeof(LoadEvent));
+    strcpy(load->loadName, record->name);
+    load->loadNumber = loadNumber;
+    load->pinNumber = record->pinNumber;
+    load->eventsON = schedScratch.items;
+    load->numOfEventsON = schedScratch.count;
+    load->eventsOFF = otherScratch.items;
+    load->numOfEventsOFF = otherScratch.count;
+    return ESP_OK;
+}
+
+/* How a new event fits the timeline of its load. A load alternates
+   between ON and OFF, so the events right before and right after the new
+   one must be of the other state. Both lists are sorted, so this takes
+   two binary searches.
+ */
+typedef enum
+{
+    SCHED_CONFLICT_NONE,
+    SCHED_CONFLICT_DUPLICATE,       // same state and date, merged into one event
+    SCHED_CONFLICT_SAME_DATE,       // the other state at the same date
+    SCHED_CONFLICT_STACKED          // same state as the event before or after it
+} Sched_Conflict;
+
+static Sched_Conflict check_sched_conflict(const Sched_List* same, const Sched_List* other, uint64_t date, uint16_t* duplicate)
+{
+    uint16_t samePosition = count_due_events(same->items, same->count, date);
+    uint16_t otherPosition = count_due_events(other->items, other->count, date);
+    if(samePosition > 0 && same->items[samePosition - 1].date == date)
+    {
+        *duplicate = samePosition - 1;
+        return SCHED_CONFLICT_DUPLICATE;
+    }
+    if(otherPosition > 0 && other->items[otherPosition - 1].date == date) return SCHED_CONFLICT_SAME_DATE;
+    uint8_t sameBefore = samePosition > 0
+        && (otherPosition == 0 || same->items[samePosition - 1].date > other->items[otherPosition - 1].date);
+    uint8_t sameAfter = samePosition < same->count
+        && (otherPosition == other->count || same->items[samePosition].date < other->items[otherPosition].date);
+    return sameBefore || sameAfter ? SCHED_CONFLICT_STACKED : SCHED_CONFLICT_NONE;
+}
+
+/* Registry number of a load, -1 (logged) when it is not registered */
+static int find_load_number(const char* loadName)
+{
+    int loadNumber = sched_loads_find(loadName);
+    if (loadNumber < 0) SCHED_LOG("Load %s is not registered!\n", loadName);
+    return loadNumber;
 }
 
 /* Save new run time value in NVS
    by first reading a table of previously saved values
-   and then adding the new value at the end of the table.
+   and then inserting the new value in date order.
+   With CONFIG_SCHED_VALIDATE_SCHEDULES a date that
+   breaks the ON/OFF alternation of the load is refused,
+   and saving an event again only changes its repetitions
+   (*merged is then set).
    Return an error if anything goes wrong
    during this process.
  */
 
-esp_err_t save_schedule_time(char* loadName, int loadState, int schedTime, int repetions)
+esp_err_t save_schedule_time(char* loadName, int loadState, uint64_t schedTime, int repetions, uint8_t* merged)
 {
     uint64_t scheduleTime = schedTime;
     uint8_t reps = repetions;
-    char loadKey[16];
-    memset(loadKey, 0, sizeof(loadKey));
-    if(loadState == 0) sprintf(loadKey, "%sOFF",loadName);
-    else sprintf(loadKey, "%sON",loadName);
+    char loadKey[SCHED_LOAD_KEY_LEN];
+    char otherLoadKey[SCHED_LOAD_KEY_LEN];
+    if (merged != NULL) *merged = 0;
+    int loadNumber = find_load_number(loadName);
+    if (loadNumber < 0) return ESP_ERR_NOT_FOUND;
+    sched_loads_sched_key(loadNumber, loadState != 0, loadKey);
+    sched_loads_sched_key(loadNumber, loadState == 0, otherLoadKey);
     nvs_handle_t my_handle;
     esp_err_t err;
 
     // Open
-    err = nvs_open_from_partition("MyNvs", SCHEDULES_STORAGE_NAMESPACE, NVS_READWRITE, &my_handle);
+    err = storage_open(SCHEDULES_STORAGE_NAMESPACE, &my_handle);
     if (err != ESP_OK) return err;
 
-    // Read the size of memory space required for blob
-    size_t required_size = 0;  // value will default to 0, if not set yet in NVS
-    err = nvs_get_blob(my_handle, loadKey, NULL, &required_size);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) return err;
-
-    // Read previously saved blob if available
-    Date_and_Reps* loadSchedList = malloc(required_size + sizeof(Date_and_Reps));
-    if (required_size > 0) {
-        err = nvs_get_blob(my_handle, loadKey, loadSchedList, &required_size);
-        if (err != ESP_OK) {
-            free(loadSchedList);
-            return err;
+    // Read previously saved blobs if available, the other state's to validate against
+    err = read_sched_list(my_handle, otherLoadKey, &otherScratch);
+    if (err == ESP_OK) err = read_sched_list(my_handle, loadKey, &schedScratch);
+    if (err != ESP_OK) {
+        storage_close(my_handle);
+        return err;
+    }
+    sort_sched_list(schedScratch.items, schedScratch.count);
+    sort_sched_list(otherScratch.items, otherScratch.count);
+
+    Sched_Conflict conflict = SCHED_CONFLICT_NONE;
+    uint16_t duplicate = 0;
+#if CONFIG_SCHED_VALIDATE_SCHEDULES
+    conflict = check_sched_conflict(&schedScratch, &otherScratch, scheduleTime, &duplicate);
+#endif
+    if (conflict == SCHED_CONFLICT_SAME_DATE || conflict == SCHED_CONFLICT_STACKED) {
+        if (conflict == SCHED_CONFLICT_SAME_DATE) SCHED_LOG("Load %s is already turned %s at %lld, date refused!\n", loadName, loadState ? "OFF" : "ON", scheduleTime);
+        else SCHED_LOG("Load %s would be turned %s twice in a row at %lld, date refused!\n", loadName, loadState ? "ON" : "OFF", scheduleTime);
+        storage_close(my_handle);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (conflict == SCHED_CONFLICT_DUPLICATE) {
+        // Saved again: one event is kept, with the new repetitions
+        SCHED_LOG("Date %lld already saved, repetitions changed from %d to %d.\n", scheduleTime, schedScratch.items[duplicate].repetions, reps);
+        schedScratch.items[duplicate].repetions = reps;
+        if (merged != NULL) *merged = 1;
+    } else {
+        // ON and OFF events together must fit CONFIG_SCHED_MAX_EVENTS_PER_LOAD
+        if (schedScratch.count + otherScratch.count >= CONFIG_SCHED_MAX_EVENTS_PER_LOAD) {
+            SCHED_LOG("Load %s already has %d events, the maximum!\n", loadName, CONFIG_SCHED_MAX_EVENTS_PER_LOAD);
+            storage_close(my_handle);
+            return ESP_ERR_NO_MEM;
         }
+
+        // Insert the new date keeping the list sorted, so the scheduler can binary search it
+        Date_and_Reps newEvent = { .repetions = reps, .date = scheduleTime };
+        uint16_t position = count_due_events(schedScratch.items, schedScratch.count, scheduleTime);
+        FIXED_LIST_INSERT(&schedScratch, position, &newEvent);
     }
 
     // Write value including previously saved blob if available
-    required_size += sizeof(Date_and_Reps);
-    loadSchedList[required_size / sizeof(Date_and_Reps) - 1].date = scheduleTime;
-    loadSchedList[required_size / sizeof(Date_and_Reps) - 1].repetions = reps;
-    err = nvs_set_blob(my_handle, loadKey, loadSchedList, required_size);
-    free(loadSchedList);
-
-    if (err != ESP_OK) return err;
+    err = storage_set_blob(my_handle, loadKey, schedScratch.items, schedScratch.count * sizeof(Date_and_Reps));
 
     // Commit
-    err = nvs_commit(my_handle);
-    if (err != ESP_OK) return err;
-
-    printf("Date registered successfully!\n");
-
-    print_nvs_stats("MyNvs");    
+    if (err == ESP_OK) err = storage_commit(my_handle);
 
     // Close
-    nvs_close(my_handle);
+    storage_close(my_handle);
+    if (err != ESP_OK) return err;
+
+    SCHED_LOG("Date registered successfully!\n");
     return ESP_OK;
 }
 
@@ -126,43 +325,37 @@ esp_err_t save_schedule_time(char* loadName, int loadState, int schedTime, int r
  */
 esp_err_t print_load_sched_list(char* loadName)
 {
-    char loadKey[16];    
+    char loadKey[SCHED_LOAD_KEY_LEN];
     nvs_handle_t my_handle;
     esp_err_t err;
+    int loadNumber = find_load_number(loadName);
+    if (loadNumber < 0) return ESP_ERR_NOT_FOUND;
 
     // Open
-    err = nvs_open_from_partition("MyNvs", SCHEDULES_STORAGE_NAMESPACE, NVS_READWRITE, &my_handle);
+    err = storage_open(SCHEDULES_STORAGE_NAMESPACE, &my_handle);
     if (err != ESP_OK) return err;
 
     for(int x = 0; x < 2; x++)
     {
-        memset(loadKey, 0, sizeof(loadKey));
-        if(x == 0) sprintf(loadKey, "%sON",loadName);
-        else sprintf(loadKey, "%sOFF",loadName);
+        sched_loads_sched_key(loadNumber, x == 0, loadKey);
         // Read run time blob for Load Name ON/OFF
-        size_t required_size = 0;  // value will default to 0, if not set yet in NVS
-        // obtain required memory space to store blob being read from NVS
-        err = nvs_get_blob(my_handle, loadKey, NULL, &required_size);
-        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) return err;
-        printf("Schedulements for %s:\n",loadKey);
-        if (required_size == 0) {
+        err = read_sched_list(my_handle, loadKey, &schedScratch);
+        if (err != ESP_OK) {
+            storage_close(my_handle);
+            return err;
+        }
+        printf("Schedulements for %s%s:\n", loadName, x == 0 ? "ON" : "OFF");
+        if (schedScratch.count == 0) {
             printf("Nothing saved yet!\n");
         } else {
-            Date_and_Reps* loadSchedList = malloc(required_size);
-            err = nvs_get_blob(my_handle, loadKey, loadSchedList, &required_size);
-            if (err != ESP_OK) {
-                free(loadSchedList);
-                return err;
-            }
-            for (int i = 0; i < required_size / sizeof(Date_and_Reps); i++) {
-                printf("Sched %d: Date: %lld / Repetitions: %d\n", i + 1, loadSchedList[i].date, loadSchedList[i].repetions);
+            for (int i = 0; i < schedScratch.count; i++) {
+                printf("Sched %d: Date: %lld / Repetitions: %d\n", i + 1, schedScratch.items[i].date, schedScratch.items[i].repetions);
             }
-            free(loadSchedList);
         }
     }
 
     // Close
-    nvs_close(my_handle);
+    storage_close(my_handle);
     return ESP_OK;
 }
 
@@ -197,324 +390,549 @@ uint8_t check_number_parameter(const cJSON *json, char *par)
        
 }
 
-void register_new_load(char* loadName, uint8_t pinNumber)
+esp_err_t register_new_load(char* loadName, uint8_t pinNumber)
 {
-    nvs_handle_t my_loadList_handle;
-    esp_err_t err = nvs_open_from_partition("MyNvs", LOADS_STORAGE_NAMESPACE, NVS_READWRITE, &my_loadList_handle);
-    if (err != ESP_OK) {
-        printf("Error (%s) opening Load List NVS handle!\n", esp_err_to_name(err));
-    } else {
-        printf("Done\n");
-
-        // Write
-        printf("Saving Load in NVS ... ");
-        err = nvs_set_u8(my_loadList_handle, loadName, pinNumber);
-        printf((err != ESP_OK) ? "Failed!\n" : "Done\n");
-
-        // Commit written value.
-        // After setting any values, nvs_commit() must be called to ensure changes are written
-        // to flash storage. Implementations may write to storage at other times,
-        // but this is not guaranteed.
-        printf("Committing updates in NVS ... ");
-        err = nvs_commit(my_loadList_handle);
-        printf((err != ESP_OK) ? "Failed!\n" : "Done\n");
-
-         print_nvs_stats("MyNvs");
-
-        // Close
-        nvs_close(my_loadList_handle);
-    }
-
+    uint8_t loadNumber;
+    SCHED_LOG("Saving Load in NVS ... ");
+    esp_err_t err = sched_loads_register(loadName, pinNumber, &loadNumber);
+    if (err != ESP_OK) SCHED_LOG("Failed (%s)!\n", esp_err_to_name(err));
+    else SCHED_LOG("Done, load %s is number %d\n", loadName, loadNumber);
+    return err;
 }
 
 void read_load_list()
 {
-    nvs_handle_t my_loadList_handle;
-    esp_err_t err = nvs_open_from_partition("MyNvs", LOADS_STORAGE_NAMESPACE, NVS_READWRITE, &my_loadList_handle);
-    uint8_t loadPinRead;
-    if (err != ESP_OK) {
-        printf("Error (%s) opening Load List NVS handle!\n", esp_err_to_name(err));
-    } else
-    {
-        printf("Done\n");
-
-        //Listing all key-values inside namespace "loadList"
-        // Example of listing all the key-value pairs of any type under specified partition and namespace
-        // Note: no need to release iterator obtained from nvs_entry_find function when
-        //       nvs_entry_find or nvs_entry_next function return NULL, indicating no other
-        //       element for specified criteria was found.               
-
-        nvs_iterator_t it = nvs_entry_find("MyNvs", LOADS_STORAGE_NAMESPACE, NVS_TYPE_ANY);
-        while (it != NULL) {
-                nvs_entry_info_t info;
-                nvs_entry_info(it, &info);
-                it = nvs_entry_next(it); 
-                printf("key '%s', type '%d' \n", info.key, info.type);               
-                if(info.type == NVS_TYPE_U8) 
-                {
-                    err = nvs_get_u8(my_loadList_handle, info.key, &loadPinRead);
-                    switch (err) {
-                        case ESP_OK:
-                        printf("Pin Number: %d  \n", loadPinRead);
-                        break;
-                        case ESP_ERR_NVS_NOT_FOUND:
-                            printf("The value is not initialized yet!\n");
-                        break;
-                        default :
-                            printf("Error (%s) reading!\n", esp_err_to_name(err));
-                    }
-                }
-                
-            };
-        
-        // Close
-        nvs_close(my_loadList_handle);    
+    char loadKey[SCHED_LOAD_KEY_LEN];
+    for (int loadNumber = 0; loadNumber < CONFIG_SCHED_MAX_LOADS; loadNumber++)
+    {
+        const Load_Record* load = sched_loads_get(loadNumber);
+        if (load == NULL) continue;
+        sched_loads_record_key(loadNumber, loadKey);
+        printf("key '%s', load '%s' \n", loadKey, load->name);
+        printf("Pin Number: %d  \n", load->pinNumber);
     }
+    printf("%d of %d loads registered.\n", sched_loads_count(), CONFIG_SCHED_MAX_LOADS);
     printf("End of read load list function.\n");
 
 }
 
-LoadEvent* return_sched_from_NVS()
+/* Read every load and its ON/OFF schedules from NVS into the loader arena,
+   as a boot image. A first pass only gathers the blob sizes to check the
+   image fits, a second pass reads each blob directly into its place.
+   A load holding more than CONFIG_SCHED_MAX_EVENTS_PER_LOAD events (saved
+   by older firmware or imported by a larger build) is left out of the
+   table, its keys stay untouched in NVS, and the other loads are read.
+ */
+static esp_err_t read_sched_keys(void)
 {
-    LoadEvent* loadEventsArray;
     uint8_t numberOfLoads = 0;
-    nvs_handle_t my_loadList_handle;
+    size_t eventsSize = 0;
+    uint8_t oversized[CONFIG_SCHED_MAX_LOADS];
     nvs_handle_t my_sched_handle;
-    uint8_t loadPinRead;
-    char auxLoadKey[20];
-    esp_err_t err = nvs_open_from_partition("MyNvs", LOADS_STORAGE_NAMESPACE, NVS_READWRITE, &my_loadList_handle);    
-    if (err != ESP_OK) printf("Error (%s) opening Load List NVS handle!\n", esp_err_to_name(err));
-    else printf("Load List Namespace opened OK!\n");
-
-    err = nvs_open_from_partition("MyNvs", SCHEDULES_STORAGE_NAMESPACE, NVS_READWRITE, &my_sched_handle);
-    if (err != ESP_OK) printf("Error (%s) opening Load List NVS handle!\n", esp_err_to_name(err));
-    else printf("Schedules Namespace opened OK!\n");
-
-    size_t used_entries;
-    size_t total_entries_namespace;
-    if(nvs_get_used_entry_count(my_loadList_handle, &used_entries) == ESP_OK){
-        // the total number of records occupied by the namespace
-        total_entries_namespace = used_entries + 1;
-        printf("Used Entries in namespace %s: %d\n", LOADS_STORAGE_NAMESPACE, used_entries);
-        printf("Total Entries in namespace %s: %d\n", LOADS_STORAGE_NAMESPACE, total_entries_namespace);
-        loadEventsArray = malloc(used_entries*sizeof(LoadEvent));
-    }else return NULL;
-    nvs_iterator_t it = nvs_entry_find("MyNvs", LOADS_STORAGE_NAMESPACE, NVS_TYPE_U8);
-    while (it != NULL) 
+    char auxLoadKey[SCHED_LOAD_KEY_LEN];
+
+    esp_err_t err = storage_open(SCHEDULES_STORAGE_NAMESPACE, &my_sched_handle);
+    if (err != ESP_OK) {
+        printf("Error (%s) opening Schedules NVS handle!\n", esp_err_to_name(err));
+        return err;
+    }
+
+    // First pass: count the registered loads and the bytes of their schedule blobs
+    memset(oversized, 0, sizeof(oversized));
+    for (int loadNumber = 0; loadNumber < CONFIG_SCHED_MAX_LOADS && err == ESP_OK; loadNumber++)
     {
+        const Load_Record* load = sched_loads_get(loadNumber);
+        if (load == NULL) continue;
+        size_t sizes[2] = {0, 0};     // value will default to 0, if not set yet in NVS
+        for(int x = 0; x < 2 && err == ESP_OK; x++)
+        {
+            sched_loads_sched_key(loadNumber, x == 0, auxLoadKey);
+            err = sched_cache_read(my_sched_handle, auxLoadKey, NULL, &sizes[x]);
+            if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+        }
+        if (err != ESP_OK) break;
+        if (sizes[0] + sizes[1] > CONFIG_SCHED_MAX_EVENTS_PER_LOAD * sizeof(Date_and_Reps)) {
+            printf("Load %s holds %d events, more than CONFIG_SCHED_MAX_EVENTS_PER_LOAD (%d): not scheduled, its schedules are kept in NVS.\n",
+                load->name, (sizes[0] + sizes[1]) / sizeof(Date_and_Reps), CONFIG_SCHED_MAX_EVENTS_PER_LOAD);
+            oversized[loadNumber] = 1;
+            continue;
+        }
         numberOfLoads++;
-        //loadEventsArray = realloc(loadEventsArray, numberOfLoads*sizeof(LoadEvent));
-        nvs_entry_info_t info;
-        nvs_entry_info(it, &info);
-        it = nvs_entry_next(it); 
-        printf("key '%s', type '%d' \n", info.key, info.type); 
-        err = nvs_get_u8(my_loadList_handle, info.key, &loadPinRead);
-        switch (err) {
-            case ESP_OK:
-            printf("Pin Number: %d  \n", loadPinRead);
-            strcpy(loadEventsArray[numberOfLoads-1].loadName, info.key);
-            loadEventsArray[numberOfLoads-1].pinNumber = loadPinRead;
-                
-            for(int x = 0; x < 2; x++)
-            {                
-                memset(auxLoadKey, 0, sizeof(auxLoadKey));
-                if(x == 0) sprintf(auxLoadKey, "%sON",info.key); 
-                else sprintf(auxLoadKey, "%sOFF",info.key);     
-                // Read run time blob for Load Name ON/OFF
-                size_t required_size = 0;  // value will default to 0, if not set yet in NVS
-                // obtain required memory space to store blob being read from NVS
-                err = nvs_get_blob(my_sched_handle, auxLoadKey, NULL, &required_size);
-                if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) return NULL;
-                printf("Schedulements for %s:\n",auxLoadKey);
-                if (required_size == 0) {
-                    printf("No %s schedules saved yet!\n",auxLoadKey);
-                    if(x == 0) loadEventsArray[numberOfLoads-1].numOfEventsON = 0;
-                    else loadEventsArray[numberOfLoads-1].numOfEventsOFF = 0;
-                } else {
-                    Date_and_Reps* loadSchedList = malloc(required_size);
-                    err = nvs_get_blob(my_sched_handle, auxLoadKey, loadSchedList, &required_size);
-                    if (err != ESP_OK) {
-                        free(loadSchedList);
-                        return NULL;
-                    }
-                    loadEventsArray[numberOfLoads-1].eventsON = loadSchedList;
-                    if(x == 0) loadEventsArray[numberOfLoads-1].numOfEventsON = required_size / sizeof(Date_and_Reps);
-                    else loadEventsArray[numberOfLoads-1].numOfEventsOFF = required_size / sizeof(Date_and_Reps);
-                    for (int i = 0; i < required_size / sizeof(Date_and_Reps); i++) {
-                        printf("Schedule %d -> Date: %lld / Repetions: %d\n", i + 1, loadSchedList[i].date, loadSchedList[i].repetions);
-                    }
-                    //free(loadSchedList);
-                }
+        for(int x = 0; x < 2; x++)
+        {
+#if SCHED_WINDOW_EVENTS
+            // Only the start of each list is loaded, the rest is read when the window is refilled
+            if (sizes[x] > SCHED_LOADED_EVENTS_PER_LIST * sizeof(Date_and_Reps))
+                sizes[x] = SCHED_LOADED_EVENTS_PER_LIST * sizeof(Date_and_Reps);
+#endif
+            eventsSize += sizes[x];
+        }
+    }
+
+    // The lists follow the load records, aligned for their 64-bit dates
+    size_t imageSize = SCHED_IMAGE_EVENTS_OFFSET(numberOfLoads) + eventsSize;
+    if (err == ESP_OK && imageSize > sizeof(loaderArena)) {
+        printf("Schedule table of %d loads needs %d bytes, more than CONFIG_SCHED_MAX_LOADS / CONFIG_SCHED_MAX_EVENTS_PER_LOAD allow (%d)!\n",
+            numberOfLoads, imageSize, sizeof(loaderArena));
+        err = ESP_ERR_NO_MEM;
+    }
+
+    // Second pass: read the blobs into the arena
+    Sched_Image_Load* records = (Sched_Image_Load*) ((Sched_Image_Header*) loaderArena + 1);
+    Date_and_Reps* nextEvents = (Date_and_Reps*) ((uint8_t*) loaderArena + SCHED_IMAGE_EVENTS_OFFSET(numberOfLoads));
+    size_t freeEventsSize = eventsSize;
+    uint8_t loadsRead = 0;
+    for (int loadNumber = 0; loadNumber < CONFIG_SCHED_MAX_LOADS && err == ESP_OK && loadsRead < numberOfLoads; loadNumber++)
+    {
+        const Load_Record* load = sched_loads_get(loadNumber);
+        if (load == NULL || oversized[loadNumber]) continue;
+        SCHED_LOG("Load %d '%s', pin number: %d\n", loadNumber, load->name, load->pinNumber);
+        Sched_Image_Load* record = &records[loadsRead++];
+        memset(record, 0, sizeof(Sched_Image_Load));
+        strcpy(record->loadName, load->name);
+        record->loadNumber = loadNumber;
+        record->pinNumber = load->pinNumber;
+        for(int x = 0; x < 2; x++)
+        {                
+            sched_loads_sched_key(loadNumber, x == 0, auxLoadKey);
+#if SCHED_WINDOW_EVENTS
+            // The blob is read whole into the scratch list and only its earliest events are kept
+            err = read_sched_list(my_sched_handle, auxLoadKey, &schedScratch);
+            if (err != ESP_OK) break;
+            sort_sched_list(schedScratch.items, schedScratch.count);
+            uint16_t numOfEvents = schedScratch.count < SCHED_LOADED_EVENTS_PER_LIST ? schedScratch.count : SCHED_LOADED_EVENTS_PER_LIST;
+            memcpy(nextEvents, schedScratch.items, numOfEvents * sizeof(Date_and_Reps));
+            size_t required_size = numOfEvents * sizeof(Date_and_Reps);
+            SCHED_LOG("Schedulements for %s%s:\n", load->name, x == 0 ? "ON" : "OFF");
+#else
+            // The blob is read straight into the arena, its length is returned in required_size
+            size_t required_size = freeEventsSize;
+            err = sched_cache_read(my_sched_handle, auxLoadKey, nextEvents, &required_size);
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                err = ESP_OK;
+                required_size = 0;
             }
-            
-            break;
-            case ESP_ERR_NVS_NOT_FOUND:
-                printf("The value is not initialized yet!\n");
-            break;
-            default :
-                printf("Error (%s) reading!\n", esp_err_to_name(err));
-        }        
-        
+            if (err != ESP_OK) break;
+            SCHED_LOG("Schedulements for %s%s:\n", load->name, x == 0 ? "ON" : "OFF");
+            uint16_t numOfEvents = required_size / sizeof(Date_and_Reps);
+            sort_sched_list(nextEvents, numOfEvents);
+#endif
+            if (numOfEvents == 0) SCHED_LOG("No %s%s schedules saved yet!\n", load->name, x == 0 ? "ON" : "OFF");
+            for (int i = 0; i < numOfEvents; i++) {
+                SCHED_LOG("Schedule %d -> Date: %lld / Repetions: %d\n", i + 1, nextEvents[i].date, nextEvents[i].repetions);
+            }
+            if(x == 0) record->numOfEventsON = numOfEvents;
+            else record->numOfEventsOFF = numOfEvents;
+            nextEvents += numOfEvents;
+            freeEventsSize -= required_size;
+        }
+    }
+    storage_close(my_sched_handle);
+
+    if (err == ESP_OK) sched_image_seal(loaderArena, loadsRead, (eventsSize - freeEventsSize) / sizeof(Date_and_Reps));
+    return err;
+}
+
+/* Load every load and its ON/OFF schedules into the loader arena, from
+   the boot image when it is current, else from the schedule keys. The
+   arena is static, so the returned table is not freed and stays valid
+   until the next call.
+ */
+LoadEvent* return_sched_from_NVS(uint8_t* numberOfLoadsRead)
+{
+    int64_t start = esp_timer_get_time();
+    *numberOfLoadsRead = 0;
+    uint8_t fromImage = sched_image_read(loaderArena, sizeof(loaderArena)) == ESP_OK;
+    if (!fromImage) {
+        esp_err_t err = read_sched_keys();
+        if (err != ESP_OK) {
+            printf("Error (%s) loading the schedules from NVS!\n", esp_err_to_name(err));
+            return NULL;
+        }
+    }
+
+    // The table points into the image
+    const Sched_Image_Header* header = (const Sched_Image_Header*) loaderArena;
+    const Sched_Image_Load* records = (const Sched_Image_Load*) (header + 1);
+    Date_and_Reps* nextEvents = (Date_and_Reps*) ((uint8_t*) loaderArena + SCHED_IMAGE_EVENTS_OFFSET(header->numberOfLoads));
+    uint8_t numberOfLoads = header->numberOfLoads;
+    for (int i = 0; i < numberOfLoads; i++)
+    {
+        LoadEvent* load = &loadTable[i];
+        memset(load, 0, sizeof(LoadEvent));
+        strcpy(load->loadName, records[i].loadName);
+        load->loadNumber = records[i].loadNumber;
+        load->pinNumber = records[i].pinNumber;
+        load->eventsON = nextEvents;
+        load->numOfEventsON = records[i].numOfEventsON;
+        nextEvents += load->numOfEventsON;
+        load->eventsOFF = nextEvents;
+        load->numOfEventsOFF = records[i].numOfEventsOFF;
+        nextEvents += load->numOfEventsOFF;
     }
+    int64_t elapsed = esp_timer_get_time() - start;
+    sched_image_record_load(fromImage, elapsed);
+
+    *numberOfLoadsRead = numberOfLoads;
     if(numberOfLoads != 0)
     {
-        numberOfLoadsGlobal = numberOfLoads;
-        printf("Printing the loadEventsArray Values: \n\n");
         for(int i = 0; i < numberOfLoads;i++)
         {
-            printf("Number of Loads to show: %d\n", numberOfLoads);
-            printf("Load Name: %s\n", loadEventsArray[i].loadName);
-            printf("Load PIN: %d\n", loadEventsArray[i].pinNumber);
-            printf("Number of Events ON: %d\n", loadEventsArray[i].numOfEventsON);
-            printf("Number of Events OFF: %d\n", loadEventsArray[i].numOfEventsOFF);
-            for(int j = 0; j < loadEventsArray[i].numOfEventsON; j++)
-            {
-                printf("Load Dates ON: %lld / Repetitions: %d \n", loadEventsArray[i].eventsON[j].date, loadEventsArray[i].eventsON[j].repetions);
-            }
-            for(int j = 0; j < loadEventsArray[i].numOfEventsOFF; j++)
-            {
-                printf("Load Dates OFF: %lld / Repetitions: %d \n", loadEventsArray[i].eventsOFF[j].date, loadEventsArray[i].eventsOFF[j].repetions);
-            }
-
+            SCHED_LOG("Load %s on pin %d: %d events ON, %d events OFF\n", loadTable[i].loadName, loadTable[i].pinNumber,
+                loadTable[i].numOfEventsON, loadTable[i].numOfEventsOFF);
         }
     }
-    else printf("No loads registered on flash.\n");
+    else SCHED_LOG("No loads registered on flash.\n");
 
-    print_nvs_stats("MyNvs");
+    SCHED_LOG("Schedule table loaded from %s in %lld us, %d of the %d loader arena bytes.\n",
+        fromImage ? "the boot image" : "the schedule keys", elapsed, sched_image_size(loaderArena), sizeof(loaderArena));
 
-    return loadEventsArray;
+    return loadTable;
 
 }
 
+/* Write the boot image, from the schedule keys so it matches NVS exactly */
+void save_boot_image(void)
+{
+    esp_err_t err = read_sched_keys();
+    if (err == ESP_OK) err = sched_image_write(loaderArena);
+    if (err != ESP_OK) printf("Error (%s) saving the boot image!\n", esp_err_to_name(err));
+    else SCHED_LOG("Boot image saved, %d bytes.\n", sched_image_size(loaderArena));
+}
+
 esp_err_t delete_or_change_sched_from_NVS(char* loadName, uint64_t date, uint8_t repetitions, uint8_t option)
 {
-    char loadKey[16];    
+    char loadKey[SCHED_LOAD_KEY_LEN];
     nvs_handle_t my_handle;
     esp_err_t err;
+    uint8_t changed = 0;
+    int loadNumber = find_load_number(loadName);
+    if (loadNumber < 0) return ESP_ERR_NOT_FOUND;
 
     // Open
-    err = nvs_open_from_partition("MyNvs", SCHEDULES_STORAGE_NAMESPACE, NVS_READWRITE, &my_handle);
+    err = storage_open(SCHEDULES_STORAGE_NAMESPACE, &my_handle);
     if (err != ESP_OK) return err;
-    for(int x = 0; x < 2; x++)
+    // The ON and OFF lists change together or not at all
+    storage_txn_begin(my_handle);
+    for(int x = 0; x < 2 && err == ESP_OK; x++)
     {
-        memset(loadKey, 0, sizeof(loadKey));
-        if(x == 0) sprintf(loadKey, "%sON",loadName);
-        else sprintf(loadKey, "%sOFF",loadName);
+        sched_loads_sched_key(loadNumber, x == 0, loadKey);
         // Read run time blob for Load Name ON/OFF
-        size_t required_size = 0;  // value will default to 0, if not set yet in NVS
-        size_t newRequired_size = 0;
         uint8_t dateFound = 0;
-        // obtain required memory space to store blob being read from NVS
-        err = nvs_get_blob(my_handle, loadKey, NULL, &required_size);
-        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) return err;
-        printf("Schedulements for %s:\n",loadKey);
-        if (required_size == 0) {
-            printf("Nothing saved yet!\n");
-        } else {
-            Date_and_Reps* loadSchedList = malloc(required_size);
-            err = nvs_get_blob(my_handle, loadKey, loadSchedList, &required_size);
-            if (err != ESP_OK) {
-                free(loadSchedList);
-                return err;
-            }
-            for (int i = 0; i < required_size / sizeof(Date_and_Reps); i++) {              
-                if(loadSchedList[i].date == date) 
+        err = read_sched_list(my_handle, loadKey, &schedScratch);
+        if (err != ESP_OK) break;
+        SCHED_LOG("Schedulements for %s%s:\n", loadName, x == 0 ? "ON" : "OFF");
+        if (schedScratch.count == 0) {
+            SCHED_LOG("Nothing saved yet!\n");
+            continue;
+        }
+        // Backwards, so removing an event does not skip the next one
+        for (int i = schedScratch.count - 1; i >= 0; i--) {
+            Date_and_Reps* event = &schedScratch.items[i];
+            if(event->date == date) 
+            {
+                dateFound = 1;
+                if(option == 0)
+                {
+                    SCHED_LOG("Deleting date %lld...\n", event->date);
+                    FIXED_LIST_REMOVE(&schedScratch, i);
+                }
+                else if(option == 1)
                 {
-                    dateFound = 1;
-                    if(option == 0)
-                    {
-                        newRequired_size = required_size - sizeof(Date_and_Reps);
-                        printf("Deleting date %lld...\n", loadSchedList[i].date);
-                    }
-                    else if(option == 1)
-                    {
-                        newRequired_size = required_size;
-                        printf("Changing repetition of date %lld from %d to %d...\n", loadSchedList[i].date, loadSchedList[i].repetions, repetitions);
-                    }
+                    SCHED_LOG("Changing repetition of date %lld from %d to %d...\n", event->date, event->repetions, repetitions);
+                    event->repetions = repetitions;
                 }
             }
-            if(dateFound == 1) //Date to be excluded found
+        }
+        if(dateFound == 0)
+        {
+            SCHED_LOG("Date not found on %s list.\n",loadKey);
+            continue;
+        }
+        // Date to be excluded found
+        if(schedScratch.count == 0) err = storage_erase_key(my_handle, loadKey);
+        else err = storage_set_blob(my_handle, loadKey, schedScratch.items, schedScratch.count * sizeof(Date_and_Reps));
+        changed = 1;
+    }
+    if (err == ESP_OK && changed) err = storage_txn_commit(my_handle);
+    else storage_txn_abort(my_handle);
+
+    // Close
+    storage_close(my_handle);
+    if (err != ESP_OK) return err;
+    if (changed && option == 0) SCHED_LOG("Date %lld for load %s deleted successfully.\n", date, loadName);
+    else if (changed && option == 1) SCHED_LOG("Repetitions %d for Date %lld for load %s changed successfully.\n", repetitions, date, loadName);
+    return ESP_OK;
+}
+
+/* Remove from NVS every ON and OFF schedule of a load whose date is
+   less than or equal to "now", rewriting each key at most once and
+   committing both keys in one transaction. The number of events removed is
+   returned in "purged" when it is not NULL.
+ */
+esp_err_t purge_due_scheds_from_NVS(uint8_t loadNumber, uint64_t now, uint16_t* purged)
+{
+    char loadKey[SCHED_LOAD_KEY_LEN];
+    nvs_handle_t my_handle;
+    esp_err_t err;
+    uint8_t changed = 0;
+    if(purged != NULL) *purged = 0;
+
+    // Open
+    err = storage_open(SCHEDULES_STORAGE_NAMESPACE, &my_handle);
+    if (err != ESP_OK) return err;
+    storage_txn_begin(my_handle);
+    for(int x = 0; x < 2; x++)
+    {
+        sched_loads_sched_key(loadNumber, x == 0, loadKey);
+        err = read_sched_list(my_handle, loadKey, &schedScratch);
+        if (err != ESP_OK) break;
+        if (schedScratch.count == 0) continue;
+
+        Date_and_Reps* loadSchedList = schedScratch.items;
+        // Keep only the events still in the future
+        int numOfEvents = schedScratch.count;
+        int kept = 0;
+        for(int i = 0; i < numOfEvents; i++)
+        {
+            if(loadSchedList[i].date > now) loadSchedList[kept++] = loadSchedList[i];
+        }
+        if(kept == numOfEvents) err = ESP_OK;
+        else if(kept == 0) err = storage_erase_key(my_handle, loadKey);
+        else err = storage_set_blob(my_handle, loadKey, loadSchedList, kept * sizeof(Date_and_Reps));
+        if (err != ESP_OK) break;
+        if(kept != numOfEvents)
+        {
+            SCHED_LOG("%d due dates purged from %s.\n", numOfEvents - kept, loadKey);
+            if(purged != NULL) *purged += numOfEvents - kept;
+            changed = 1;
+        }
+    }
+    if (err == ESP_OK && changed) err = storage_txn_commit(my_handle);
+    else storage_txn_abort(my_handle);
+
+    // Close
+    storage_close(my_handle);
+    return err;
+}
+
+// Difference between the actual and the scheduled fire time, in microseconds
+int64_t fireJitterMin = INT64_MAX;
+int64_t fireJitterMax = INT64_MIN;
+int64_t fireJitterSum = 0;
+uint32_t fireJitterCount = 0;
+// Upper limits (us) of the jitter histogram buckets, the last bucket has no limit
+const int64_t fireJitterBucketLimits[] = {1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000};
+#define FIRE_JITTER_BUCKETS (sizeof(fireJitterBucketLimits) / sizeof(fireJitterBucketLimits[0]) + 1)
+uint32_t fireJitterHistogram[FIRE_JITTER_BUCKETS];
+
+void print_fire_jitter_histogram()
+{
+    uint32_t fires = fireJitterCount;
+    printf("Fire jitter of %d punctual events", fires);
+    if(fires > 0) printf(" (min %lld / avg %lld / max %lld us)", fireJitterMin, fireJitterSum / fires, fireJitterMax);
+    printf(":\n");
+    for(int i = 0; i < FIRE_JITTER_BUCKETS; i++)
+    {
+        if(i < FIRE_JITTER_BUCKETS - 1) printf("  < %7lld us: %d\n", fireJitterBucketLimits[i], fireJitterHistogram[i]);
+        else printf(" >= %7lld us: %d\n", fireJitterBucketLimits[i - 1], fireJitterHistogram[i]);
+    }
+}
+
+void fire_load_event(const Sched_Load* load, uint8_t loadState, uint64_t date, uint64_t time)
+{
+    int64_t jitter = time_service_now_us() - date * USEC_PER_SEC;
+    if(date == time)
+    {
+        if(jitter < fireJitterMin) fireJitterMin = jitter;
+        if(jitter > fireJitterMax) fireJitterMax = jitter;
+        fireJitterSum += jitter;
+        fireJitterCount++;
+        int bucket = 0;
+        while(bucket < FIRE_JITTER_BUCKETS - 1 && jitter >= fireJitterBucketLimits[bucket]) bucket++;
+        fireJitterHistogram[bucket]++;
+        SCHED_LOG("Turning %s load %s at %lld, jitter %lld us (min %lld / avg %lld / max %lld)\n", loadState ? "ON" : "OFF", load->loadName, time,
+            jitter, fireJitterMin, fireJitterSum / fireJitterCount, fireJitterMax);
+    }
+    else SCHED_LOG("Turning %s load %s at %lld (scheduled for %lld)\n", loadState ? "ON" : "OFF", load->loadName, time, date);
+}
+
+#if SCHED_WINDOW_EVENTS
+/* Loads whose window ended before the time handled, by load number: their
+   events after heldAfter were not resident, so each is fired once a
+   refill publishes it, however late, instead of going through the
+   catch-up policy. Scheduler task only. */
+static uint8_t isHeld[CONFIG_SCHED_MAX_LOADS];
+static uint64_t heldAfter[CONFIG_SCHED_MAX_LOADS];
+static uint8_t numberOfHeld = 0;
+
+static void fire_held_events(const Sched_Snapshot* snapshot, uint64_t time, uint64_t handledUpTo)
+{
+    for(int n = 0; n < CONFIG_SCHED_MAX_LOADS && numberOfHeld > 0; n++)
+    {
+        if(!isHeld[n]) continue;
+        int loadId = sched_snapshot_find_load(snapshot, n);
+        if(loadId >= 0)
+        {
+            // The load's view is in date order, the held events are the ones up to handledUpTo
+            const Sched_Load* load = &snapshot->loads[loadId];
+            for(uint32_t i = 0; i < load->numOfEvents; i++)
             {
-                if(newRequired_size == 0)
-                {
-                    free(loadSchedList);
-                    err = nvs_erase_key(my_handle, loadKey);
-                    if (err != ESP_OK) return err;
-                    // Commit
-                    err = nvs_commit(my_handle);
-                    if (err != ESP_OK) return err; 
-
-                    printf("Date %lld deleted for load %s successfully. No dates left for that key.\n", date, loadKey);
-
-                    print_nvs_stats("MyNvs");   
-                } 
-                else
-                {
-                    Date_and_Reps* newLoadSchedList = malloc(newRequired_size);
-                    for(int i = 0, j = 0; i < required_size/sizeof(Date_and_Reps);i++)
-                    {
-                        if(option == 0)
-                        {
-                            if(loadSchedList[i].date != date) 
-                            {
-                                newLoadSchedList[j].date = loadSchedList[i].date;
-                                newLoadSchedList[j].repetions = loadSchedList[i].repetions;
-                                j++;
-                            }
-                        }
-                        else if(option == 1)
-                        {
-                            newLoadSchedList[j].date = loadSchedList[i].date;
-                            if(loadSchedList[i].date == date) 
-                            {
-                                newLoadSchedList[j].repetions = repetitions;
-                            }
-                            else newLoadSchedList[j].repetions = loadSchedList[i].repetions;
-                            j++;
-                        }
-                    }
-                    err = nvs_set_blob(my_handle, loadKey, newLoadSchedList, newRequired_size);
-                    free(loadSchedList);
-                    free(newLoadSchedList);                    
-
-                    if (err != ESP_OK) return err;
-
-                    // Commit
-                    err = nvs_commit(my_handle);
-                    if (err != ESP_OK) return err; 
-
-                    if(option == 0) printf("Date %lld for load %s deleted successfully.\n", date, loadKey);
-                    else if(option == 1) printf("Repetitions %d for Date %lld for load %s changed successfully.\n", repetitions , date, loadKey);
-
-                    print_nvs_stats("MyNvs");
-                }                           
+                uint32_t e = snapshot->loadEvents[load->firstEvent + i];
+                if(snapshot->dates[e] > handledUpTo) break;
+                if(snapshot->dates[e] > heldAfter[n]) fire_load_event(load, snapshot->direction[e], snapshot->dates[e], time);
             }
-            else 
+            if(load->windowEnd < handledUpTo)
             {
-                printf("Date not found on %s list.\n",loadKey);            
-                free(loadSchedList);
+                heldAfter[n] = load->windowEnd;
+                continue;
             }
         }
+        // Refilled past the time handled, or deleted
+        isHeld[n] = 0;
+        numberOfHeld--;
     }
-   
-    // Close
-    nvs_close(my_handle);
-    return ESP_OK;
 }
 
-void free_load_loads_events_array(LoadEvent* loadsEventsLoaded)
+static void hold_ended_windows(const Sched_Snapshot* snapshot, uint64_t time)
+{
+    if(snapshot->windowEnd >= time) return;
+    for(int l = 0; l < snapshot->numberOfLoads; l++)
+    {
+        const Sched_Load* load = &snapshot->loads[l];
+        if(load->windowEnd >= time || isHeld[load->loadNumber]) continue;
+        isHeld[load->loadNumber] = 1;
+        heldAfter[load->loadNumber] = load->windowEnd;
+        numberOfHeld++;
+    }
+}
+#endif
+
+/* Handle the events that became due (date <= time) since the previous
+   wake, when everything up to "handledUpTo" was handled. Due events are a
+   prefix of the date-sorted table, so this is two binary searches plus a
+   scan of the new due events only.
+   Events late by no more than CONFIG_SCHED_CATCHUP_TOLERANCE_S are fired
+   normally, older ones (missed while the device was rebooting or the task
+   was delayed) are handled according to the catch-up policy. The loads
+   with due events are then sent to the command task to be purged from NVS
+   in one batch; until it publishes a table without them they are skipped.
+   With windows, a load whose window ended before "time" is held on its own
+   (see heldAfter): the others keep firing on time, it is purged only up to
+   its windowEnd and the purge asks for the refill.
+ */
+void handle_due_events(const Sched_Snapshot* snapshot, uint64_t time, uint64_t handledUpTo, uint8_t newVersion)
 {
-    for(int i = 0; i < numberOfLoadsGlobal; i++)
+    uint32_t due = sched_count_due(snapshot->dates, snapshot->numberOfEvents, time);
+    uint32_t first = sched_count_due(snapshot->dates, snapshot->numberOfEvents, handledUpTo);
+    uint64_t missedBefore = time > CONFIG_SCHED_CATCHUP_TOLERANCE_S ? time - CONFIG_SCHED_CATCHUP_TOLERANCE_S : 0;
+    uint32_t missedEnd = missedBefore > 0 ? sched_count_due(snapshot->dates, snapshot->numberOfEvents, missedBefore - 1) : 0;
+    uint32_t loadsSeen[256 / 32];
+
+    if(first > due) first = due;    // clock set back
+    if(missedEnd < first) missedEnd = first;
+    if(missedEnd > due) missedEnd = due;
+
+#if SCHED_WINDOW_EVENTS
+    if(numberOfHeld > 0) fire_held_events(snapshot, time, handledUpTo);
+#endif
+    // Missed events come first, so they are handled before any punctual one
+    if(missedEnd > first)
+    {
+#if CONFIG_SCHED_CATCHUP_ALL
+        for(uint32_t e = first; e < missedEnd; e++)
+            fire_load_event(&snapshot->loads[snapshot->loadId[e]], snapshot->direction[e], snapshot->dates[e], time);
+#elif CONFIG_SCHED_CATCHUP_LATEST
+        // Backwards, so the first event seen for each load is its latest state
+        memset(loadsSeen, 0, sizeof(loadsSeen));
+        for(uint32_t e = missedEnd; e-- > first;)
+        {
+            uint8_t loadId = snapshot->loadId[e];
+            if(loadsSeen[loadId / 32] & (1u << (loadId % 32))) continue;
+            loadsSeen[loadId / 32] |= 1u << (loadId % 32);
+            fire_load_event(&snapshot->loads[loadId], snapshot->direction[e], snapshot->dates[e], time);
+        }
+#endif
+        SCHED_LOG("%d missed events handled by the catch-up policy.\n", missedEnd - first);
+    }
+    for(uint32_t e = missedEnd; e < due; e++)
+        fire_load_event(&snapshot->loads[snapshot->loadId[e]], snapshot->direction[e], snapshot->dates[e], time);
+#if SCHED_WINDOW_EVENTS
+    hold_ended_windows(snapshot, time);
+    uint32_t dueOfLoad[CONFIG_SCHED_MAX_LOADS];
+    memset(dueOfLoad, 0, sizeof(dueOfLoad));
+    for(uint32_t e = 0; e < due; e++) dueOfLoad[snapshot->loadId[e]]++;
+#endif
+
+    // NVS is only written by the command task, which purges the handled events. Requests
+    // are repeated for every new table version still holding them, in case one was lost.
+    if(due == first && !(newVersion && due > 0)) return;
+    memset(loadsSeen, 0, sizeof(loadsSeen));
+    for(uint32_t e = 0; e < due; e++)
     {
-        free(loadsEventsLoaded[i].eventsON);
-        free(loadsEventsLoaded[i].eventsOFF);
+        uint8_t loadId = snapshot->loadId[e];
+        if(loadsSeen[loadId / 32] & (1u << (loadId % 32))) continue;
+        loadsSeen[loadId / 32] |= 1u << (loadId % 32);
+        const Sched_Load* load = &snapshot->loads[loadId];
+        Sched_Purge purge;
+        purge.loadNumber = load->loadNumber;
+        // Events past the window are still in NVS only, not fired yet
+        purge.upTo = time < load->windowEnd ? time : load->windowEnd;
+        purge.refill = 0;
+#if SCHED_WINDOW_EVENTS
+        purge.refill = load->windowEnd != UINT64_MAX && (load->windowEnd < time || load->numOfEvents - dueOfLoad[loadId] <= SCHED_WINDOW_EVENTS / 2);
+#endif
+        if(!spsc_queue_push(&schedPurgeQueue, &purge)) SCHED_LOG("Purge queue full, due dates of load %s stay in NVS for now.\n", load->loadName);
     }
 }
+
+/* Ticks to sleep until the next event not handled yet, at most one
+   second so clock changes are picked up.
+ */
+TickType_t ticks_until_next_event(const Sched_Snapshot* snapshot, uint64_t handledUpTo)
+{
+    uint64_t now = time_service_now_us();
+    uint64_t next = now + USEC_PER_SEC;
+    uint32_t nextEvent = sched_count_due(snapshot->dates, snapshot->numberOfEvents, handledUpTo);
+    if(nextEvent < snapshot->numberOfEvents && snapshot->dates[nextEvent] * USEC_PER_SEC < next)
+        next = snapshot->dates[nextEvent] * USEC_PER_SEC;
+    if(next <= now) return 1;
+    // Round up, waking before the event would only cost another wakeup
+    TickType_t ticks = (next - now + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000);
+    return ticks > 0 ? ticks : 1;
+}
+
+/* Publish the snapshot resulting from a change already committed to NVS
+   and wake the scheduler up. Writers are serialized by the snapshot write
+   lock; the scheduler never takes it.
+ */
+void commit_sched_change(const Sched_Delta* delta)
+{
+    sched_snapshot_write_lock();
+    const Sched_Snapshot* current = sched_snapshot_current();
+    Sched_Snapshot* snapshot = sched_snapshot_apply(current, delta);
+    if(snapshot != NULL) sched_snapshot_publish(snapshot);
+    sched_snapshot_write_unlock();
+    if(scheduleTaskHandle != NULL) xTaskNotifyGive(scheduleTaskHandle);
+}
+
+/* Date up to which the scheduler has fired (or skipped) every event, for
+   the command task. Seconds fit 32 bits until 2106; a later date reads as
+   UINT32_MAX, which only holds work back. */
+static atomic_uint schedHandledUpTo = 0;
+
+uint64_t sched_handled_up_to(void)
+{
+    return atomic_load(&schedHandledUpTo);
+}
+
 void execute_schedule_action()
 {
-    LoadEvent* loadsEventsLoaded = return_sched_from_NVS(); //=NULL
     uint64_t time = 0;
-    esp_err_t err;
+    uint64_t handledUpTo = 0;   // every event up to this date was already fired or skipped
+    uint32_t lastVersion = 0;
+
+    sched_log_register_scheduler_task();
     while(1)
     {
         // if(nvsLoaded == 0)
@@ -523,36 +941,41 @@ void execute_schedule_action()
         //     loadEventsLoaded = return_sched_from_NVS();
         //     nvsLoaded = 1;
         // }
-        time = (xTaskGetTickCount() * portTICK_PERIOD_MS)/1000;
+        // Lock free: the snapshot cannot change or be freed until read_end
+        const Sched_Snapshot* snapshot = sched_snapshot_read_begin(SCHED_READER_SCHEDULER);
+        time = time_service_now_s();
         //printf("Time = %d\n",time);
-        for(int i = 0; i < numberOfLoadsGlobal; i++)
-        {            
-            for(int j = 0; j < loadsEventsLoaded[i].numOfEventsON; j++)
-            {
-                if(time == loadsEventsLoaded[i].eventsON[j].date) 
-                {
-                    printf("Turning ON load %s at %lld\n", loadsEventsLoaded[i].loadName, time);
-                    err = delete_or_change_sched_from_NVS(loadsEventsLoaded[i].loadName, time, _NULL, 0);
-                    if(err == ESP_OK) printf("Time %lld deleted from NVS.\n", time);
-                    else printf("Not possible to delete from NVS.\n");
-                }
-            }
-            for(int j = 0; j < loadsEventsLoaded[i].numOfEventsOFF; j++)
-            {
-                if(time == loadsEventsLoaded[i].eventsOFF[j].date) 
-                {
-                    printf("Turning OFF load %s at %lld\n", loadsEventsLoaded[i].loadName, time);
-                    err = delete_or_change_sched_from_NVS(loadsEventsLoaded[i].loadName, time, _NULL, 0);
-                    if(err == ESP_OK) printf("Time %lld deleted from NVS.\n", time);
-                    else printf("Not possible to delete from NVS.\n");
-                }
-                
-            }
-        }
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        // Runs on boot and on every wake, so events whose second passed while
+        // the task was not running are still fired (or skipped) and purged
+        handle_due_events(snapshot, time, handledUpTo, snapshot->version != lastVersion);
+        handledUpTo = time;
+        atomic_store(&schedHandledUpTo, handledUpTo < UINT32_MAX ? (uint32_t) handledUpTo : UINT32_MAX);
+        lastVersion = snapshot->version;
+        // A held load wakes the task up when its refill is published
+        TickType_t ticks = ticks_until_next_event(snapshot, handledUpTo);
+        sched_snapshot_read_end(SCHED_READER_SCHEDULER);
+        // Sleep until the next event or until a new table is published
+        ulTaskNotifyTake(pdTRUE, ticks);
     }    
 }
 
+static void write_export_chunk(const char* chunk, size_t length, void* context)
+{
+    fwrite(chunk, 1, length, stdout);
+}
+
+/* One message of a document being imported (command 18). Messages are
+   queued in order and a write is refused (ATT error) while the queue is
+   full, so the sender retries it: no chunk is lost while this task writes
+   the previous loads to NVS. */
+static void import_chunk(char* chunk)
+{
+    storage_set_command(18);
+    Sched_Import_State state = sched_transfer_import_feed(chunk, strlen(chunk));
+    storage_set_command(STORAGE_NO_COMMAND);
+    if(state == SCHED_IMPORT_MORE) SCHED_LOG("Import: chunk of %d bytes read, %u loads imported.\n", strlen(chunk), sched_transfer_import_loads());
+}
+
 void process_command(char* jsonCommand)
 {
     cJSON *cmd = NULL;
@@ -567,7 +990,12 @@ void process_command(char* jsonCommand)
     
     //printf("Typed JSON: %s\n",stringJson);
         
+    TRACE_START(commandStart);
+    sched_heap_command_begin();
+    sched_stack_command_begin();
+    TRACE_START(parseStart);
     cmd_json = cJSON_Parse(jsonCommand);
+    TRACE_END(TRACE_PARSE, parseStart);
     command = 99;
 
     if (cmd_json == NULL)
@@ -604,23 +1032,172 @@ void process_command(char* jsonCommand)
     // else printf("date: \"%d\"\n", date->valueint);    
 
     pin = cJSON_GetObjectItemCaseSensitive(cmd_json, "p");             
+
+    // Every change committed to NVS is also sent to the scheduler task
+    Sched_Delta delta;
+    memset(&delta, 0, sizeof(delta));
+    if(cJSON_IsString(loadName))
+    {
+        strncpy(delta.loadName, loadName->valuestring, sizeof(delta.loadName) - 1);
+        int loadNumber = sched_loads_find(loadName->valuestring);
+        if(loadNumber >= 0) delta.loadNumber = loadNumber;
+    }
+    if(cJSON_IsNumber(date)) delta.date = (uint64_t)date->valuedouble;
     
+    // Flash wear of the writes below is accounted to this command
+    storage_set_command(command);
+
     if(command == 0) 
     {
         if(date == NULL || repetions == NULL) printf("Date or Repetions missing. Please type the entire command.\n");
-        else ESP_ERROR_CHECK(save_schedule_time(loadName->valuestring, loadState->valueint, date->valueint, repetions->valueint));
+        else
+        {
+            // Refused when the load is full (CONFIG_SCHED_MAX_EVENTS_PER_LOAD) or the date conflicts
+            uint8_t merged;
+            if(save_schedule_time(loadName->valuestring, loadState->valueint, (uint64_t)date->valuedouble, repetions->valueint, &merged) == ESP_OK)
+            {
+                delta.type = merged ? SCHED_DELTA_CHANGE_REPS : SCHED_DELTA_ADD_EVENT;
+                delta.loadState = loadState->valueint != 0;
+                delta.repetions = repetions->valueint;
+                commit_sched_change(&delta);
+            }
+        }
+    }
+    else if(command == 1) print_load_sched_list(loadName->valuestring);
+    else if(command == 2)
+    {
+        if(register_new_load(loadName->valuestring, pin->valueint) == ESP_OK)
+        {
+            delta.type = SCHED_DELTA_ADD_LOAD;
+            delta.loadNumber = sched_loads_find(loadName->valuestring);
+            delta.pinNumber = pin->valueint;
+            commit_sched_change(&delta);
+        }
     }
-    else if(command == 1) ESP_ERROR_CHECK(print_load_sched_list(loadName->valuestring));
-    else if(command == 2) register_new_load(loadName->valuestring, pin->valueint);
     else if(command == 3) read_load_list();
-    else if(command == 4) return_sched_from_NVS();
-    else if(command == 5) delete_or_change_sched_from_NVS(loadName->valuestring, date->valueint, _NULL, 0);
-    else if(command == 6) delete_or_change_sched_from_NVS(loadName->valuestring, date->valueint, repetions->valueint, 1);
+    else if(command == 4)
+    {
+        // The fresh table replaces the current one
+        delta.type = SCHED_DELTA_RELOAD;
+        delta.loads = return_sched_from_NVS(&delta.numberOfLoads);
+        if(delta.loads != NULL) commit_sched_change(&delta);
+    }
+    else if(command == 5)
+    {
+        if(delete_or_change_sched_from_NVS(loadName->valuestring, (uint64_t)date->valuedouble, _NULL, 0) == ESP_OK)
+        {
+            delta.type = SCHED_DELTA_DELETE_EVENT;
+            commit_sched_change(&delta);
+        }
+    }
+    else if(command == 6)
+    {
+        if(delete_or_change_sched_from_NVS(loadName->valuestring, (uint64_t)date->valuedouble, repetions->valueint, 1) == ESP_OK)
+        {
+            delta.type = SCHED_DELTA_CHANGE_REPS;
+            delta.repetions = repetions->valueint;
+            commit_sched_change(&delta);
+        }
+    }
+    else if(command == 7)
+    {
+        // Set time: "d" is the epoch time in seconds, optional "u" adds microseconds
+        cJSON *micros = cJSON_GetObjectItemCaseSensitive(cmd_json, "u");
+        if(!cJSON_IsNumber(date)) printf("Date missing. Please type the entire command.\n");
+        else if(micros != NULL && !cJSON_IsNumber(micros)) printf("ERROR: Parameter \"u\" is NOT a NUMBER!\n");
+        else
+        {
+            esp_err_t err = time_service_set_time((uint64_t)date->valuedouble * USEC_PER_SEC + (micros != NULL ? micros->valueint : 0));
+            if(err != ESP_OK) printf("Error (%s) saving the clock checkpoint, the time is set until the next reset!\n", esp_err_to_name(err));
+            // Events the new time made due are handled now, not at the scheduler's next wake
+            if(scheduleTaskHandle != NULL) xTaskNotifyGive(scheduleTaskHandle);
+        }
+    }
+    else if(command == 8) print_fire_jitter_histogram();
+    else if(command == 9)
+    {
+        // NVS wear and cache report, "r":1 also clears the counters
+        print_nvs_stats("MyNvs");
+        storage_print_wear_stats();
+        sched_compact_print_stats();
+        sched_image_print_stats();
+        sched_window_print_stats();
+        sched_cache_print_stats();
+        if(cJSON_IsNumber(repetions) && repetions->valueint == 1)
+        {
+            storage_reset_wear_stats();
+            sched_cache_reset_stats();
+        }
+    }
+    else if(command == 10)
+    {
+        // Phase latency report, "r":1 also dumps the trace ring and "r":2 clears it
+        sched_trace_print();
+        if(cJSON_IsNumber(repetions) && repetions->valueint == 1) sched_trace_dump();
+        if(cJSON_IsNumber(repetions) && repetions->valueint == 2) sched_trace_reset();
+    }
+#if CONFIG_SCHED_BENCHMARK
+    else if(command == 11)
+    {
+        // Benchmark: "n" loads of "e" events each
+        cJSON *loads = cJSON_GetObjectItemCaseSensitive(cmd_json, "n");
+        cJSON *events = cJSON_GetObjectItemCaseSensitive(cmd_json, "e");
+        sched_benchmark_run(cJSON_IsNumber(loads) ? loads->valueint : 0, cJSON_IsNumber(events) ? events->valueint : 0);
+    }
+#endif
+    else if(command == 12)
+    {
+        // Command recorder: "r" 0 dumps the trace, 1 replays it at original speed, 2 at maximum speed, 3 clears it
+        uint8_t action = cJSON_IsNumber(repetions) ? repetions->valueint : 0;
+        if(action == 1) sched_recorder_replay(RECORDER_REPLAY_ORIGINAL_SPEED);
+        else if(action == 2) sched_recorder_replay(RECORDER_REPLAY_MAX_SPEED);
+        else if(action == 3) sched_recorder_clear();
+        else sched_recorder_dump();
+    }
+    else if(command == 13)
+    {
+        // Heap report per command, "r":1 also clears it
+        sched_heap_print_stats();
+        if(cJSON_IsNumber(repetions) && repetions->valueint == 1) sched_heap_reset_stats();
+    }
+    else if(command == 14)
+    {
+        // Stack use per task and per command with recommended sizes, "r":1 clears the per-command part
+        sched_stack_print_report();
+        if(cJSON_IsNumber(repetions) && repetions->valueint == 1) sched_stack_reset_stats();
+    }
+    else if(command == 15 || command == 16)
+    {
+        // Events of all loads by date, only those on pin "p" if given:
+        // 15 the next "r" (default 10), 16 those from "d" to "t" (epoch seconds)
+        int pinFilter = cJSON_IsNumber(pin) && pin->valueint >= 0 && pin->valueint <= UINT8_MAX ? pin->valueint : SCHED_QUERY_ANY_PIN;
+        cJSON *to = cJSON_GetObjectItemCaseSensitive(cmd_json, "t");
+        if(command == 15) sched_query_print_next(cJSON_IsNumber(repetions) && repetions->valueint > 0 ? repetions->valueint : 10, pinFilter);
+        else if(!cJSON_IsNumber(date) || !cJSON_IsNumber(to)) printf("Range start \"d\" or end \"t\" missing. Please type the entire command.\n");
+        else sched_query_print_range((uint64_t)date->valuedouble, (uint64_t)to->valuedouble, pinFilter);
+    }
+    else if(command == 17)
+    {
+        // Export of every load and its schedules as one JSON document, see sched_transfer.h
+        uint32_t exported = sched_transfer_export(write_export_chunk, NULL);
+        SCHED_LOG("Exported %u bytes.\n", exported);
+    }
+    else if(command == 18)
+    {
+        // Import: the messages that follow are the document, in chunks of any size
+        sched_transfer_import_begin();
+        SCHED_LOG("Import started, send the document.\n");
+    }
     else printf("Command not recognized!");                
     
+    storage_set_command(STORAGE_NO_COMMAND);
+
 end:
-    printf("Command Processed successfully!\nType the next command: "); 
+    SCHED_LOG("Command Processed successfully!\nType the next command: "); 
     cJSON_Delete(cmd_json);
+    sched_heap_command_end(command);
+    sched_stack_command_end(command);
+    TRACE_END(TRACE_COMMAND, commandStart);
     //system ("pause");
 }
 
@@ -650,19 +1227,63 @@ void receiveCommand()
 void task_process_BLE_received_command()
 {
     char *commandReceived = "";
+    Sched_Purge purge;
+    esp_err_t err;
 
     while (1)
     {           
-        xQueueReceive(xQueue_BLE_Received_Data, (void *) &commandReceived, portMAX_DELAY);
-        printf("Received in the task: task_process_BLE_received_command: %s\nAnd his data lenght: %d\n",commandReceived, strlen(commandReceived));
-        process_command(commandReceived);        
-              
+        if(xQueueReceive(xQueue_BLE_Received_Data, (void *) &commandReceived, pdMS_TO_TICKS(CONFIG_SCHED_PURGE_POLL_MS)) == pdTRUE)
+        {
+            TRACE_END(TRACE_BLE_RECEIVE, sched_trace_received_at());
+            // No document has an object starting with "c", so such a message is a command cancelling the import
+            if(sched_transfer_import_active() && strncmp(commandReceived, "{\"c\":", 5) == 0) sched_transfer_import_cancel("cancelled by a command");
+            if(sched_transfer_import_active()) import_chunk(commandReceived);
+            else
+            {
+                sched_recorder_record(commandReceived);
+                SCHED_LOG("Received in the task: task_process_BLE_received_command, data lenght %d:\n", strlen(commandReceived));
+                SCHED_LOG_TEXT(commandReceived);
+                process_command(commandReceived);
+            }
+        }
+        else
+        {
+            sched_transfer_import_poll();
+            sched_compact_step();
+            // Once the schedules are quiet, the table is saved for the next boot
+            if(sched_image_is_due()) save_boot_image();
+        }
+        // All NVS writes happen in this task, including the purge of events fired by the scheduler
+        while(spsc_queue_pop(&schedPurgeQueue, &purge))
+        {
+            // A load deleted since the event fired has nothing left to purge
+            const Load_Record* load = sched_loads_get(purge.loadNumber);
+            if(load == NULL) continue;
+            err = purge_due_scheds_from_NVS(purge.loadNumber, purge.upTo, NULL);
+            if(err != ESP_OK) SCHED_LOG("Error (%s) purging due dates of load %s from NVS!\n", esp_err_to_name(err), load->name);
+            else
+            {
+                Sched_Delta delta;
+                memset(&delta, 0, sizeof(delta));
+                delta.type = SCHED_DELTA_PURGE;
+                delta.loadNumber = purge.loadNumber;
+                strcpy(delta.loadName, load->name);
+                delta.date = purge.upTo;
+                commit_sched_change(&delta);
+                if(purge.refill) err = sched_window_refill(purge.loadNumber);
+                if(err != ESP_OK) SCHED_LOG("Error (%s) refilling the window of load %s!\n", esp_err_to_name(err), load->name);
+            }
+        }
+        // Any other drained window (a refill that failed, events deleted) is refilled here
+        sched_window_step();
+        time_service_checkpoint();
     }
 }
 
 void app_main()
 {
     //Hello 3
+    int64_t bootStart = esp_timer_get_time();
     esp_err_t err = nvs_flash_init_partition("MyNvs");
     if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
         // NVS partition was truncated and needs to be erased
@@ -672,9 +1293,45 @@ void app_main()
     }
     ESP_ERROR_CHECK( err );
 
+    // Every write to the schedules from here on invalidates the boot image
+    sched_image_init();
+    // ... and the cached copy of the list written
+    sched_cache_init();
+
+    // Complete a schedule change interrupted by a reset, a single lookup otherwise
+    int64_t recoverStart = esp_timer_get_time();
+    err = storage_recover(SCHEDULES_STORAGE_NAMESPACE);
+    if(err != ESP_OK) printf("Error (%s) recovering the schedules!\n", esp_err_to_name(err));
+    printf("Schedule recovery took %lld us.\n", esp_timer_get_time() - recoverStart);
+
+    // cJSON and the schedule buffers allocate through the accounted heap
+    sched_heap_init();
+
+    // Boot logs are rendered by the logger task as well
+    sched_log_init();
+
+    time_service_init();
+
+    xQueue_BLE_Received_Data = xQueueCreateStatic(BLE_MESSAGE_QUEUE_LEN, sizeof(char *), bleQueueStorage, &bleQueueBuffer);
+
     initializaton_BLE_function();
 
-    xQueue_BLE_Received_Data = xQueueCreate( 1, sizeof( char *) );
+    // Load numbers, migrating the loads saved by older firmware
+    err = sched_loads_init();
+    if(err != ESP_OK) printf("Error (%s) reading the load registry!\n", esp_err_to_name(err));
+
+    // An import cut by a reset is undone before the table is read
+    err = sched_transfer_recover();
+    if(err != ESP_OK) printf("Error (%s) rolling back an import!\n", esp_err_to_name(err));
+
+    // The scheduler starts from the table read at boot
+    sched_snapshot_init();
+    Sched_Delta bootTable;
+    memset(&bootTable, 0, sizeof(bootTable));
+    bootTable.type = SCHED_DELTA_RELOAD;
+    bootTable.loads = return_sched_from_NVS(&bootTable.numberOfLoads);
+    if(bootTable.loads != NULL) commit_sched_change(&bootTable);
+    printf("Scheduler table ready %lld us after the NVS init.\n", esp_timer_get_time() - bootStart);
 
     // xTaskCreate(
     // receiveCommand                     /* Funcao a qual esta implementado o que a tarefa deve fazer */
@@ -684,21 +1341,37 @@ void app_main()
     // ,  3                            /* Prioridade */
     // ,  NULL );                      /* Handle da tarefa, opcional (nesse caso, não há) */
 
-     xTaskCreate(
+    // Command ingest and all NVS writes run on one core, the scheduler on the other,
+    // so a slow NVS rewrite never delays a scheduled action
+    TaskHandle_t commandTaskHandle = xTaskCreateStaticPinnedToCore(
     task_process_BLE_received_command                     /* Funcao a qual esta implementado o que a tarefa deve fazer */
     ,  "ProcessBLE_CMD"   /* Nome (para fins de debug, se necessário) */
-    ,  1024 * 2                         /* Tamanho da stack (em words) reservada para essa tarefa */
+    ,  CONFIG_SCHED_COMMAND_TASK_STACK  /* Tamanho da stack (em bytes) reservada para essa tarefa */
     ,  NULL                         /* Parametros passados (nesse caso, não há) */
-    ,  3                            /* Prioridade */
-    ,  NULL );                      /* Handle da tarefa, opcional (nesse caso, não há) */
+    ,  CONFIG_SCHED_COMMAND_TASK_PRIORITY                            /* Prioridade */
+    ,  commandTaskStack             /* Stack estatica */
+    ,  &commandTaskBuffer           /* TCB estatico */
+    ,  COMMAND_TASK_CORE );         /* Core onde a tarefa executa */
 
-    xTaskCreate(
+    scheduleTaskHandle = xTaskCreateStaticPinnedToCore(
     execute_schedule_action                     /* Funcao a qual esta implementado o que a tarefa deve fazer */
     ,  "ExecutingScheduleAction"   /* Nome (para fins de debug, se necessário) */
-    ,  1024 * 2                         /* Tamanho da stack (em words) reservada para essa tarefa */
+    ,  CONFIG_SCHED_SCHEDULER_TASK_STACK  /* Tamanho da stack (em bytes) reservada para essa tarefa */
     ,  NULL                         /* Parametros passados (nesse caso, não há) */
-    ,  3                            /* Prioridade */
-    ,  NULL );                      /* Handle da tarefa, opcional (nesse caso, não há) */
+    ,  CONFIG_SCHED_SCHEDULER_TASK_PRIORITY                            /* Prioridade */
+    ,  schedulerTaskStack           /* Stack estatica */
+    ,  &schedulerTaskBuffer         /* TCB estatico; o handle acorda a tarefa quando ha mudancas */
+    ,  SCHEDULER_TASK_CORE );       /* Core onde a tarefa executa */
+
+    sched_stack_register_task(commandTaskHandle, "ProcessBLE_CMD", "CONFIG_SCHED_COMMAND_TASK_STACK",
+                              commandTaskStack, CONFIG_SCHED_COMMAND_TASK_STACK);
+    sched_stack_register_task(scheduleTaskHandle, "ExecutingScheduleAction", "CONFIG_SCHED_SCHEDULER_TASK_STACK",
+                              schedulerTaskStack, CONFIG_SCHED_SCHEDULER_TASK_STACK);
+
+    uint32_t heapAllocations, heapLiveBytes;
+    sched_heap_get_totals(&heapAllocations, &heapLiveBytes);
+    printf("Static RAM reserved: %d of the %d bytes budget. Heap held by the command task: %u bytes, free heap %d bytes.\n",
+        SCHED_STATIC_RAM_BYTES, CONFIG_SCHED_RAM_BUDGET, heapLiveBytes, esp_get_free_heap_size());
 
     
     // gpio_pad_select_gpio(GPIO_NUM_0);
@@ -7,8 +7,74 @@
 #include "esp_system.h"
 #include "esp_event.h"
 
+#define SCHEDULES_STORAGE_NAMESPACE "schedList"
+#define LOADS_STORAGE_NAMESPACE "loadList"
+
+typedef struct events_dates_and_reps
+{
+    uint8_t repetions;
+    uint64_t date;
+}Date_and_Reps;
+
+typedef struct events_of_load
+{
+  char loadName[20];
+  uint8_t loadNumber;     // registry number, see sched_loads.h
+  uint8_t pinNumber;
+  Date_and_Reps* eventsON;
+  Date_and_Reps* eventsOFF;
+  uint16_t numOfEventsON;
+  uint16_t numOfEventsOFF;
+
+} LoadEvent;
+
+/* Schedule changes applied to the schedule table once committed to NVS */
+typedef enum
+{
+    SCHED_DELTA_ADD_EVENT,
+    SCHED_DELTA_DELETE_EVENT,
+    SCHED_DELTA_CHANGE_REPS,
+    SCHED_DELTA_ADD_LOAD,
+    SCHED_DELTA_PURGE,      // drops every date up to "date"
+    SCHED_DELTA_RELOAD,
+    SCHED_DELTA_WINDOW      // refilled window of a load, "loads" holds its lists
+} Sched_Delta_Type;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t loadState;
+    uint8_t repetions;
+    uint8_t pinNumber;
+    uint8_t loadNumber;     // registry number of the load changed
+    char loadName[20];
+    uint64_t date;
+    LoadEvent* loads;       // SCHED_DELTA_RELOAD: table replacing the current one, SCHED_DELTA_WINDOW: the load
+    uint8_t numberOfLoads;
+} Sched_Delta;
+
+/* Due events already fired by the scheduler, to be purged from NVS by the command task */
+typedef struct
+{
+    uint8_t loadNumber;
+    uint8_t refill;         // the load's window drained, its next events are read from NVS after the purge
+    uint64_t upTo;
+} Sched_Purge;
+
+void sort_sched_list(Date_and_Reps* schedList, uint16_t numOfEvents);
+esp_err_t save_schedule_time(char* loadName, int loadState, uint64_t schedTime, int repetions, uint8_t* merged);
+esp_err_t print_load_sched_list(char* loadName);
+void read_load_list();
+esp_err_t register_new_load(char* loadName, uint8_t pinNumber);
+LoadEvent* return_sched_from_NVS(uint8_t* numberOfLoadsRead);
+esp_err_t read_load_lists(uint8_t loadNumber, LoadEvent* load);
+void save_boot_image(void);
+esp_err_t delete_or_change_sched_from_NVS(char* loadName, uint64_t date, uint8_t repetitions, uint8_t option);
+esp_err_t purge_due_scheds_from_NVS(uint8_t loadNumber, uint64_t now, uint16_t* purged);
+void commit_sched_change(const Sched_Delta* delta);
+uint64_t sched_handled_up_to(void);
 void execute_schedule_action();
 void process_command(char* jsonCommand);
 QueueHandle_t xQueue_BLE_Received_Data;
 
-#endif
\ No newline at end of file
+#endif
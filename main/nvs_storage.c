@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "nvs.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+
+#include "nvs_storage.h"
+#include "sched_trace.h"
+
+/* NVS keeps 126 entries of 32 bytes per 4 kB page. A primitive value takes
+   one entry, a blob takes one index entry plus, per chunk, one header entry
+   and its data rounded up to whole entries. Rewriting a key writes the new
+   entries and marks the old ones erased, so every written entry eventually
+   costs 1/126 of a page erase when the page is recycled. The counters are
+   an upper bound: NVS may skip a write whose value did not change.
+ */
+#define NVS_ENTRY_SIZE 32
+#define NVS_ENTRIES_PER_PAGE 126
+#define NVS_RATED_ERASE_CYCLES 100000
+
+#define STORAGE_MAX_NAMESPACES 4
+#define STORAGE_MAX_OPEN_HANDLES 4
+#define STORAGE_COMMAND_SLOTS 16
+#define STORAGE_TXN_KEY "~txn"
+
+typedef struct
+{
+    uint32_t writes;
+    uint32_t bytesWritten;
+    uint32_t entriesWritten;
+    uint32_t erases;
+    uint32_t entriesErased;
+    uint32_t rewrites;
+} Wear_Counters;
+
+typedef struct
+{
+    char namespaceName[16];
+    char key[16];
+    Wear_Counters counters;
+    uint32_t storedEntries;     // entries the key uses now, once "sized"
+    uint8_t sized;
+} Key_Wear;
+
+typedef struct
+{
+    nvs_handle_t handle;
+    uint8_t namespaceId;
+    uint8_t inUse;
+} Open_Handle;
+
+static char namespaceNames[STORAGE_MAX_NAMESPACES][16];
+static uint8_t numberOfNamespaces = 0;
+static Open_Handle openHandles[STORAGE_MAX_OPEN_HANDLES];
+static uint8_t currentCommand = STORAGE_NO_COMMAND;
+static Storage_Write_Hook writeHooks[STORAGE_MAX_WRITE_HOOKS];
+static uint8_t numberOfWriteHooks = 0;
+
+#if CONFIG_SCHED_WEAR_STATS
+static Key_Wear keyWear[CONFIG_SCHED_WEAR_MAX_KEYS];
+static uint16_t numberOfKeys = 0;
+static Wear_Counters otherKeysWear;         // keys beyond CONFIG_SCHED_WEAR_MAX_KEYS
+static Wear_Counters namespaceWear[STORAGE_MAX_NAMESPACES];
+static Wear_Counters commandWear[STORAGE_COMMAND_SLOTS + 1];   // last slot: STORAGE_NO_COMMAND
+static uint32_t commits = 0;
+_Static_assert(sizeof(keyWear) + sizeof(otherKeysWear) + sizeof(namespaceWear) + sizeof(commandWear) <= STORAGE_RAM_BYTES,
+               "STORAGE_RAM_BYTES is too small");
+#endif
+
+typedef struct
+{
+    char key[16];
+    uint16_t length;
+    uint8_t erase;
+    uint8_t reserved;
+} Txn_Entry;
+
+// Also the layout of the journal blob, up to the used part of data[]
+typedef struct
+{
+    uint8_t numberOfEntries;
+    uint8_t reserved;
+    uint16_t dataLength;
+    Txn_Entry entries[STORAGE_TXN_MAX_KEYS];
+    uint8_t data[STORAGE_TXN_DATA_BYTES];
+} Txn_Journal;
+
+#if CONFIG_SCHED_NVS_TRANSACTIONS
+static Txn_Journal journal;
+static nvs_handle_t txnHandle;
+static uint8_t txnOpen = 0;
+_Static_assert(sizeof(journal) <= STORAGE_TXN_RAM_BYTES, "STORAGE_TXN_RAM_BYTES is too small");
+#endif
+
+static uint8_t namespace_id(const char* namespaceName)
+{
+    for (uint8_t i = 0; i < numberOfNamespaces; i++) {
+        if (strcmp(namespaceNames[i], namespaceName) == 0) return i;
+    }
+    if (numberOfNamespaces == STORAGE_MAX_NAMESPACES) return STORAGE_MAX_NAMESPACES - 1;
+    strncpy(namespaceNames[numberOfNamespaces], namespaceName, sizeof(namespaceNames[0]) - 1);
+    return numberOfNamespaces++;
+}
+
+static Open_Handle* find_open_handle(nvs_handle_t handle)
+{
+    for (uint8_t i = 0; i < STORAGE_MAX_OPEN_HANDLES; i++) {
+        if (openHandles[i].inUse && openHandles[i].handle == handle) return &openHandles[i];
+    }
+    return NULL;
+}
+
+esp_err_t storage_open(const char* namespaceName, nvs_handle_t* handle)
+{
+    TRACE_START(start);
+    esp_err_t err = nvs_open_from_partition(STORAGE_PARTITION, namespaceName, NVS_READWRITE, handle);
+    TRACE_END(TRACE_NVS_OPEN, start);
+    if (err != ESP_OK) return err;
+    for (uint8_t i = 0; i < STORAGE_MAX_OPEN_HANDLES; i++) {
+        if (!openHandles[i].inUse) {
+            openHandles[i].handle = *handle;
+            openHandles[i].namespaceId = namespace_id(namespaceName);
+            openHandles[i].inUse = 1;
+            break;
+        }
+    }
+    return ESP_OK;
+}
+
+void storage_close(nvs_handle_t handle)
+{
+    Open_Handle* open = find_open_handle(handle);
+    if (open != NULL) open->inUse = 0;
+    nvs_close(handle);
+}
+
+void storage_set_command(uint8_t command)
+{
+    currentCommand = command;
+}
+
+void storage_add_write_hook(Storage_Write_Hook hook)
+{
+    if (numberOfWriteHooks < STORAGE_MAX_WRITE_HOOKS) writeHooks[numberOfWriteHooks++] = hook;
+    else printf("Storage write hook dropped, STORAGE_MAX_WRITE_HOOKS reached!\n");
+}
+
+static esp_err_t notify_write(nvs_handle_t handle, const char* key)
+{
+    Open_Handle* open = find_open_handle(handle);
+    for (uint8_t i = 0; i < numberOfWriteHooks; i++) {
+        esp_err_t err = writeHooks[i](open != NULL ? namespaceNames[open->namespaceId] : NULL, key);
+        if (err != ESP_OK) return err;
+    }
+    return ESP_OK;
+}
+
+static uint32_t blob_entries(size_t length)
+{
+    return 2 + (length + NVS_ENTRY_SIZE - 1) / NVS_ENTRY_SIZE;
+}
+
+#if CONFIG_SCHED_WEAR_STATS
+
+static uint8_t handle_namespace_id(nvs_handle_t handle)
+{
+    Open_Handle* open = find_open_handle(handle);
+    return open != NULL ? open->namespaceId : namespace_id("?");
+}
+
+// NULL once CONFIG_SCHED_WEAR_MAX_KEYS keys are tracked
+static Key_Wear* key_wear(uint8_t namespaceId, const char* key)
+{
+    for (uint16_t i = 0; i < numberOfKeys; i++) {
+        if (strcmp(keyWear[i].key, key) == 0 && strcmp(keyWear[i].namespaceName, namespaceNames[namespaceId]) == 0) return &keyWear[i];
+    }
+    if (numberOfKeys == CONFIG_SCHED_WEAR_MAX_KEYS) return NULL;
+    strcpy(keyWear[numberOfKeys].namespaceName, namespaceNames[namespaceId]);
+    strncpy(keyWear[numberOfKeys].key, key, sizeof(keyWear[0].key) - 1);
+    return &keyWear[numberOfKeys++];
+}
+
+/* Entries currently used by "key", 0 when it does not exist. A tracked key
+   is looked up (up to three lookups, one per type) only the first time, its
+   size is then kept by account(); the others are looked up on every write. */
+static uint32_t stored_entries(nvs_handle_t handle, const char* key)
+{
+    Key_Wear* tracked = key_wear(handle_namespace_id(handle), key);
+    if (tracked != NULL && tracked->sized) return tracked->storedEntries;
+    size_t length = 0;
+    uint64_t value;
+    uint32_t entries = 0;
+    if (nvs_get_blob(handle, key, NULL, &length) == ESP_OK) entries = blob_entries(length);
+    else if (nvs_get_u8(handle, key, (uint8_t*) &value) == ESP_OK) entries = 1;
+    else if (nvs_get_u64(handle, key, &value) == ESP_OK) entries = 1;
+    if (tracked != NULL) {
+        tracked->storedEntries = entries;
+        tracked->sized = 1;
+    }
+    return entries;
+}
+
+static void account(nvs_handle_t handle, const char* key, size_t bytesWritten, uint32_t entriesWritten, uint32_t entriesErased, uint8_t isErase)
+{
+    uint8_t namespaceId = handle_namespace_id(handle);
+    Key_Wear* tracked = key_wear(namespaceId, key);
+    if (tracked != NULL) {
+        tracked->storedEntries = isErase ? 0 : entriesWritten;
+        tracked->sized = 1;
+    }
+    Wear_Counters* targets[3] = {
+        tracked != NULL ? &tracked->counters : &otherKeysWear,
+        &namespaceWear[namespaceId],
+        &commandWear[currentCommand < STORAGE_COMMAND_SLOTS ? currentCommand : STORAGE_COMMAND_SLOTS]
+    };
+    for (uint8_t i = 0; i < 3; i++) {
+        Wear_Counters* counters = targets[i];
+        if (isErase) counters->erases++;
+        else {
+            counters->writes++;
+            if (entriesErased > 0) counters->rewrites++;
+        }
+        counters->bytesWritten += bytesWritten;
+        counters->entriesWritten += entriesWritten;
+        counters->entriesErased += entriesErased;
+    }
+}
+
+#else
+
+static uint32_t stored_entries(nvs_handle_t handle, const char* key)
+{
+    return 0;
+}
+
+static void account(nvs_handle_t handle, const char* key, size_t bytesWritten, uint32_t entriesWritten, uint32_t entriesErased, uint8_t isErase)
+{
+}
+
+#endif
+
+esp_err_t storage_set_u8(nvs_handle_t handle, const char* key, uint8_t value)
+{
+    esp_err_t err = notify_write(handle, key);
+    if (err != ESP_OK) return err;
+    uint32_t oldEntries = stored_entries(handle, key);
+    TRACE_START(start);
+    err = nvs_set_u8(handle, key, value);
+    TRACE_END(TRACE_NVS_WRITE, start);
+    if (err == ESP_OK) {
+        account(handle, key, sizeof(value), 1, oldEntries, 0);
+    }
+    return err;
+}
+
+esp_err_t storage_set_u64(nvs_handle_t handle, const char* key, uint64_t value)
+{
+    esp_err_t err = notify_write(handle, key);
+    if (err != ESP_OK) return err;
+    uint32_t oldEntries = stored_entries(handle, key);
+    TRACE_START(start);
+    err = nvs_set_u64(handle, key, value);
+    TRACE_END(TRACE_NVS_WRITE, start);
+    if (err == ESP_OK) {
+        account(handle, key, sizeof(value), 1, oldEntries, 0);
+    }
+    return err;
+}
+
+#if CONFIG_SCHED_NVS_TRANSACTIONS
+
+static esp_err_t txn_add(const char* key, const void* value, size_t length, uint8_t erase)
+{
+    for (uint8_t i = 0; i < journal.numberOfEntries; i++) {
+        if (strcmp(journal.entries[i].key, key) == 0) return ESP_ERR_INVALID_ARG;
+    }
+    if (journal.numberOfEntries == STORAGE_TXN_MAX_KEYS || journal.dataLength + length > sizeof(journal.data)) return ESP_ERR_NO_MEM;
+    Txn_Entry* entry = &journal.entries[journal.numberOfEntries++];
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->key, key, sizeof(entry->key) - 1);
+    entry->length = length;
+    entry->erase = erase;
+    if (length > 0) memcpy(&journal.data[journal.dataLength], value, length);
+    journal.dataLength += length;
+    return ESP_OK;
+}
+
+#endif
+
+esp_err_t storage_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length)
+{
+#if CONFIG_SCHED_NVS_TRANSACTIONS
+    if (txnOpen && handle == txnHandle) return txn_add(key, value, length, 0);
+#endif
+    esp_err_t err = notify_write(handle, key);
+    if (err != ESP_OK) return err;
+    uint32_t oldEntries = stored_entries(handle, key);
+    TRACE_START(start);
+    err = nvs_set_blob(handle, key, value, length);
+    TRACE_END(TRACE_NVS_WRITE, start);
+    if (err == ESP_OK) {
+        account(handle, key, length, blob_entries(length), oldEntries, 0);
+    }
+    return err;
+}
+
+esp_err_t storage_erase_key(nvs_handle_t handle, const char* key)
+{
+#if CONFIG_SCHED_NVS_TRANSACTIONS
+    if (txnOpen && handle == txnHandle) return txn_add(key, NULL, 0, 1);
+#endif
+    esp_err_t err = notify_write(handle, key);
+    if (err != ESP_OK) return err;
+    uint32_t oldEntries = stored_entries(handle, key);
+    TRACE_START(start);
+    err = nvs_erase_key(handle, key);
+    TRACE_END(TRACE_NVS_WRITE, start);
+    if (err == ESP_OK) {
+        account(handle, key, 0, 0, oldEntries, 1);
+    }
+    return err;
+}
+
+esp_err_t storage_get_blob(nvs_handle_t handle, const char* key, void* value, size_t* length)
+{
+    TRACE_START(start);
+    esp_err_t err = nvs_get_blob(handle, key, value, length);
+    TRACE_END(TRACE_NVS_READ, start);
+    return err;
+}
+
+esp_err_t storage_commit(nvs_handle_t handle)
+{
+    TRACE_START(start);
+    esp_err_t err = nvs_commit(handle);
+    TRACE_END(TRACE_NVS_COMMIT, start);
+#if CONFIG_SCHED_WEAR_STATS
+    commits++;
+#endif
+    return err;
+}
+
+#if CONFIG_SCHED_NVS_TRANSACTIONS
+
+#if CONFIG_SCHED_TXN_FAULT_STEP
+#define TXN_FAULT_DONE 0x46415554u
+
+// Survives esp_restart but not a power cycle, so the fault is injected once per power-up
+static RTC_NOINIT_ATTR uint32_t txnFaultDone;
+
+/* Test hook: restart at one step of the first journaled transaction since
+   power-up, so the recovery at boot can be checked on the device (see
+   README.md). Step 1 follows the journal write, step 1 + n the write of
+   its n-th key; the journal is erased after the last one. */
+static void txn_fault_point(uint8_t step)
+{
+    if (step != CONFIG_SCHED_TXN_FAULT_STEP || journal.numberOfEntries < 2 || txnFaultDone == TXN_FAULT_DONE) return;
+    txnFaultDone = TXN_FAULT_DONE;
+    printf("Transaction fault injected at step %d of %d keys, restarting.\n", step, journal.numberOfEntries);
+    fflush(stdout);
+    esp_restart();
+}
+#else
+#define txn_fault_point(step)
+#endif
+
+static size_t journal_size(void)
+{
+    return offsetof(Txn_Journal, data) + journal.dataLength;
+}
+
+// Write or erase every key of the journal; repeating it after a reset is harmless
+static esp_err_t apply_journal(nvs_handle_t handle)
+{
+    uint16_t offset = 0;
+    for (uint8_t i = 0; i < journal.numberOfEntries; i++) {
+        const Txn_Entry* entry = &journal.entries[i];
+        esp_err_t err;
+        if (entry->erase) {
+            err = storage_erase_key(handle, entry->key);
+            if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+        }
+        else err = storage_set_blob(handle, entry->key, &journal.data[offset], entry->length);
+        if (err != ESP_OK) return err;
+        offset += entry->length;
+        txn_fault_point(2 + i);
+    }
+    return ESP_OK;
+}
+
+esp_err_t storage_txn_begin(nvs_handle_t handle)
+{
+    if (txnOpen) return ESP_ERR_INVALID_STATE;
+    journal.numberOfEntries = 0;
+    journal.dataLength = 0;
+    txnHandle = handle;
+    txnOpen = 1;
+    return ESP_OK;
+}
+
+void storage_txn_abort(nvs_handle_t handle)
+{
+    if (txnOpen && handle == txnHandle) txnOpen = 0;
+}
+
+esp_err_t storage_txn_commit(nvs_handle_t handle)
+{
+    if (!txnOpen || handle != txnHandle) return storage_commit(handle);
+    txnOpen = 0;
+    esp_err_t err = ESP_OK;
+    // NVS writes a single key atomically on its own
+    uint8_t journaled = journal.numberOfEntries > 1;
+    if (journaled) {
+        err = storage_set_blob(handle, STORAGE_TXN_KEY, &journal, journal_size());
+        if (err == ESP_OK) err = storage_commit(handle);
+        if (err == ESP_OK) txn_fault_point(1);
+    }
+    if (err == ESP_OK) err = apply_journal(handle);
+    if (err == ESP_OK && journaled) err = storage_erase_key(handle, STORAGE_TXN_KEY);
+    if (err == ESP_OK) err = storage_commit(handle);
+    return err;
+}
+
+/* Finish a transaction interrupted by a reset. Without a journal, the
+   usual case, this is one failed lookup. */
+esp_err_t storage_recover(const char* namespaceName)
+{
+    nvs_handle_t handle;
+    esp_err_t err = storage_open(namespaceName, &handle);
+    if (err != ESP_OK) return err;
+    size_t length = sizeof(journal);
+    err = storage_get_blob(handle, STORAGE_TXN_KEY, &journal, &length);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        storage_close(handle);
+        return ESP_OK;
+    }
+    if (err == ESP_OK && (length < offsetof(Txn_Journal, data) || journal.numberOfEntries > STORAGE_TXN_MAX_KEYS
+                          || length != journal_size())) err = ESP_ERR_INVALID_SIZE;
+    if (err == ESP_OK) {
+        err = apply_journal(handle);
+        if (err == ESP_OK) printf("Transaction of %d keys in %s completed after a reset.\n", journal.numberOfEntries, namespaceName);
+    }
+    else if (err == ESP_ERR_INVALID_SIZE) {
+        // Not a journal of this firmware, nothing can be applied from it
+        printf("Unusable transaction journal in %s dropped.\n", namespaceName);
+        err = ESP_OK;
+    }
+    if (err == ESP_OK) err = storage_erase_key(handle, STORAGE_TXN_KEY);
+    if (err == ESP_OK) err = storage_commit(handle);
+    storage_close(handle);
+    return err;
+}
+
+#else
+
+esp_err_t storage_txn_begin(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void storage_txn_abort(nvs_handle_t handle)
+{
+}
+
+esp_err_t storage_txn_commit(nvs_handle_t handle)
+{
+    return storage_commit(handle);
+}
+
+esp_err_t storage_recover(const char* namespaceName)
+{
+    return ESP_OK;
+}
+
+#endif
+
+#if CONFIG_SCHED_WEAR_STATS
+
+static void print_counters(const char* label, const Wear_Counters* counters)
+{
+    printf("  %-22s writes %u (%u rewrites), erases %u, %u bytes, entries written %u / erased %u\n", label,
+           counters->writes, counters->rewrites, counters->erases, counters->bytesWritten,
+           counters->entriesWritten, counters->entriesErased);
+}
+
+void storage_print_wear_stats(void)
+{
+    char label[40];
+    uint32_t entriesWritten = 0;
+    nvs_stats_t nvs_stats;
+
+    printf("NVS wear since boot, %u commits:\n", commits);
+    printf(" Per namespace:\n");
+    for (uint8_t i = 0; i < numberOfNamespaces; i++) {
+        print_counters(namespaceNames[i], &namespaceWear[i]);
+        entriesWritten += namespaceWear[i].entriesWritten;
+    }
+    printf(" Per command:\n");
+    for (uint8_t i = 0; i <= STORAGE_COMMAND_SLOTS; i++) {
+        if (commandWear[i].writes == 0 && commandWear[i].erases == 0) continue;
+        if (i == STORAGE_COMMAND_SLOTS) strcpy(label, "background");
+        else sprintf(label, "command %u", i);
+        print_counters(label, &commandWear[i]);
+    }
+    printf(" Per key:\n");
+    for (uint16_t i = 0; i < numberOfKeys; i++) {
+        snprintf(label, sizeof(label), "%s/%s", keyWear[i].namespaceName, keyWear[i].key);
+        print_counters(label, &keyWear[i].counters);
+    }
+    if (otherKeysWear.writes > 0 || otherKeysWear.erases > 0) print_counters("(other keys)", &otherKeysWear);
+
+    // Page recycling spreads the erases over the whole partition
+    if (nvs_get_stats(STORAGE_PARTITION, &nvs_stats) == ESP_OK && nvs_stats.total_entries > 0) {
+        uint32_t pages = nvs_stats.total_entries / NVS_ENTRIES_PER_PAGE;
+        uint32_t pageErases = entriesWritten / NVS_ENTRIES_PER_PAGE;
+        printf(" Estimated page erases %u over %u pages, %u.%03u erase cycles per page (rated %u).\n",
+               pageErases, pages, entriesWritten / (NVS_ENTRIES_PER_PAGE * pages),
+               (uint32_t)((uint64_t) entriesWritten * 1000 / (NVS_ENTRIES_PER_PAGE * pages) % 1000), NVS_RATED_ERASE_CYCLES);
+    }
+}
+
+void storage_get_wear_totals(uint32_t* bytesWritten, uint32_t* entriesWritten)
+{
+    *bytesWritten = 0;
+    *entriesWritten = 0;
+    for (uint8_t i = 0; i < numberOfNamespaces; i++) {
+        *bytesWritten += namespaceWear[i].bytesWritten;
+        *entriesWritten += namespaceWear[i].entriesWritten;
+    }
+}
+
+void storage_reset_wear_stats(void)
+{
+    memset(keyWear, 0, sizeof(keyWear));
+    memset(&otherKeysWear, 0, sizeof(otherKeysWear));
+    memset(namespaceWear, 0, sizeof(namespaceWear));
+    memset(commandWear, 0, sizeof(commandWear));
+    numberOfKeys = 0;
+    commits = 0;
+}
+
+#else
+
+void storage_get_wear_totals(uint32_t* bytesWritten, uint32_t* entriesWritten)
+{
+    *bytesWritten = 0;
+    *entriesWritten = 0;
+}
+
+void storage_print_wear_stats(void)
+{
+    printf("NVS wear statistics are disabled (CONFIG_SCHED_WEAR_STATS).\n");
+}
+
+void storage_reset_wear_stats(void)
+{
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef NVS_STORAGE_H_
+#define NVS_STORAGE_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "nvs.h"
+
+#define STORAGE_PARTITION "MyNvs"
+
+// Writes not issued by a command (purges, clock checkpoints, boot)
+#define STORAGE_NO_COMMAND 0xFF
+
+// Keys a transaction can change, and the bytes it can write: both lists of a load
+#define STORAGE_TXN_MAX_KEYS 4
+#define STORAGE_TXN_DATA_BYTES (2 * CONFIG_SCHED_MAX_EVENTS_PER_LOAD * 16)
+
+// Static RAM of the wear counters: 64 bytes per tracked key plus the totals
+#if CONFIG_SCHED_WEAR_STATS
+#define STORAGE_WEAR_RAM_BYTES (CONFIG_SCHED_WEAR_MAX_KEYS * 64 + 1024)
+#else
+#define STORAGE_WEAR_RAM_BYTES 0
+#endif
+// Static RAM of the transaction journal
+#if CONFIG_SCHED_NVS_TRANSACTIONS
+#define STORAGE_TXN_RAM_BYTES (STORAGE_TXN_MAX_KEYS * 20 + 4 + STORAGE_TXN_DATA_BYTES)
+#else
+#define STORAGE_TXN_RAM_BYTES 0
+#endif
+#define STORAGE_RAM_BYTES (STORAGE_WEAR_RAM_BYTES + STORAGE_TXN_RAM_BYTES)
+
+/* Thin layer over the NVS write calls of the "MyNvs" partition that
+   accounts for the flash wear of every write and traces the latency of opens,
+   blob reads, writes and commits. Other reads use the nvs_get_* calls directly
+   on the handle returned by storage_open. All writes happen in the command
+   task, so the counters are not locked.
+ */
+esp_err_t storage_open(const char* namespaceName, nvs_handle_t* handle);
+void storage_close(nvs_handle_t handle);
+esp_err_t storage_set_u8(nvs_handle_t handle, const char* key, uint8_t value);
+esp_err_t storage_set_u64(nvs_handle_t handle, const char* key, uint64_t value);
+esp_err_t storage_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length);
+esp_err_t storage_erase_key(nvs_handle_t handle, const char* key);
+esp_err_t storage_get_blob(nvs_handle_t handle, const char* key, void* value, size_t* length);
+esp_err_t storage_commit(nvs_handle_t handle);
+
+/* Transactions: between storage_txn_begin and storage_txn_commit the
+   blob writes and erases of the handle are kept in RAM, so reads still see the
+   committed values. The commit writes them as one journal blob, which NVS
+   writes atomically, then applies them to their keys and erases the
+   journal. storage_recover, run at boot, applies a journal left by a reset
+   during that step, so after a reset either all the keys have changed or
+   none. A transaction of a single key skips the journal. One transaction
+   at a time, each key written or erased once.
+ */
+esp_err_t storage_txn_begin(nvs_handle_t handle);
+esp_err_t storage_txn_commit(nvs_handle_t handle);
+void storage_txn_abort(nvs_handle_t handle);
+esp_err_t storage_recover(const char* namespaceName);
+
+void storage_set_command(uint8_t command);
+
+/* Called before every write or erase with the namespace of the handle
+   (NULL if the handle was not opened with storage_open) and the key. NVS
+   persists a value as soon as it is set, so whatever must not outlive the
+   old value is dropped here; if a hook fails the write is not done and
+   its error is returned. */
+#define STORAGE_MAX_WRITE_HOOKS 2
+typedef esp_err_t (*Storage_Write_Hook)(const char* namespaceName, const char* key);
+void storage_add_write_hook(Storage_Write_Hook hook);
+void storage_get_wear_totals(uint32_t* bytesWritten, uint32_t* entriesWritten);
+void storage_print_wear_stats(void);
+void storage_reset_wear_stats(void);
+
+#endif
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+
+#include "nvs_blob_example_main.h"
+#include "sched_benchmark.h"
+#include "nvs_storage.h"
+#include "time_service.h"
+#include "sched_heap.h"
+#include "sched_loads.h"
+#include "sched_query.h"
+#include "sched_transfer.h"
+#include "sched_window.h"
+
+/* On-device benchmark of the storage and command layers. It creates its own
+   loads ("bench000"...), times each layer over them and removes them again,
+   printing one JSON line per case so runs can be diffed:
+   {"bench":..., "loads":..., "events":..., "ops":..., "us":..., "us_per_op":...,
+    "allocs":..., "leaked_bytes":..., "nvs_bytes":..., "nvs_entries":..., "heap_delta":..., "result":...}
+   NVS bytes and entries come from the wear counters; with CONFIG_SCHED_WEAR_STATS
+   off they are left out and "nvs":"counters disabled" is printed instead.
+   Allocations come from the accounted heap. A case fails if it leaks memory.
+   Cases moving a document also give "bytes" and "kb_per_s".
+ */
+#define BENCHMARK_LOAD_FORMAT "bench%03u"
+#define BENCHMARK_PIN 2
+// Far enough in the future to never be fired by the scheduler during the run
+#define BENCHMARK_DATE_OFFSET_S (365 * 24 * 3600)
+
+typedef struct
+{
+    const char* name;
+    uint32_t ops;
+    uint32_t bytes;
+    int64_t start;
+    uint32_t bytesWritten;
+    uint32_t entriesWritten;
+    uint32_t freeHeap;
+    uint32_t allocations;
+    uint32_t liveBytes;
+} Benchmark_Case;
+
+static uint8_t failedCases;
+
+static void case_begin(Benchmark_Case* bench, const char* name)
+{
+    bench->name = name;
+    bench->ops = 0;
+    bench->bytes = 0;
+    storage_get_wear_totals(&bench->bytesWritten, &bench->entriesWritten);
+    bench->freeHeap = esp_get_free_heap_size();
+    sched_heap_get_totals(&bench->allocations, &bench->liveBytes);
+    bench->start = esp_timer_get_time();
+}
+
+static void case_end(Benchmark_Case* bench, uint8_t numberOfLoads, uint8_t eventsPerLoad)
+{
+    int64_t elapsed = esp_timer_get_time() - bench->start;
+    uint32_t bytesWritten, entriesWritten, allocations, liveBytes;
+    storage_get_wear_totals(&bytesWritten, &entriesWritten);
+    sched_heap_get_totals(&allocations, &liveBytes);
+    int32_t leakedBytes = liveBytes - bench->liveBytes;
+    if (leakedBytes > 0) failedCases++;
+
+    cJSON* result = cJSON_CreateObject();
+    cJSON_AddStringToObject(result, "bench", bench->name);
+    cJSON_AddNumberToObject(result, "loads", numberOfLoads);
+    cJSON_AddNumberToObject(result, "events", eventsPerLoad);
+    cJSON_AddNumberToObject(result, "ops", bench->ops);
+    cJSON_AddNumberToObject(result, "us", elapsed);
+    cJSON_AddNumberToObject(result, "us_per_op", bench->ops > 0 ? elapsed / bench->ops : 0);
+    cJSON_AddNumberToObject(result, "allocs", allocations - bench->allocations);
+    cJSON_AddNumberToObject(result, "leaked_bytes", leakedBytes);
+#if CONFIG_SCHED_WEAR_STATS
+    cJSON_AddNumberToObject(result, "nvs_bytes", bytesWritten - bench->bytesWritten);
+    cJSON_AddNumberToObject(result, "nvs_entries", entriesWritten - bench->entriesWritten);
+#else
+    cJSON_AddStringToObject(result, "nvs", "counters disabled");
+#endif
+    cJSON_AddNumberToObject(result, "heap_delta", (int32_t)(esp_get_free_heap_size() - bench->freeHeap));
+    if (bench->bytes > 0) {
+        cJSON_AddNumberToObject(result, "bytes", bench->bytes);
+        cJSON_AddNumberToObject(result, "kb_per_s", elapsed > 0 ? (uint64_t) bench->bytes * 1000000 / 1024 / elapsed : 0);
+    }
+    cJSON_AddStringToObject(result, "result", leakedBytes > 0 ? "fail" : "pass");
+    char* line = cJSON_PrintUnformatted(result);
+    if (line != NULL) printf("%s\n", line);
+    cJSON_free(line);
+    cJSON_Delete(result);
+}
+
+// Queries run per query case
+#define BENCHMARK_QUERIES 100
+
+static void count_event(const Sched_Snapshot* snapshot, uint32_t event, void* context)
+{
+    (*(uint32_t*) context)++;
+}
+
+static void count_bytes(const char* chunk, size_t length, void* context)
+{
+    *(uint32_t*) context += length;
+}
+
+static void feed_import(char* chunk, size_t* used, Benchmark_Case* bench)
+{
+    sched_transfer_import_feed(chunk, *used);
+    bench->bytes += *used;
+    *used = 0;
+}
+
+/* The document of the benchmark loads, with the dates they hold, is
+   generated and imported chunk by chunk: it is never held whole, as when
+   it arrives over BLE. Returns the number of loads imported. */
+static uint32_t import_benchmark_document(Benchmark_Case* bench, uint8_t numberOfLoads, uint8_t eventsPerLoad, uint32_t firstDate)
+{
+    char chunk[128];
+    char piece[48];
+    size_t used = 0;
+
+    sched_transfer_import_begin();
+    for (int i = -1; i <= numberOfLoads; i++) {
+        if (i == -1) strcpy(piece, "{\"v\":1,\"loads\":[");
+        else if (i == numberOfLoads) strcpy(piece, "]}");
+        else sprintf(piece, "%s{\"l\":\"" BENCHMARK_LOAD_FORMAT "\",\"p\":%d", i > 0 ? "," : "", i, BENCHMARK_PIN);
+        for (uint8_t state = 1; i >= 0 && i < numberOfLoads && state <= 2; state++) {
+            // ON then OFF, each with the dates of its parity as saved above
+            size_t length = strlen(piece);
+            sprintf(&piece[length], state == 1 ? ",\"on\":[" : ",\"off\":[");
+            if (used + strlen(piece) > sizeof(chunk)) feed_import(chunk, &used, bench);
+            memcpy(&chunk[used], piece, strlen(piece));
+            used += strlen(piece);
+            uint8_t first = 1;
+            for (uint8_t e = 1; e <= eventsPerLoad + 1; e++) {
+                if (e % 2 != (state == 1)) continue;
+                length = sprintf(piece, "%s[%u,1]", first ? "" : ",", firstDate + e);
+                first = 0;
+                if (used + length > sizeof(chunk)) feed_import(chunk, &used, bench);
+                memcpy(&chunk[used], piece, length);
+                used += length;
+            }
+            strcpy(piece, state == 1 ? "]" : "]}");
+        }
+        if (used + strlen(piece) > sizeof(chunk)) feed_import(chunk, &used, bench);
+        memcpy(&chunk[used], piece, strlen(piece));
+        used += strlen(piece);
+    }
+    feed_import(chunk, &used, bench);
+    return sched_transfer_import_loads();
+}
+
+static void remove_benchmark_loads(uint8_t numberOfLoads)
+{
+    char loadName[20];
+
+    for (uint8_t i = 0; i < numberOfLoads; i++) {
+        sprintf(loadName, BENCHMARK_LOAD_FORMAT, i);
+        int loadNumber = sched_loads_find(loadName);
+        if (loadNumber >= 0) sched_loads_remove(loadNumber);
+    }
+}
+
+void sched_benchmark_run(uint8_t numberOfLoads, uint8_t eventsPerLoad)
+{
+    Benchmark_Case bench;
+    Sched_Delta delta;
+    char loadName[20];
+    char command[96];
+    uint32_t firstDate = time_service_now_s() + BENCHMARK_DATE_OFFSET_S;
+
+    if (numberOfLoads == 0 || numberOfLoads > BENCHMARK_MAX_LOADS) numberOfLoads = BENCHMARK_MAX_LOADS;
+    if (eventsPerLoad == 0 || eventsPerLoad > BENCHMARK_MAX_EVENTS) eventsPerLoad = BENCHMARK_MAX_EVENTS;
+    printf("Benchmark with %d loads of %d events each:\n", numberOfLoads, eventsPerLoad);
+    failedCases = 0;
+
+    case_begin(&bench, "register_new_load");
+    for (uint8_t i = 0; i < numberOfLoads; i++, bench.ops++) {
+        sprintf(loadName, BENCHMARK_LOAD_FORMAT, i);
+        register_new_load(loadName, BENCHMARK_PIN);
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+
+    // The scheduler knows the loads, so the end to end case applies its changes
+    for (uint8_t i = 0; i < numberOfLoads; i++) {
+        memset(&delta, 0, sizeof(delta));
+        delta.type = SCHED_DELTA_ADD_LOAD;
+        delta.pinNumber = BENCHMARK_PIN;
+        sprintf(delta.loadName, BENCHMARK_LOAD_FORMAT, i);
+        int loadNumber = sched_loads_find(delta.loadName);
+        if (loadNumber < 0) continue;
+        delta.loadNumber = loadNumber;
+        commit_sched_change(&delta);
+    }
+
+    // Dates are inserted in reverse so every save also moves the list,
+    // alternating ON and OFF so they pass the conflict validation
+    case_begin(&bench, "save_schedule_time");
+    for (uint8_t i = 0; i < numberOfLoads; i++) {
+        sprintf(loadName, BENCHMARK_LOAD_FORMAT, i);
+        for (uint8_t e = eventsPerLoad; e > 0; e--, bench.ops++) {
+            save_schedule_time(loadName, e % 2, firstDate + e, 1, NULL);
+        }
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+
+    // Every date again with the other state, all refused by the validation
+    case_begin(&bench, "save_conflicting");
+    for (uint8_t i = 0; i < numberOfLoads; i++) {
+        sprintf(loadName, BENCHMARK_LOAD_FORMAT, i);
+        for (uint8_t e = 1; e <= eventsPerLoad; e++, bench.ops++) {
+            save_schedule_time(loadName, (e + 1) % 2, firstDate + e, 1, NULL);
+        }
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+
+    case_begin(&bench, "print_load_sched_list");
+    for (uint8_t i = 0; i < numberOfLoads; i++, bench.ops++) {
+        sprintf(loadName, BENCHMARK_LOAD_FORMAT, i);
+        print_load_sched_list(loadName);
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+
+    // The saves above erased the boot image, so the table is read from the keys
+    case_begin(&bench, "return_sched_from_NVS");
+    for (uint8_t i = 0; i < 4; i++, bench.ops++) {
+        uint8_t loadsRead;
+        return_sched_from_NVS(&loadsRead);
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+
+#if CONFIG_SCHED_BOOT_IMAGE
+    save_boot_image();
+    case_begin(&bench, "return_sched_from_image");
+    for (uint8_t i = 0; i < 4; i++, bench.ops++) {
+        uint8_t loadsRead;
+        return_sched_from_NVS(&loadsRead);
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+#endif
+
+    case_begin(&bench, "change_repetitions");
+    for (uint8_t i = 0; i < numberOfLoads; i++) {
+        sprintf(loadName, BENCHMARK_LOAD_FORMAT, i);
+        for (uint8_t e = 1; e <= eventsPerLoad; e++, bench.ops++) {
+            delete_or_change_sched_from_NVS(loadName, firstDate + e, 2, 1);
+        }
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+
+    // Command parsing, NVS write and schedule table update, as a BLE command
+    case_begin(&bench, "process_command_save");
+    for (uint8_t i = 0; i < numberOfLoads; i++, bench.ops++) {
+        sprintf(command, "{\"c\":0,\"l\":\"" BENCHMARK_LOAD_FORMAT "\",\"s\":%u,\"d\":%u,\"r\":1}", i, (eventsPerLoad + 1) % 2, firstDate + eventsPerLoad + 1);
+        process_command(command);
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+
+    // The schedule table with every benchmark event, for the query cases
+    memset(&delta, 0, sizeof(delta));
+    delta.type = SCHED_DELTA_RELOAD;
+    delta.loads = return_sched_from_NVS(&delta.numberOfLoads);
+    if (delta.loads != NULL) commit_sched_change(&delta);
+    uint32_t found = 0;
+    const Sched_Snapshot* snapshot = sched_snapshot_read_begin(SCHED_READER_QUERY);
+    case_begin(&bench, "query_next");
+    for (uint8_t i = 0; i < BENCHMARK_QUERIES; i++, bench.ops++) {
+        sched_query_next(snapshot, firstDate, SCHED_QUERY_ANY_PIN, 10, count_event, &found);
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+    case_begin(&bench, "query_range");
+    for (uint8_t i = 0; i < BENCHMARK_QUERIES; i++, bench.ops++) {
+        sched_query_range(snapshot, firstDate + 1, firstDate + eventsPerLoad / 2, SCHED_QUERY_ANY_PIN, UINT32_MAX, count_event, &found);
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+    case_begin(&bench, "query_next_pin");
+    for (uint8_t i = 0; i < BENCHMARK_QUERIES; i++, bench.ops++) {
+        sched_query_next(snapshot, firstDate, BENCHMARK_PIN, 10, count_event, &found);
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+    sched_snapshot_read_end(SCHED_READER_QUERY);
+    printf("Queries found %u events.\n", found);
+
+    case_begin(&bench, "export");
+    bench.ops = 1;
+    sched_transfer_export(count_bytes, &bench.bytes);
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+
+    // Rewrites every benchmark load with the dates it already has
+    case_begin(&bench, "import");
+    bench.ops = import_benchmark_document(&bench, numberOfLoads, eventsPerLoad, firstDate);
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+
+#if SCHED_WINDOW_EVENTS
+    // Reads both lists of a load and merges its window into the table
+    case_begin(&bench, "window_refill");
+    for (uint8_t i = 0; i < numberOfLoads; i++, bench.ops++) {
+        sprintf(loadName, BENCHMARK_LOAD_FORMAT, i);
+        int loadNumber = sched_loads_find(loadName);
+        if (loadNumber >= 0) sched_window_refill(loadNumber);
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+#endif
+
+    case_begin(&bench, "delete_sched");
+    for (uint8_t i = 0; i < numberOfLoads; i++) {
+        sprintf(loadName, BENCHMARK_LOAD_FORMAT, i);
+        for (uint8_t e = 1; e <= eventsPerLoad; e++, bench.ops++) {
+            delete_or_change_sched_from_NVS(loadName, firstDate + e, 0, 0);
+        }
+    }
+    case_end(&bench, numberOfLoads, eventsPerLoad);
+
+    remove_benchmark_loads(numberOfLoads);
+    memset(&delta, 0, sizeof(delta));
+    delta.type = SCHED_DELTA_RELOAD;
+    delta.loads = return_sched_from_NVS(&delta.numberOfLoads);
+    if (delta.loads != NULL) commit_sched_change(&delta);
+    if (failedCases > 0) printf("Benchmark FAILED: %d cases leaked memory. Benchmark loads removed.\n", failedCases);
+    else printf("Benchmark passed, benchmark loads removed.\n");
+}
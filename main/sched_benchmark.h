@@ -0,0 +1,13 @@
+#ifndef SCHED_BENCHMARK_H_
+#define SCHED_BENCHMARK_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+// The benchmark loads must fit the static schedule tables; one more event is saved by process_command_save
+#define BENCHMARK_MAX_LOADS CONFIG_SCHED_MAX_LOADS
+#define BENCHMARK_MAX_EVENTS (CONFIG_SCHED_MAX_EVENTS_PER_LOAD - 1)
+
+void sched_benchmark_run(uint8_t numberOfLoads, uint8_t eventsPerLoad);
+
+#endif
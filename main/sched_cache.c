@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+#include "nvs_storage.h"
+#include "sched_cache.h"
+
+#if CONFIG_SCHED_LIST_CACHE_ENTRIES > 0
+
+static Sched_Cache_Entry entries[CONFIG_SCHED_LIST_CACHE_ENTRIES];
+static uint32_t useClock = 0;
+static uint32_t hits = 0;
+static uint32_t misses = 0;
+static uint32_t invalidations = 0;
+static int64_t hitTimeSum = 0;
+static int64_t missTimeSum = 0;
+
+static Sched_Cache_Entry* find_entry(const char* key)
+{
+    for (int i = 0; i < CONFIG_SCHED_LIST_CACHE_ENTRIES; i++) {
+        if (entries[i].valid && strcmp(entries[i].key, key) == 0) return &entries[i];
+    }
+    return NULL;
+}
+
+// An invalid entry if there is one, else the least recently used
+static Sched_Cache_Entry* victim_entry(void)
+{
+    Sched_Cache_Entry* victim = &entries[0];
+    for (int i = 0; i < CONFIG_SCHED_LIST_CACHE_ENTRIES; i++) {
+        if (!entries[i].valid) return &entries[i];
+        if (entries[i].lastUse < victim->lastUse) victim = &entries[i];
+    }
+    return victim;
+}
+
+static esp_err_t copy_out(const Sched_Cache_Entry* entry, void* value, size_t* length)
+{
+    if (!entry->found) return ESP_ERR_NVS_NOT_FOUND;
+    if (value != NULL) {
+        if (*length < entry->length) return ESP_ERR_NVS_INVALID_LENGTH;
+        memcpy(value, entry->items, entry->length);
+    }
+    *length = entry->length;
+    return ESP_OK;
+}
+
+static esp_err_t on_storage_write(const char* namespaceName, const char* key)
+{
+    if (namespaceName != NULL && strcmp(namespaceName, SCHEDULES_STORAGE_NAMESPACE) != 0) return ESP_OK;
+    Sched_Cache_Entry* entry = find_entry(key);
+    if (entry == NULL) return ESP_OK;
+    entry->valid = 0;
+    invalidations++;
+    return ESP_OK;
+}
+
+void sched_cache_init(void)
+{
+    memset(entries, 0, sizeof(entries));
+    storage_add_write_hook(on_storage_write);
+}
+
+esp_err_t sched_cache_read(nvs_handle_t handle, const char* key, void* value, size_t* length)
+{
+    int64_t start = esp_timer_get_time();
+    Sched_Cache_Entry* entry = find_entry(key);
+    if (entry != NULL) {
+        entry->lastUse = ++useClock;
+        esp_err_t err = copy_out(entry, value, length);
+        hits++;
+        hitTimeSum += esp_timer_get_time() - start;
+        return err;
+    }
+
+    entry = victim_entry();
+    entry->valid = 0;
+    size_t size = sizeof(entry->items);
+    esp_err_t err = storage_get_blob(handle, key, entry->items, &size);
+    if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+        strncpy(entry->key, key, sizeof(entry->key) - 1);
+        entry->key[sizeof(entry->key) - 1] = '\0';
+        entry->found = err == ESP_OK;
+        entry->length = entry->found ? size : 0;
+        entry->valid = 1;
+        entry->lastUse = ++useClock;
+        err = copy_out(entry, value, length);
+    }
+    // Larger than any list this firmware writes: read as it is, not cached
+    else if (err == ESP_ERR_NVS_INVALID_LENGTH) err = storage_get_blob(handle, key, value, length);
+    misses++;
+    missTimeSum += esp_timer_get_time() - start;
+    return err;
+}
+
+void sched_cache_print_stats(void)
+{
+    uint32_t reads = hits + misses;
+    printf("List cache: %d entries, %u hits / %u misses", CONFIG_SCHED_LIST_CACHE_ENTRIES, hits, misses);
+    if (reads > 0) printf(" (%u%% hits)", hits * 100 / reads);
+    printf(", %u invalidations", invalidations);
+    if (hits > 0) printf(", hit avg %lld us", hitTimeSum / hits);
+    if (misses > 0) printf(", miss avg %lld us", missTimeSum / misses);
+    printf(".\n");
+}
+
+void sched_cache_reset_stats(void)
+{
+    hits = 0;
+    misses = 0;
+    invalidations = 0;
+    hitTimeSum = 0;
+    missTimeSum = 0;
+}
+
+#else
+
+void sched_cache_init(void)
+{
+}
+
+esp_err_t sched_cache_read(nvs_handle_t handle, const char* key, void* value, size_t* length)
+{
+    return storage_get_blob(handle, key, value, length);
+}
+
+void sched_cache_print_stats(void)
+{
+    printf("List cache is disabled (CONFIG_SCHED_LIST_CACHE_ENTRIES).\n");
+}
+
+void sched_cache_reset_stats(void)
+{
+}
+
+#endif
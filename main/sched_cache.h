@@ -0,0 +1,38 @@
+#ifndef SCHED_CACHE_H_
+#define SCHED_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "nvs.h"
+
+#include "nvs_blob_example_main.h"
+#include "sched_loads.h"
+
+/* Read-through cache of the ON and OFF lists of the loads, keyed by their
+   schedule key (load and direction). A miss reads the whole blob once,
+   instead of a size probe and a data read, into the least recently used
+   entry; a list missing from NVS is cached too. Every write or erase of a
+   schedule key drops its entry (storage write hook), so a hit is always
+   the committed list. Used by the command task only, for handles of
+   SCHEDULES_STORAGE_NAMESPACE.
+ */
+typedef struct
+{
+    char key[SCHED_LOAD_KEY_LEN];
+    uint32_t lastUse;
+    uint16_t length;        // bytes of the list
+    uint8_t found;          // 0: the key is not in NVS
+    uint8_t valid;
+    Date_and_Reps items[CONFIG_SCHED_MAX_EVENTS_PER_LOAD];
+} Sched_Cache_Entry;
+
+#define SCHED_CACHE_RAM_BYTES (CONFIG_SCHED_LIST_CACHE_ENTRIES * sizeof(Sched_Cache_Entry))
+
+void sched_cache_init(void);
+// Same contract as storage_get_blob: with value NULL only the length is returned
+esp_err_t sched_cache_read(nvs_handle_t handle, const char* key, void* value, size_t* length);
+void sched_cache_print_stats(void);
+void sched_cache_reset_stats(void);
+
+#endif
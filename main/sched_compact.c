@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+#include "nvs_blob_example_main.h"
+#include "sched_compact.h"
+#include "sched_loads.h"
+#include "sched_log.h"
+#include "sched_snapshot.h"
+#include "time_service.h"
+
+#if CONFIG_SCHED_COMPACT
+
+static uint8_t nextLoad = 0;
+static int64_t lastStep = 0;
+static uint32_t passes = 0;
+static uint32_t loadsRewritten = 0;
+static uint32_t eventsDropped = 0;
+
+static void next_load(void)
+{
+    if (++nextLoad == CONFIG_SCHED_MAX_LOADS) {
+        nextLoad = 0;
+        passes++;
+    }
+}
+
+void sched_compact_step(void)
+{
+    // Without the real time every date would look recent or expired
+    if (!time_service_is_synced()) return;
+    int64_t now = esp_timer_get_time();
+    if (lastStep != 0 && now - lastStep < CONFIG_SCHED_COMPACT_STEP_MS * 1000LL) return;
+    lastStep = now;
+    uint64_t nowS = time_service_now_s();
+    if (nowS <= CONFIG_SCHED_COMPACT_RETENTION_S) return;
+
+    const Load_Record* load = NULL;
+    for (int i = 0; i < CONFIG_SCHED_MAX_LOADS && load == NULL; i++) {
+        load = sched_loads_get(nextLoad);
+        if (load == NULL) next_load();
+    }
+    if (load == NULL) return;
+
+    uint8_t loadNumber = nextLoad;
+    next_load();
+    uint16_t dropped = 0;
+    uint64_t upTo = nowS - CONFIG_SCHED_COMPACT_RETENTION_S - 1;
+    // Events the scheduler has not handled yet (the clock was just set forward) are left
+    // to its catch-up policy, and those past a window not refilled yet are still to fire
+    uint64_t handledUpTo = sched_handled_up_to();
+    if (upTo > handledUpTo) upTo = handledUpTo;
+    const Sched_Snapshot* snapshot = sched_snapshot_read_begin(SCHED_READER_QUERY);
+    int loadId = sched_snapshot_find_load(snapshot, loadNumber);
+    if (loadId >= 0 && upTo > snapshot->loads[loadId].windowEnd) upTo = snapshot->loads[loadId].windowEnd;
+    sched_snapshot_read_end(SCHED_READER_QUERY);
+    if (upTo == 0) return;
+    esp_err_t err = purge_due_scheds_from_NVS(loadNumber, upTo, &dropped);
+    if (err != ESP_OK) {
+        SCHED_LOG("Error (%s) compacting load %s!\n", esp_err_to_name(err), load->name);
+        return;
+    }
+    if (dropped == 0) return;
+    loadsRewritten++;
+    eventsDropped += dropped;
+
+    // The scheduler drops the same events from its table
+    Sched_Delta delta;
+    memset(&delta, 0, sizeof(delta));
+    delta.type = SCHED_DELTA_PURGE;
+    delta.loadNumber = loadNumber;
+    strcpy(delta.loadName, load->name);
+    delta.date = upTo;
+    commit_sched_change(&delta);
+}
+
+void sched_compact_print_stats(void)
+{
+    printf("Compaction: %u passes, %u loads rewritten, %u expired events dropped (retention %d s).\n",
+           passes, loadsRewritten, eventsDropped, CONFIG_SCHED_COMPACT_RETENTION_S);
+}
+
+#else
+
+void sched_compact_step(void)
+{
+}
+
+void sched_compact_print_stats(void)
+{
+    printf("Compaction is disabled (CONFIG_SCHED_COMPACT).\n");
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef SCHED_COMPACT_H_
+#define SCHED_COMPACT_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+/* Idle-time compaction of the schedules in NVS. Events only leave NVS when
+   the scheduler reports them fired, so dates that were never fired (the
+   device was off, the clock jumped) stay in the blobs. The command task
+   calls sched_compact_step when it has nothing else to do; each step
+   handles a single load, dropping its events older than
+   CONFIG_SCHED_COMPACT_RETENTION_S and rewriting its keys only if some
+   were dropped, then returns. Only events the scheduler has handled are
+   dropped: never later than its handled date, nor past the load's window. Steps are at least CONFIG_SCHED_COMPACT_STEP_MS
+   apart, so a pass over N loads takes N steps.
+ */
+void sched_compact_step(void);
+void sched_compact_print_stats(void);
+
+#endif
@@ -0,0 +1,21 @@
+#include <string.h>
+
+#include "sched_fixed.h"
+
+uint8_t fixed_list_insert(void* items, uint16_t* count, uint16_t capacity, size_t itemSize, uint16_t position, const void* item)
+{
+    if (*count >= capacity || position > *count) return 0;
+    uint8_t* slot = (uint8_t*) items + position * itemSize;
+    memmove(slot + itemSize, slot, (*count - position) * itemSize);
+    memcpy(slot, item, itemSize);
+    (*count)++;
+    return 1;
+}
+
+void fixed_list_remove(void* items, uint16_t* count, size_t itemSize, uint16_t position)
+{
+    if (position >= *count) return;
+    uint8_t* slot = (uint8_t*) items + position * itemSize;
+    memmove(slot, slot + itemSize, (*count - position - 1) * itemSize);
+    (*count)--;
+}
@@ -0,0 +1,27 @@
+#ifndef SCHED_FIXED_H_
+#define SCHED_FIXED_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Fixed-capacity list of "type" items stored inline, so it never uses the
+   heap. The capacity is a compile-time constant (a Kconfig limit) checked
+   against the 16-bit count when the type is declared, and every insertion
+   is checked against it at run time instead of writing past the end.
+ */
+#define FIXED_LIST_TYPE(name, type, capacity) \
+    _Static_assert((capacity) > 0 && (capacity) <= UINT16_MAX, #name " capacity must fit a 16-bit count"); \
+    typedef struct { uint16_t count; type items[capacity]; } name
+
+#define FIXED_LIST_CAPACITY(list) (sizeof((list)->items) / sizeof((list)->items[0]))
+
+// Insert "item" at "position" (0..count), returns 0 when the list is full
+#define FIXED_LIST_INSERT(list, position, item) \
+    fixed_list_insert((list)->items, &(list)->count, FIXED_LIST_CAPACITY(list), sizeof((list)->items[0]), (position), (item))
+#define FIXED_LIST_REMOVE(list, position) \
+    fixed_list_remove((list)->items, &(list)->count, sizeof((list)->items[0]), (position))
+
+uint8_t fixed_list_insert(void* items, uint16_t* count, uint16_t capacity, size_t itemSize, uint16_t position, const void* item);
+void fixed_list_remove(void* items, uint16_t* count, size_t itemSize, uint16_t position);
+
+#endif
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "sdkconfig.h"
+#include "cJSON.h"
+
+#include "sched_heap.h"
+
+// Commands 0..15 have their own statistics, the others are counted together
+#define HEAP_COMMAND_SLOTS 16
+
+/* Every block starts with this header, 8 bytes so the payload keeps the
+   alignment malloc gives */
+typedef struct
+{
+    uint32_t size;
+    uint16_t fromCommandTask;
+    uint16_t fromArena;
+} Heap_Header;
+
+#define HEAP_ALIGN(size) (((size) + 7) & ~7)
+
+typedef struct
+{
+    uint32_t commands;
+    uint32_t allocations;
+    uint32_t bytes;                 // allocated in total
+    uint32_t peakBytesSum;
+    uint32_t peakBytes;             // most bytes held at once by one command
+    uint32_t leakedBytes;           // still held when their command ended
+    uint32_t leakingCommands;
+    int32_t lastFreeHeapDelta;
+    int32_t lastLargestBlockDelta;
+    uint32_t minLargestBlock;       // smallest largest free block seen at the end of a command
+} Heap_Command_Stats;
+
+static TaskHandle_t commandTask = NULL;
+static uint8_t commandDepth = 0;
+
+// Command task counters, only touched by the command task
+static uint32_t commandAllocations = 0;
+static uint32_t commandBytes = 0;
+static uint32_t commandLiveBytes = 0;
+static uint32_t windowAllocations;
+static uint32_t windowBytes;
+static uint32_t windowStartLive;
+static uint32_t windowPeakLive;
+static size_t windowFreeHeap;
+static size_t windowLargestBlock;
+
+// Other tasks (BLE host) may allocate and free concurrently
+static atomic_uint otherAllocations;
+static atomic_uint otherLiveBytes;
+
+static Heap_Command_Stats commandStats[HEAP_COMMAND_SLOTS + 1];
+
+/* Bump arena for the blocks of one command: a command allocates its JSON
+   tree and frees it before ending, so the arena is rewound as soon as its
+   live bytes drop to zero. Blocks that do not fit fall back to malloc. */
+static uint64_t commandArena[CONFIG_SCHED_COMMAND_ARENA_SIZE / sizeof(uint64_t)];
+static uint32_t arenaUsed = 0;
+static uint32_t arenaLive = 0;
+static uint32_t arenaHighWater = 0;
+static uint32_t arenaFallbacks = 0;
+
+static Heap_Header* arena_alloc(size_t size)
+{
+    uint32_t blockSize = HEAP_ALIGN(sizeof(Heap_Header) + size);
+    if (blockSize > sizeof(commandArena) - arenaUsed) {
+        arenaFallbacks++;
+        return NULL;
+    }
+    Heap_Header* header = (Heap_Header*) ((uint8_t*) commandArena + arenaUsed);
+    arenaUsed += blockSize;
+    arenaLive += blockSize;
+    if (arenaUsed > arenaHighWater) arenaHighWater = arenaUsed;
+    return header;
+}
+
+static uint8_t in_command_task(void)
+{
+    return commandTask != NULL && xTaskGetCurrentTaskHandle() == commandTask;
+}
+
+void* sched_heap_alloc(size_t size)
+{
+    uint16_t fromCommandTask = in_command_task();
+    Heap_Header* header = (fromCommandTask && commandDepth > 0) ? arena_alloc(size) : NULL;
+    uint16_t fromArena = header != NULL;
+    if (header == NULL) header = malloc(sizeof(Heap_Header) + size);
+    if (header == NULL) return NULL;
+    header->size = size;
+    header->fromCommandTask = fromCommandTask;
+    header->fromArena = fromArena;
+    if (header->fromCommandTask) {
+        commandAllocations++;
+        commandBytes += size;
+        commandLiveBytes += size;
+        if (commandLiveBytes > windowPeakLive) windowPeakLive = commandLiveBytes;
+    } else {
+        atomic_fetch_add(&otherAllocations, 1);
+        atomic_fetch_add(&otherLiveBytes, size);
+    }
+    return header + 1;
+}
+
+void sched_heap_free(void* pointer)
+{
+    if (pointer == NULL) return;
+    Heap_Header* header = (Heap_Header*) pointer - 1;
+    if (header->fromCommandTask) commandLiveBytes -= header->size;
+    else atomic_fetch_sub(&otherLiveBytes, header->size);
+    if (header->fromArena) {
+        arenaLive -= HEAP_ALIGN(sizeof(Heap_Header) + header->size);
+        if (arenaLive == 0) arenaUsed = 0;
+    }
+    else free(header);
+}
+
+void sched_heap_init(void)
+{
+    cJSON_Hooks hooks = { sched_heap_alloc, sched_heap_free };
+    cJSON_InitHooks(&hooks);
+    sched_heap_reset_stats();
+}
+
+/* Start charging the command task allocations to the command about to be
+   processed. Commands run from inside another one (replays, benchmarks) are
+   charged to the outer one. */
+void sched_heap_command_begin(void)
+{
+    if (commandDepth++ > 0) return;
+    commandTask = xTaskGetCurrentTaskHandle();
+    windowAllocations = commandAllocations;
+    windowBytes = commandBytes;
+    windowStartLive = commandLiveBytes;
+    windowPeakLive = commandLiveBytes;
+    windowFreeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    windowLargestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+}
+
+void sched_heap_command_end(uint8_t command)
+{
+    if (--commandDepth > 0) return;
+    Heap_Command_Stats* stats = &commandStats[command < HEAP_COMMAND_SLOTS ? command : HEAP_COMMAND_SLOTS];
+    size_t largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    uint32_t peak = windowPeakLive - windowStartLive;
+
+    stats->commands++;
+    stats->allocations += commandAllocations - windowAllocations;
+    stats->bytes += commandBytes - windowBytes;
+    stats->peakBytesSum += peak;
+    if (peak > stats->peakBytes) stats->peakBytes = peak;
+    if (commandLiveBytes > windowStartLive) {
+        stats->leakedBytes += commandLiveBytes - windowStartLive;
+        stats->leakingCommands++;
+        printf("Command %d kept %u bytes allocated after it ended!\n", command, commandLiveBytes - windowStartLive);
+    }
+    stats->lastFreeHeapDelta = (int32_t)(heap_caps_get_free_size(MALLOC_CAP_8BIT) - windowFreeHeap);
+    stats->lastLargestBlockDelta = (int32_t)(largestBlock - windowLargestBlock);
+    if (stats->minLargestBlock == 0 || largestBlock < stats->minLargestBlock) stats->minLargestBlock = largestBlock;
+}
+
+void sched_heap_get_totals(uint32_t* allocations, uint32_t* liveBytes)
+{
+    *allocations = commandAllocations;
+    *liveBytes = commandLiveBytes;
+}
+
+void sched_heap_print_stats(void)
+{
+    printf("Heap: %d bytes free, largest free block %d, minimum free since boot %d\n",
+           heap_caps_get_free_size(MALLOC_CAP_8BIT), heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+           heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+    printf("Command  count  allocs   alloc B  avg peak B  max peak B  leaked B  free delta  block delta  min block\n");
+    for (uint8_t i = 0; i <= HEAP_COMMAND_SLOTS; i++) {
+        const Heap_Command_Stats* stats = &commandStats[i];
+        if (stats->commands == 0) continue;
+        if (i < HEAP_COMMAND_SLOTS) printf("%7d", i);
+        else printf("  other");
+        printf("  %5u  %6u  %8u  %10u  %10u  %8u  %10d  %11d  %9u\n", stats->commands, stats->allocations,
+               stats->bytes, stats->peakBytesSum / stats->commands, stats->peakBytes, stats->leakedBytes,
+               stats->lastFreeHeapDelta, stats->lastLargestBlockDelta, stats->minLargestBlock);
+    }
+    printf("Other tasks: %u allocations, %u bytes held now\n", atomic_load(&otherAllocations), atomic_load(&otherLiveBytes));
+    printf("Command arena: %u of %d bytes at most, %u allocations fell back to malloc\n",
+           arenaHighWater, CONFIG_SCHED_COMMAND_ARENA_SIZE, arenaFallbacks);
+}
+
+void sched_heap_reset_stats(void)
+{
+    memset(commandStats, 0, sizeof(commandStats));
+    arenaHighWater = arenaUsed;
+    arenaFallbacks = 0;
+}
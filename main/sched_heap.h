@@ -0,0 +1,28 @@
+#ifndef SCHED_HEAP_H_
+#define SCHED_HEAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+/* Accounted allocator for the command path: cJSON (through its hooks),
+   the schedule buffers of the storage functions and the BLE message
+   copies. Blocks from sched_heap_alloc must be released with sched_heap_free.
+   Allocations made by the command task inside process_command are charged
+   to the command being processed; those of other tasks are counted apart.
+   Blocks of a command come from a static arena of
+   CONFIG_SCHED_COMMAND_ARENA_SIZE bytes while it has room.
+ */
+#define SCHED_HEAP_RAM_BYTES CONFIG_SCHED_COMMAND_ARENA_SIZE
+
+void sched_heap_init(void);
+void* sched_heap_alloc(size_t size);
+void sched_heap_free(void* pointer);
+
+void sched_heap_command_begin(void);
+void sched_heap_command_end(uint8_t command);
+void sched_heap_get_totals(uint32_t* allocations, uint32_t* liveBytes);
+void sched_heap_print_stats(void);
+void sched_heap_reset_stats(void);
+
+#endif
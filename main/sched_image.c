@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+#include "nvs_blob_example_main.h"
+#include "nvs_storage.h"
+#include "sched_image.h"
+
+#define IMAGE_NAMESPACE "Storage"
+#define IMAGE_KEY "schedImage"
+#define IMAGE_MAGIC 0x474D4953      // "SIMG"
+// The window is part of the version: an image cut to another window is rebuilt
+#define IMAGE_VERSION (1 + 2 * SCHED_WINDOW_EVENTS)
+
+typedef enum
+{
+    IMAGE_UNKNOWN,      // not read yet, may be on flash
+    IMAGE_VALID,
+    IMAGE_INVALID       // erased or never written
+} Image_State;
+
+static Image_State imageState = IMAGE_UNKNOWN;
+static uint8_t dirty = 0;
+static int64_t lastChange = 0;
+static uint32_t imageWrites = 0;
+static uint32_t invalidations = 0;
+static uint8_t lastLoadFromImage = 0;
+static int64_t lastLoadUs = -1;
+
+static uint32_t crc32(const uint8_t* data, size_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    while (length--) {
+        crc ^= *data++;
+        for (uint8_t bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+size_t sched_image_size(const void* image)
+{
+    const Sched_Image_Header* header = image;
+    return SCHED_IMAGE_EVENTS_OFFSET(header->numberOfLoads) + header->numberOfEvents * sizeof(Date_and_Reps);
+}
+
+void sched_image_seal(void* image, uint8_t numberOfLoads, uint32_t numberOfEvents)
+{
+    Sched_Image_Header* header = image;
+    header->magic = IMAGE_MAGIC;
+    header->version = IMAGE_VERSION;
+    header->numberOfLoads = numberOfLoads;
+    header->reserved = 0;
+    header->numberOfEvents = numberOfEvents;
+    header->checksum = crc32((const uint8_t*) image + sizeof(*header), sched_image_size(image) - sizeof(*header));
+}
+
+#if CONFIG_SCHED_BOOT_IMAGE
+
+static esp_err_t validate(void* image, size_t length)
+{
+    Sched_Image_Header* header = image;
+    if (length < sizeof(*header) || header->magic != IMAGE_MAGIC || header->version != IMAGE_VERSION) return ESP_ERR_INVALID_VERSION;
+    if (header->numberOfLoads > CONFIG_SCHED_MAX_LOADS || header->numberOfEvents > SCHED_LOADED_EVENTS
+        || sched_image_size(image) != length) return ESP_ERR_INVALID_SIZE;
+    if (crc32((const uint8_t*) image + sizeof(*header), length - sizeof(*header)) != header->checksum) return ESP_ERR_INVALID_CRC;
+    Sched_Image_Load* loads = (Sched_Image_Load*) (header + 1);
+    uint32_t numberOfEvents = 0;
+    for (uint8_t l = 0; l < header->numberOfLoads; l++) {
+        loads[l].loadName[sizeof(loads[l].loadName) - 1] = '\0';
+        numberOfEvents += loads[l].numOfEventsON + loads[l].numOfEventsOFF;
+    }
+    return numberOfEvents == header->numberOfEvents ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+/* A write to the schedules or the loads is about to be done: the image is
+   erased first, as NVS persists the write at once, so a reset right after
+   it never finds a stale image. If the erase fails the write is refused.
+   Only the first write after the image was written or read costs an erase. */
+static esp_err_t on_storage_write(const char* namespaceName, const char* key)
+{
+    if (namespaceName != NULL && strcmp(namespaceName, SCHEDULES_STORAGE_NAMESPACE) != 0
+        && strcmp(namespaceName, LOADS_STORAGE_NAMESPACE) != 0) return ESP_OK;
+    dirty = 1;
+    lastChange = esp_timer_get_time();
+    if (imageState == IMAGE_INVALID) return ESP_OK;
+
+    nvs_handle_t handle;
+    esp_err_t err = storage_open(IMAGE_NAMESPACE, &handle);
+    if (err == ESP_OK) {
+        err = storage_erase_key(handle, IMAGE_KEY);
+        if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+        if (err == ESP_OK) err = storage_commit(handle);
+        storage_close(handle);
+    }
+    if (err != ESP_OK) {
+        printf("Error (%s) erasing the boot image, write to %s refused!\n", esp_err_to_name(err), key);
+        return err;
+    }
+    imageState = IMAGE_INVALID;
+    invalidations++;
+    return ESP_OK;
+}
+
+void sched_image_init(void)
+{
+    storage_add_write_hook(on_storage_write);
+}
+
+esp_err_t sched_image_read(void* image, size_t capacity)
+{
+    nvs_handle_t handle;
+    size_t length = capacity;
+    esp_err_t err = storage_open(IMAGE_NAMESPACE, &handle);
+    if (err == ESP_OK) {
+        err = storage_get_blob(handle, IMAGE_KEY, image, &length);
+        storage_close(handle);
+    }
+    if (err == ESP_OK) err = validate(image, length);
+    if (err == ESP_OK) imageState = IMAGE_VALID;
+    else {
+        // Missing or unusable: a new one is written once the schedules are quiet
+        if (err != ESP_ERR_NVS_NOT_FOUND) printf("Boot image unusable (%s), reading the schedule keys.\n", esp_err_to_name(err));
+        imageState = IMAGE_INVALID;
+        if (!dirty) lastChange = esp_timer_get_time();
+        dirty = 1;
+    }
+    return err;
+}
+
+esp_err_t sched_image_write(const void* image)
+{
+    nvs_handle_t handle;
+    esp_err_t err = storage_open(IMAGE_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    err = storage_set_blob(handle, IMAGE_KEY, image, sched_image_size(image));
+    if (err == ESP_OK) err = storage_commit(handle);
+    storage_close(handle);
+    if (err != ESP_OK) return err;
+    imageState = IMAGE_VALID;
+    dirty = 0;
+    imageWrites++;
+    return ESP_OK;
+}
+
+/* Whether the image should be written now. A failed attempt is retried
+   after another CONFIG_SCHED_BOOT_IMAGE_DELAY_S. */
+uint8_t sched_image_is_due(void)
+{
+    int64_t now = esp_timer_get_time();
+    if (!dirty || now - lastChange < CONFIG_SCHED_BOOT_IMAGE_DELAY_S * 1000000LL) return 0;
+    lastChange = now;
+    return 1;
+}
+
+#else
+
+void sched_image_init(void)
+{
+}
+
+esp_err_t sched_image_read(void* image, size_t capacity)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t sched_image_write(const void* image)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+uint8_t sched_image_is_due(void)
+{
+    return 0;
+}
+
+#endif
+
+void sched_image_record_load(uint8_t fromImage, int64_t elapsedUs)
+{
+    lastLoadFromImage = fromImage;
+    lastLoadUs = elapsedUs;
+}
+
+void sched_image_print_stats(void)
+{
+#if CONFIG_SCHED_BOOT_IMAGE
+    const char* states[] = { "not read", "current", "stale" };
+    printf("Boot image: %s%s, %u writes, %u invalidations.\n", states[imageState], dirty ? " (rewrite pending)" : "",
+           imageWrites, invalidations);
+#else
+    printf("Boot image disabled (CONFIG_SCHED_BOOT_IMAGE).\n");
+#endif
+    if (lastLoadUs >= 0) printf("Last table load: %lld us from %s.\n", lastLoadUs, lastLoadFromImage ? "the boot image" : "the schedule keys");
+}
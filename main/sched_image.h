@@ -0,0 +1,59 @@
+#ifndef SCHED_IMAGE_H_
+#define SCHED_IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+#include "sched_snapshot.h"
+
+/* Boot image of the schedule table: a single blob in the Storage namespace
+   holding every load and every ON/OFF list, in the layout of the loader
+   arena of return_sched_from_NVS, so the table is loaded with one read and
+   a checksum instead of two blob reads per load. The first write to
+   schedList or loadList after an image was written or read erases it
+   before the write reaches flash (a storage write hook), and the write is
+   refused if the erase fails, so an image that is present is current even
+   after a reset. The command task writes a new one once
+   the schedules have not changed for CONFIG_SCHED_BOOT_IMAGE_DELAY_S.
+
+   With a window (CONFIG_SCHED_WINDOW_EVENTS) each list holds only the
+   events the loader keeps, SCHED_LOADED_EVENTS_PER_LIST at most.
+
+   Layout: the header, one record per load, padding to 8 bytes, then the ON
+   and the OFF list of each load in record order.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint8_t numberOfLoads;
+    uint8_t reserved;
+    uint32_t numberOfEvents;
+    uint32_t checksum;          // CRC-32 of everything after the header
+} Sched_Image_Header;
+
+typedef struct
+{
+    char loadName[20];
+    uint8_t loadNumber;
+    uint8_t pinNumber;
+    uint16_t numOfEventsON;
+    uint16_t numOfEventsOFF;
+} Sched_Image_Load;
+
+#define SCHED_IMAGE_EVENTS_OFFSET(numberOfLoads) \
+    SCHED_SNAPSHOT_ALIGN(sizeof(Sched_Image_Header) + (numberOfLoads) * sizeof(Sched_Image_Load))
+#define SCHED_IMAGE_MAX_BYTES (SCHED_IMAGE_EVENTS_OFFSET(CONFIG_SCHED_MAX_LOADS) + SCHED_LOADED_EVENTS * sizeof(Date_and_Reps))
+
+void sched_image_init(void);
+esp_err_t sched_image_read(void* image, size_t capacity);
+void sched_image_seal(void* image, uint8_t numberOfLoads, uint32_t numberOfEvents);
+esp_err_t sched_image_write(const void* image);
+size_t sched_image_size(const void* image);
+uint8_t sched_image_is_due(void);
+void sched_image_record_load(uint8_t fromImage, int64_t elapsedUs);
+void sched_image_print_stats(void);
+
+#endif
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "nvs.h"
+
+#include "nvs_blob_example_main.h"
+#include "nvs_storage.h"
+#include "sched_loads.h"
+#include "sched_log.h"
+
+static Load_Record loadRecords[CONFIG_SCHED_MAX_LOADS];
+static uint32_t nameHashes[CONFIG_SCHED_MAX_LOADS];
+static uint8_t loadUsed[CONFIG_SCHED_MAX_LOADS];
+static uint8_t numberOfLoads = 0;
+
+// FNV-1a, so a lookup compares one word per load before any string
+static uint32_t name_hash(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name) hash = (hash ^ (uint8_t) *name++) * 16777619u;
+    return hash;
+}
+
+void sched_loads_record_key(uint8_t loadNumber, char* key)
+{
+    sprintf(key, "L%03u", loadNumber);
+}
+
+void sched_loads_sched_key(uint8_t loadNumber, uint8_t loadState, char* key)
+{
+    sprintf(key, "L%03u%s", loadNumber, loadState ? "ON" : "OFF");
+}
+
+int sched_loads_find(const char* name)
+{
+    uint32_t hash = name_hash(name);
+    for (int i = 0; i < CONFIG_SCHED_MAX_LOADS; i++) {
+        if (loadUsed[i] && nameHashes[i] == hash && strcmp(loadRecords[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+const Load_Record* sched_loads_get(uint8_t loadNumber)
+{
+    if (loadNumber >= CONFIG_SCHED_MAX_LOADS || !loadUsed[loadNumber]) return NULL;
+    return &loadRecords[loadNumber];
+}
+
+uint8_t sched_loads_count(void)
+{
+    return numberOfLoads;
+}
+
+static void set_record(uint8_t loadNumber, const Load_Record* record)
+{
+    if (!loadUsed[loadNumber]) numberOfLoads++;
+    loadRecords[loadNumber] = *record;
+    nameHashes[loadNumber] = name_hash(record->name);
+    loadUsed[loadNumber] = 1;
+}
+
+/* Register a load, or change the pin of a registered one. The number
+   given to a new load is the lowest one free. */
+esp_err_t sched_loads_register(const char* name, uint8_t pinNumber, uint8_t* loadNumber)
+{
+    size_t length = strlen(name);
+    if (length == 0 || length >= SCHED_LOAD_NAME_LEN) {
+        SCHED_LOG("Load names must have 1 to %d characters!\n", SCHED_LOAD_NAME_LEN - 1);
+        return ESP_ERR_INVALID_ARG;
+    }
+    int number = sched_loads_find(name);
+    if (number < 0) {
+        for (number = 0; number < CONFIG_SCHED_MAX_LOADS && loadUsed[number]; number++);
+        if (number == CONFIG_SCHED_MAX_LOADS) {
+            SCHED_LOG("%d loads registered, the maximum!\n", numberOfLoads);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    Load_Record record;
+    memset(&record, 0, sizeof(record));
+    strcpy(record.name, name);
+    record.pinNumber = pinNumber;
+    char key[SCHED_LOAD_KEY_LEN];
+    sched_loads_record_key(number, key);
+
+    nvs_handle_t handle;
+    esp_err_t err = storage_open(LOADS_STORAGE_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    err = storage_set_blob(handle, key, &record, sizeof(record));
+    if (err == ESP_OK) err = storage_commit(handle);
+    storage_close(handle);
+    if (err != ESP_OK) return err;
+
+    set_record(number, &record);
+    *loadNumber = number;
+    return ESP_OK;
+}
+
+// Erase the load record and both schedule lists
+esp_err_t sched_loads_remove(uint8_t loadNumber)
+{
+    char key[SCHED_LOAD_KEY_LEN];
+    nvs_handle_t handle;
+    if (sched_loads_get(loadNumber) == NULL) return ESP_ERR_NOT_FOUND;
+
+    esp_err_t err = storage_open(SCHEDULES_STORAGE_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    storage_txn_begin(handle);
+    for (uint8_t loadState = 0; loadState < 2; loadState++) {
+        sched_loads_sched_key(loadNumber, loadState, key);
+        storage_erase_key(handle, key);
+    }
+    err = storage_txn_commit(handle);
+    storage_close(handle);
+    if (err != ESP_OK) return err;
+
+    err = storage_open(LOADS_STORAGE_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    sched_loads_record_key(loadNumber, key);
+    err = storage_erase_key(handle, key);
+    if (err == ESP_OK) err = storage_commit(handle);
+    storage_close(handle);
+    if (err != ESP_OK) return err;
+
+    loadUsed[loadNumber] = 0;
+    numberOfLoads--;
+    return ESP_OK;
+}
+
+/* Move the schedules of a load registered by older firmware (pin stored
+   under the load name, schedules under "<name>ON" / "<name>OFF") to the
+   keys of its number, then drop the old pin entry. Runs once at boot. */
+static esp_err_t migrate_legacy_load(const char* name, uint8_t pinNumber)
+{
+    uint8_t loadNumber;
+    esp_err_t err = sched_loads_register(name, pinNumber, &loadNumber);
+    if (err != ESP_OK) return err;
+
+    nvs_handle_t handle;
+    err = storage_open(SCHEDULES_STORAGE_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    for (uint8_t loadState = 0; loadState < 2 && err == ESP_OK; loadState++) {
+        char oldKey[SCHED_LOAD_KEY_LEN + 4];
+        char newKey[SCHED_LOAD_KEY_LEN];
+        snprintf(oldKey, sizeof(oldKey), "%s%s", name, loadState ? "ON" : "OFF");
+        sched_loads_sched_key(loadNumber, loadState, newKey);
+        size_t length = 0;
+        err = storage_get_blob(handle, oldKey, NULL, &length);
+        if (err == ESP_ERR_NVS_NOT_FOUND || (err == ESP_OK && length == 0)) {
+            err = ESP_OK;
+            continue;
+        }
+        if (err != ESP_OK) break;
+        // Boot-time only, before the scheduler runs, so a transient buffer is fine
+        void* events = malloc(length);
+        if (events == NULL) {
+            err = ESP_ERR_NO_MEM;
+            break;
+        }
+        err = storage_get_blob(handle, oldKey, events, &length);
+        if (err == ESP_OK) err = storage_set_blob(handle, newKey, events, length);
+        if (err == ESP_OK) err = storage_erase_key(handle, oldKey);
+        free(events);
+    }
+    if (err == ESP_OK) err = storage_commit(handle);
+    storage_close(handle);
+    if (err != ESP_OK) return err;
+
+    err = storage_open(LOADS_STORAGE_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    err = storage_erase_key(handle, name);
+    if (err == ESP_OK) err = storage_commit(handle);
+    storage_close(handle);
+    if (err == ESP_OK) printf("Load %s migrated to number %d.\n", name, loadNumber);
+    return err;
+}
+
+/* Read the registry from loadList and migrate the loads saved by older firmware */
+esp_err_t sched_loads_init(void)
+{
+    nvs_handle_t handle;
+    memset(loadUsed, 0, sizeof(loadUsed));
+    numberOfLoads = 0;
+
+    esp_err_t err = storage_open(LOADS_STORAGE_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    nvs_iterator_t it = nvs_entry_find(STORAGE_PARTITION, LOADS_STORAGE_NAMESPACE, NVS_TYPE_BLOB);
+    while (it != NULL) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        it = nvs_entry_next(it);
+        unsigned loadNumber;
+        Load_Record record;
+        size_t length = sizeof(record);
+        if (sscanf(info.key, "L%3u", &loadNumber) != 1 || loadNumber >= CONFIG_SCHED_MAX_LOADS) {
+            printf("Load record %s ignored, beyond CONFIG_SCHED_MAX_LOADS!\n", info.key);
+            continue;
+        }
+        if (storage_get_blob(handle, info.key, &record, &length) != ESP_OK || length != sizeof(record)) {
+            printf("Load record %s unreadable, ignored!\n", info.key);
+            continue;
+        }
+        record.name[SCHED_LOAD_NAME_LEN - 1] = '\0';
+        set_record(loadNumber, &record);
+    }
+
+    // Loads of older firmware: collect them first, the migration rewrites the namespace
+    char legacyNames[CONFIG_SCHED_MAX_LOADS][SCHED_LOAD_KEY_LEN];
+    uint8_t legacyPins[CONFIG_SCHED_MAX_LOADS];
+    uint8_t legacyLoads = 0;
+    it = nvs_entry_find(STORAGE_PARTITION, LOADS_STORAGE_NAMESPACE, NVS_TYPE_U8);
+    while (it != NULL) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        it = nvs_entry_next(it);
+        if (legacyLoads == CONFIG_SCHED_MAX_LOADS) continue;
+        if (nvs_get_u8(handle, info.key, &legacyPins[legacyLoads]) != ESP_OK) continue;
+        strcpy(legacyNames[legacyLoads++], info.key);
+    }
+    storage_close(handle);
+
+    for (uint8_t i = 0; i < legacyLoads; i++) {
+        err = migrate_legacy_load(legacyNames[i], legacyPins[i]);
+        if (err != ESP_OK) printf("Error (%s) migrating load %s!\n", esp_err_to_name(err), legacyNames[i]);
+    }
+    printf("%d loads registered.\n", numberOfLoads);
+    return ESP_OK;
+}
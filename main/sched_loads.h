@@ -0,0 +1,35 @@
+#ifndef SCHED_LOADS_H_
+#define SCHED_LOADS_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+/* Registry of the loads. Each load gets a dense number (0 to
+   CONFIG_SCHED_MAX_LOADS - 1) when it is registered; its name and pin are
+   kept in loadList under "L<number>" and its schedules in schedList under
+   "L<number>ON" / "L<number>OFF", so keys have the same short length for
+   any name. Names are only compared once per command, to find the number.
+   Only the command task (and app_main before it) uses the registry.
+ */
+#define SCHED_LOAD_NAME_LEN 20      // including the terminator
+#define SCHED_LOAD_KEY_LEN 16
+
+typedef struct
+{
+    char name[SCHED_LOAD_NAME_LEN];
+    uint8_t pinNumber;
+} Load_Record;
+
+#define SCHED_LOADS_RAM_BYTES (CONFIG_SCHED_MAX_LOADS * (sizeof(Load_Record) + 8))
+
+esp_err_t sched_loads_init(void);
+int sched_loads_find(const char* name);
+esp_err_t sched_loads_register(const char* name, uint8_t pinNumber, uint8_t* loadNumber);
+esp_err_t sched_loads_remove(uint8_t loadNumber);
+const Load_Record* sched_loads_get(uint8_t loadNumber);
+uint8_t sched_loads_count(void);
+void sched_loads_record_key(uint8_t loadNumber, char* key);
+void sched_loads_sched_key(uint8_t loadNumber, uint8_t loadState, char* key);
+
+#endif
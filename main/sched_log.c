@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "sched_log.h"
+#include "sched_queue.h"
+#include "sched_stack.h"
+
+#if CONFIG_SCHED_DEFERRED_LOG
+
+#define SCHED_LOG_PAYLOAD 64
+#define SCHED_LOG_SPEC_MAX 16
+
+typedef struct
+{
+    const char* format;
+    uint32_t time;          // esp_timer, ms
+    uint8_t length;         // payload bytes in use
+    uint8_t truncated;      // arguments that did not fit
+    uint8_t payload[SCHED_LOG_PAYLOAD];
+} Log_Record;
+
+_Static_assert(sizeof(Log_Record) <= SCHED_LOG_RECORD_BYTES, "SCHED_LOG_RECORD_BYTES is smaller than a log record");
+
+/* One ring per producer keeps both sides lock-free: the scheduler task logs
+   into its own ring, the command task (and app_main before it) into the other.
+ */
+SPSC_QUEUE_DEFINE(commandLogQueue, Log_Record, CONFIG_SCHED_LOG_LEN);
+SPSC_QUEUE_DEFINE(schedulerLogQueue, Log_Record, CONFIG_SCHED_LOG_LEN);
+
+static StackType_t logTaskStack[CONFIG_SCHED_LOG_TASK_STACK];
+static StaticTask_t logTaskBuffer;
+
+static TaskHandle_t schedulerTaskHandle = NULL;
+static uint32_t droppedRecords[2] = {0, 0};
+static uint32_t reportedDrops[2] = {0, 0};
+
+typedef enum
+{
+    ARG_NONE,
+    ARG_INT,
+    ARG_LONG_LONG,
+    ARG_STRING,
+    ARG_POINTER,
+    ARG_UNSUPPORTED     // floating point or '*': the argument size is unknown here
+} Arg_Type;
+
+// Format of the records of SCHED_LOG_TEXT, rendered as they are
+static const char textFormat[] = "%s";
+
+/* Parse the conversion starting after a '%'. Returns the argument it takes
+   and stores the length of the specification (without the '%') in "length".
+ */
+static Arg_Type parse_conversion(const char* spec, uint8_t* length)
+{
+    uint8_t longs = 0;
+    uint8_t i = 0;
+
+    uint8_t star = 0;
+    while (spec[i] != '\0' && strchr("-+ #0123456789.*", spec[i]) != NULL) {
+        if (spec[i] == '*') star = 1;
+        i++;
+    }
+    while (spec[i] == 'l' || spec[i] == 'h' || spec[i] == 'z') {
+        if (spec[i] == 'l') longs++;
+        i++;
+    }
+    if (spec[i] == '\0') {
+        *length = i;
+        return ARG_NONE;
+    }
+    *length = i + 1;
+    if (star) return ARG_UNSUPPORTED;
+    switch (spec[i]) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            return longs >= 2 ? ARG_LONG_LONG : ARG_INT;
+        case 's':
+            return ARG_STRING;
+        case 'p':
+            return ARG_POINTER;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            return ARG_UNSUPPORTED;
+        default:
+            return ARG_NONE;
+    }
+}
+
+void sched_log(const char* format, ...)
+{
+    Log_Record record;
+    SPSC_Queue* queue = &commandLogQueue;
+    uint8_t producer = 0;
+    uint8_t length;
+    va_list args;
+
+    if (schedulerTaskHandle != NULL && xTaskGetCurrentTaskHandle() == schedulerTaskHandle) {
+        queue = &schedulerLogQueue;
+        producer = 1;
+    }
+
+    record.format = format;
+    record.time = (uint32_t)(esp_timer_get_time() / 1000);
+    record.length = 0;
+    record.truncated = 0;
+
+    va_start(args, format);
+    for (const char* c = format; *c != '\0'; c++) {
+        if (*c != '%') continue;
+        if (c[1] == '%') {
+            c++;
+            continue;
+        }
+        Arg_Type type = parse_conversion(c + 1, &length);
+        c += length;
+        // Once an argument did not fit the following ones are dropped too
+        if (record.truncated > 0 && type != ARG_NONE) record.truncated++;
+        // Without its size, the arguments after it cannot be found
+        else if (type == ARG_UNSUPPORTED) record.truncated++;
+        else if (type == ARG_INT) {
+            uint32_t value = va_arg(args, uint32_t);
+            if (record.length + sizeof(value) <= SCHED_LOG_PAYLOAD) {
+                memcpy(&record.payload[record.length], &value, sizeof(value));
+                record.length += sizeof(value);
+            } else record.truncated++;
+        } else if (type == ARG_LONG_LONG) {
+            uint64_t value = va_arg(args, uint64_t);
+            if (record.length + sizeof(value) <= SCHED_LOG_PAYLOAD) {
+                memcpy(&record.payload[record.length], &value, sizeof(value));
+                record.length += sizeof(value);
+            } else record.truncated++;
+        } else if (type == ARG_POINTER) {
+            void* value = va_arg(args, void*);
+            if (record.length + sizeof(value) <= SCHED_LOG_PAYLOAD) {
+                memcpy(&record.payload[record.length], &value, sizeof(value));
+                record.length += sizeof(value);
+            } else record.truncated++;
+        } else if (type == ARG_STRING) {
+            const char* value = va_arg(args, const char*);
+            size_t size = strnlen(value != NULL ? value : "(null)", SCHED_LOG_STRING_MAX - 1);
+            if (record.length + size + 1 <= SCHED_LOG_PAYLOAD) {
+                memcpy(&record.payload[record.length], value != NULL ? value : "(null)", size);
+                record.payload[record.length + size] = '\0';
+                record.length += size + 1;
+            } else record.truncated++;
+        }
+    }
+    va_end(args);
+
+    // Never wait for the logger, count what does not fit
+    if (!spsc_queue_push(queue, &record)) droppedRecords[producer]++;
+}
+
+/* Consecutive records of the producer's ring, each with a piece of the
+   text; the last one ends the line */
+void sched_log_text(const char* text)
+{
+    Log_Record record;
+    SPSC_Queue* queue = &commandLogQueue;
+    uint8_t producer = 0;
+    if (schedulerTaskHandle != NULL && xTaskGetCurrentTaskHandle() == schedulerTaskHandle) {
+        queue = &schedulerLogQueue;
+        producer = 1;
+    }
+
+    size_t length = strnlen(text, CONFIG_SCHED_MAX_COMMAND_LEN);
+    size_t offset = 0;
+    do {
+        // Room for the newline of the last piece and the terminator
+        size_t piece = length - offset < SCHED_LOG_PAYLOAD - 2 ? length - offset : SCHED_LOG_PAYLOAD - 2;
+        record.format = textFormat;
+        record.time = (uint32_t)(esp_timer_get_time() / 1000);
+        record.truncated = 0;
+        memcpy(record.payload, text + offset, piece);
+        offset += piece;
+        if (offset == length) record.payload[piece++] = '\n';
+        record.payload[piece] = '\0';
+        record.length = piece + 1;
+        if (!spsc_queue_push(queue, &record)) droppedRecords[producer]++;
+    } while (offset < length);
+}
+
+static void render(const Log_Record* record)
+{
+    char spec[SCHED_LOG_SPEC_MAX + 2];
+    uint8_t offset = 0;
+    uint8_t length;
+    const char* text = record->format;
+
+    if (record->format == textFormat) {
+        fputs((const char*) record->payload, stdout);
+        return;
+    }
+    printf("[%u] ", record->time);
+    if (record->truncated > 0) printf("(%u arguments truncated) ", record->truncated);
+    while (*text != '\0') {
+        const char* percent = strchr(text, '%');
+        if (percent == NULL) {
+            fputs(text, stdout);
+            break;
+        }
+        fwrite(text, 1, percent - text, stdout);
+        if (percent[1] == '%') {
+            putchar('%');
+            text = percent + 2;
+            continue;
+        }
+        Arg_Type type = parse_conversion(percent + 1, &length);
+        text = percent + 1 + length;
+        if (length > SCHED_LOG_SPEC_MAX) type = ARG_NONE;
+        else {
+            memcpy(spec, percent, length + 1);
+            spec[length + 1] = '\0';
+        }
+
+        if (type == ARG_INT && offset + sizeof(uint32_t) <= record->length) {
+            uint32_t value;
+            memcpy(&value, &record->payload[offset], sizeof(value));
+            printf(spec, value);
+            offset += sizeof(value);
+        } else if (type == ARG_LONG_LONG && offset + sizeof(uint64_t) <= record->length) {
+            uint64_t value;
+            memcpy(&value, &record->payload[offset], sizeof(value));
+            printf(spec, value);
+            offset += sizeof(value);
+        } else if (type == ARG_POINTER && offset + sizeof(void*) <= record->length) {
+            void* value;
+            memcpy(&value, &record->payload[offset], sizeof(value));
+            printf(spec, value);
+            offset += sizeof(value);
+        } else if (type == ARG_STRING && offset < record->length) {
+            const char* value = (const char*) &record->payload[offset];
+            printf(spec, value);
+            offset += strlen(value) + 1;
+        } else if (type != ARG_NONE) fputs("?", stdout);
+    }
+}
+
+void sched_log_flush(void)
+{
+    Log_Record record;
+    SPSC_Queue* queues[2] = { &commandLogQueue, &schedulerLogQueue };
+
+    for (uint8_t i = 0; i < 2; i++) {
+        while (spsc_queue_pop(queues[i], &record)) render(&record);
+        uint32_t dropped = droppedRecords[i];
+        if (dropped != reportedDrops[i]) {
+            printf("%u %s log records dropped, the log ring was full.\n", dropped - reportedDrops[i], i == 0 ? "command" : "scheduler");
+            reportedDrops[i] = dropped;
+        }
+    }
+    fflush(stdout);
+}
+
+static void task_drain_log()
+{
+    while (1)
+    {
+        sched_log_flush();
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_SCHED_LOG_DRAIN_MS));
+    }
+}
+
+void sched_log_init(void)
+{
+    TaskHandle_t logTask = xTaskCreateStatic(task_drain_log, "task_drain_log", CONFIG_SCHED_LOG_TASK_STACK, NULL,
+                                             CONFIG_SCHED_LOG_TASK_PRIORITY, logTaskStack, &logTaskBuffer);
+    sched_stack_register_task(logTask, "task_drain_log", "CONFIG_SCHED_LOG_TASK_STACK", logTaskStack, CONFIG_SCHED_LOG_TASK_STACK);
+}
+
+/* Called by the scheduler task before it logs anything, from then on its
+   records go to its own ring
+ */
+void sched_log_register_scheduler_task(void)
+{
+    schedulerTaskHandle = xTaskGetCurrentTaskHandle();
+}
+
+#else
+
+void sched_log_init(void)
+{
+}
+
+void sched_log_register_scheduler_task(void)
+{
+}
+
+void sched_log(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+void sched_log_text(const char* text)
+{
+    printf("%s\n", text);
+}
+
+void sched_log_flush(void)
+{
+}
+
+#endif
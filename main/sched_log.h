@@ -0,0 +1,39 @@
+#ifndef SCHED_LOG_H_
+#define SCHED_LOG_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+/* Deferred logger for the command and scheduler hot paths. sched_log only
+   copies the format string address and its arguments into a ring; a low
+   priority task renders them with printf later. Integer arguments keep their
+   size from the format length modifier and strings are copied (truncated to
+   SCHED_LOG_STRING_MAX - 1 characters, enough for load names, keys and
+   error names), so stack buffers may be logged. Longer text, such as a
+   received command, goes through SCHED_LOG_TEXT, split over as many records
+   as it needs. Floating point and '*' conversions are not supported: the
+   build rejects them (tools/check_log_formats.py) and at run time the
+   arguments from such a conversion on are dropped, never misaligned.
+ */
+#define SCHED_LOG_STRING_MAX 32
+
+#if CONFIG_SCHED_DEFERRED_LOG
+#define SCHED_LOG(...) sched_log(__VA_ARGS__)
+// "text" on a line of its own, at most CONFIG_SCHED_MAX_COMMAND_LEN characters
+#define SCHED_LOG_TEXT(text) sched_log_text(text)
+// Static RAM of the two rings and the logger task
+#define SCHED_LOG_RECORD_BYTES 80
+#define SCHED_LOG_RAM_BYTES (2 * CONFIG_SCHED_LOG_LEN * SCHED_LOG_RECORD_BYTES + CONFIG_SCHED_LOG_TASK_STACK + sizeof(StaticTask_t))
+#else
+#define SCHED_LOG(...) printf(__VA_ARGS__)
+#define SCHED_LOG_TEXT(text) printf("%s\n", text)
+#define SCHED_LOG_RAM_BYTES 0
+#endif
+
+void sched_log_init(void);
+void sched_log_register_scheduler_task(void);
+void sched_log(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void sched_log_text(const char* text);
+void sched_log_flush(void);
+
+#endif
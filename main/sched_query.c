@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include "sdkconfig.h"
+
+#include "sched_query.h"
+#include "time_service.h"
+
+// Printing stops after this many events, the count is still reported
+#define QUERY_PRINT_LIMIT 200
+
+// First position of a load's view whose date is >= from
+static uint32_t view_lower_bound(const Sched_Snapshot* snapshot, const Sched_Load* load, uint64_t from)
+{
+    const uint32_t* view = &snapshot->loadEvents[load->firstEvent];
+    uint32_t low = 0;
+    uint32_t high = load->numOfEvents;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (snapshot->dates[view[middle]] < from) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+/* Merge the views of the loads on "pin". Positions in the views are
+   positions in dates[], so the smallest one is the earliest event. */
+static uint32_t query_pin(const Sched_Snapshot* snapshot, uint64_t from, uint64_t to, uint8_t pin, uint32_t limit,
+                          Sched_Query_Visit visit, void* context)
+{
+    uint8_t loads[CONFIG_SCHED_MAX_LOADS];
+    uint32_t cursors[CONFIG_SCHED_MAX_LOADS];
+    uint8_t numberOfLoads = 0;
+    for (int l = 0; l < snapshot->numberOfLoads; l++) {
+        const Sched_Load* load = &snapshot->loads[l];
+        if (load->pinNumber != pin) continue;
+        loads[numberOfLoads] = l;
+        cursors[numberOfLoads++] = view_lower_bound(snapshot, load, from);
+    }
+
+    uint32_t visited = 0;
+    while (visited < limit) {
+        int best = -1;
+        uint32_t bestEvent = 0;
+        for (int i = 0; i < numberOfLoads; i++) {
+            const Sched_Load* load = &snapshot->loads[loads[i]];
+            if (cursors[i] == load->numOfEvents) continue;
+            uint32_t event = snapshot->loadEvents[load->firstEvent + cursors[i]];
+            if (best == -1 || event < bestEvent) {
+                best = i;
+                bestEvent = event;
+            }
+        }
+        if (best == -1 || snapshot->dates[bestEvent] > to) break;
+        cursors[best]++;
+        visit(snapshot, bestEvent, context);
+        visited++;
+    }
+    return visited;
+}
+
+uint32_t sched_query_range(const Sched_Snapshot* snapshot, uint64_t from, uint64_t to, int pin, uint32_t limit,
+                           Sched_Query_Visit visit, void* context)
+{
+    if (snapshot == NULL || from > to) return 0;
+    if (pin != SCHED_QUERY_ANY_PIN) return query_pin(snapshot, from, to, pin, limit, visit, context);
+
+    uint32_t first = from > 0 ? sched_count_due(snapshot->dates, snapshot->numberOfEvents, from - 1) : 0;
+    uint32_t end = sched_count_due(snapshot->dates, snapshot->numberOfEvents, to);
+    if (end - first > limit) end = first + limit;
+    for (uint32_t e = first; e < end; e++) visit(snapshot, e, context);
+    return end - first;
+}
+
+uint32_t sched_query_next(const Sched_Snapshot* snapshot, uint64_t now, int pin, uint32_t limit,
+                          Sched_Query_Visit visit, void* context)
+{
+    if (now == UINT64_MAX) return 0;
+    return sched_query_range(snapshot, now + 1, UINT64_MAX, pin, limit, visit, context);
+}
+
+static void print_event(const Sched_Snapshot* snapshot, uint32_t event, void* context)
+{
+    uint32_t* printed = context;
+    if ((*printed)++ >= QUERY_PRINT_LIMIT) return;
+    const Sched_Load* load = &snapshot->loads[snapshot->loadId[event]];
+    printf("%lld  %-19s  pin %2d  %-3s  reps %d\n", snapshot->dates[event], load->loadName, load->pinNumber,
+           snapshot->direction[event] ? "ON" : "OFF", snapshot->reps[event]);
+}
+
+static void print_found(uint32_t found)
+{
+    if (found > QUERY_PRINT_LIMIT) printf("... %u more not printed.\n", found - QUERY_PRINT_LIMIT);
+    printf("%u events found.\n", found);
+}
+
+void sched_query_print_next(uint32_t count, int pin)
+{
+    uint32_t printed = 0;
+    uint64_t now = time_service_now_s();
+    const Sched_Snapshot* snapshot = sched_snapshot_read_begin(SCHED_READER_QUERY);
+    printf("Next %u events after %lld:\n", count, now);
+    print_found(sched_query_next(snapshot, now, pin, count, print_event, &printed));
+    sched_snapshot_read_end(SCHED_READER_QUERY);
+}
+
+void sched_query_print_range(uint64_t from, uint64_t to, int pin)
+{
+    uint32_t printed = 0;
+    const Sched_Snapshot* snapshot = sched_snapshot_read_begin(SCHED_READER_QUERY);
+    printf("Events from %lld to %lld:\n", from, to);
+    print_found(sched_query_range(snapshot, from, to, pin, UINT32_MAX, print_event, &printed));
+    sched_snapshot_read_end(SCHED_READER_QUERY);
+}
@@ -0,0 +1,29 @@
+#ifndef SCHED_QUERY_H_
+#define SCHED_QUERY_H_
+
+#include <stdint.h>
+
+#include "sched_snapshot.h"
+
+#define SCHED_QUERY_ANY_PIN -1
+
+/* Queries over the schedule snapshot, which already is the index of every
+   event of every load ordered by date, kept up to date by each committed
+   change. A range is found with two binary searches over dates[] and then
+   walked, O(log n + k). With a pin, the per-load views of the loads on that
+   pin are searched and merged instead, so other loads are never visited.
+   "visit" is called for each event in date order, at most "limit" times;
+   the number of events visited is returned.
+ */
+typedef void (*Sched_Query_Visit)(const Sched_Snapshot* snapshot, uint32_t event, void* context);
+
+uint32_t sched_query_range(const Sched_Snapshot* snapshot, uint64_t from, uint64_t to, int pin, uint32_t limit,
+                           Sched_Query_Visit visit, void* context);
+uint32_t sched_query_next(const Sched_Snapshot* snapshot, uint64_t now, int pin, uint32_t limit,
+                          Sched_Query_Visit visit, void* context);
+
+// Command helpers, printing the events found in the current snapshot
+void sched_query_print_next(uint32_t count, int pin);
+void sched_query_print_range(uint64_t from, uint64_t to, int pin);
+
+#endif
@@ -0,0 +1,34 @@
+#include <string.h>
+
+#include "sched_queue.h"
+
+/* Return 1 if the item was queued, 0 if the queue is full */
+uint8_t spsc_queue_push(SPSC_Queue* queue, const void* item)
+{
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head == queue->capacity) return 0;
+
+    memcpy(&queue->buffer[(tail & (queue->capacity - 1)) * queue->itemSize], item, queue->itemSize);
+    // Publish the item only after it is completely written
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+/* Return 1 if an item was copied to "item", 0 if the queue is empty */
+uint8_t spsc_queue_pop(SPSC_Queue* queue, void* item)
+{
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail) return 0;
+
+    memcpy(item, &queue->buffer[(head & (queue->capacity - 1)) * queue->itemSize], queue->itemSize);
+    // Release the slot only after the item was copied out
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return 1;
+}
+
+uint32_t spsc_queue_count(SPSC_Queue* queue)
+{
+    return atomic_load_explicit(&queue->tail, memory_order_acquire) - atomic_load_explicit(&queue->head, memory_order_acquire);
+}
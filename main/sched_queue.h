@@ -0,0 +1,29 @@
+#ifndef SCHED_QUEUE_H_
+#define SCHED_QUEUE_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Lock-free single producer / single consumer ring of fixed size items.
+   Only the producer task may push and only the consumer task may pop;
+   neither side ever blocks. The capacity must be a power of two.
+ */
+typedef struct
+{
+    uint8_t* buffer;
+    uint32_t itemSize;
+    uint32_t capacity;
+    atomic_uint head;   // next item to pop, written by the consumer
+    atomic_uint tail;   // next free slot, written by the producer
+} SPSC_Queue;
+
+#define SPSC_QUEUE_DEFINE(name, type, length) \
+    _Static_assert(((length) & ((length) - 1)) == 0, #name " length must be a power of two"); \
+    static type name##_storage[length]; \
+    SPSC_Queue name = { (uint8_t*) name##_storage, sizeof(type), (length), 0, 0 }
+
+uint8_t spsc_queue_push(SPSC_Queue* queue, const void* item);
+uint8_t spsc_queue_pop(SPSC_Queue* queue, void* item);
+uint32_t spsc_queue_count(SPSC_Queue* queue);
+
+#endif
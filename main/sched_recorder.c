@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+
+#include "nvs_blob_example_main.h"
+#include "sched_recorder.h"
+#include "sched_snapshot.h"
+#include "nvs_storage.h"
+
+// Command number of the replay itself, never replayed
+#define RECORDER_COMMAND 12
+/* Export and import are not replayed either: the chunks of an import are
+   not recorded, so replaying its start would leave the import open and
+   send every later command to its parser */
+#define EXPORT_COMMAND 17
+#define IMPORT_COMMAND 18
+
+/* Trace format: a sequence of records, each one
+   uint32_t time (ms since the first recorded command), uint16_t length,
+   then "length" bytes of the command string without its terminator.
+   Recording stops when the buffer is full; "clear" starts a new trace.
+ */
+typedef struct
+{
+    uint32_t time;
+    uint16_t length;
+} __attribute__((packed)) Record_Header;
+
+#if CONFIG_SCHED_RECORDER
+
+static uint8_t traceBuffer[CONFIG_SCHED_RECORDER_SIZE];
+static uint32_t traceUsed = 0;
+static uint32_t traceCommands = 0;
+static uint32_t droppedCommands = 0;
+static int64_t firstCommandUs = -1;
+static uint8_t replaying = 0;
+
+void sched_recorder_record(const char* command)
+{
+    Record_Header header;
+    size_t length = strlen(command);
+
+    // Commands issued by a replay are not recorded again
+    if (replaying) return;
+    if (traceUsed + sizeof(header) + length > sizeof(traceBuffer) || length > UINT16_MAX) {
+        droppedCommands++;
+        return;
+    }
+    if (firstCommandUs < 0) firstCommandUs = esp_timer_get_time();
+    header.time = (esp_timer_get_time() - firstCommandUs) / 1000;
+    header.length = length;
+    memcpy(&traceBuffer[traceUsed], &header, sizeof(header));
+    memcpy(&traceBuffer[traceUsed + sizeof(header)], command, length);
+    traceUsed += sizeof(header) + length;
+    traceCommands++;
+}
+
+/* One line per command, "cmd,<ms>,<command>", followed by a summary line */
+void sched_recorder_dump(void)
+{
+    Record_Header header;
+    for (uint32_t offset = 0; offset < traceUsed; offset += sizeof(header) + header.length) {
+        memcpy(&header, &traceBuffer[offset], sizeof(header));
+        printf("cmd,%u,%.*s\n", header.time, header.length, (const char*) &traceBuffer[offset + sizeof(header)]);
+    }
+    printf("%u commands recorded in %u of %d bytes, %u dropped.\n", traceCommands, traceUsed, CONFIG_SCHED_RECORDER_SIZE, droppedCommands);
+}
+
+void sched_recorder_clear(void)
+{
+    traceUsed = 0;
+    traceCommands = 0;
+    droppedCommands = 0;
+    firstCommandUs = -1;
+}
+
+static int compare_latency(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint8_t is_skipped_command(const char* command)
+{
+    cJSON* json = cJSON_Parse(command);
+    const cJSON* cmd = cJSON_GetObjectItemCaseSensitive(json, "c");
+    uint8_t skipped = cJSON_IsNumber(cmd) && (cmd->valueint == RECORDER_COMMAND || cmd->valueint == EXPORT_COMMAND
+                                              || cmd->valueint == IMPORT_COMMAND);
+    cJSON_Delete(json);
+    return skipped;
+}
+
+void sched_recorder_replay(uint8_t speed)
+{
+    Record_Header header;
+    uint32_t replayed = 0;
+    uint32_t bytesBefore, entriesBefore, bytesAfter, entriesAfter;
+    uint16_t longestCommand = 0;
+
+    for (uint32_t offset = 0; offset < traceUsed; offset += sizeof(header) + header.length) {
+        memcpy(&header, &traceBuffer[offset], sizeof(header));
+        if (header.length > longestCommand) longestCommand = header.length;
+    }
+    uint32_t* latencies = malloc((traceCommands > 0 ? traceCommands : 1) * sizeof(uint32_t));
+    char* command = malloc(longestCommand + 1);
+    if (latencies == NULL || command == NULL) {
+        printf("Not enough memory to replay %u commands!\n", traceCommands);
+        free(latencies);
+        free(command);
+        return;
+    }
+
+    printf("Replaying %u commands at %s speed...\n", traceCommands, speed == RECORDER_REPLAY_MAX_SPEED ? "maximum" : "original");
+    storage_get_wear_totals(&bytesBefore, &entriesBefore);
+    replaying = 1;
+    int64_t start = esp_timer_get_time();
+    for (uint32_t offset = 0; offset < traceUsed; offset += sizeof(header) + header.length) {
+        memcpy(&header, &traceBuffer[offset], sizeof(header));
+        memcpy(command, &traceBuffer[offset + sizeof(header)], header.length);
+        command[header.length] = '\0';
+        if (is_skipped_command(command)) continue;
+
+        if (speed == RECORDER_REPLAY_ORIGINAL_SPEED) {
+            int64_t due = start + (int64_t) header.time * 1000;
+            int64_t now = esp_timer_get_time();
+            if (due > now) vTaskDelay(pdMS_TO_TICKS((due - now) / 1000));
+        }
+        int64_t commandStart = esp_timer_get_time();
+        process_command(command);
+        latencies[replayed++] = esp_timer_get_time() - commandStart;
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    replaying = 0;
+    storage_get_wear_totals(&bytesAfter, &entriesAfter);
+
+    printf("\nReplayed %u commands in %lld us", replayed, elapsed);
+    if (replayed > 0 && elapsed > 0) printf(", %lld commands/s", (int64_t) replayed * 1000000 / elapsed);
+    printf(".\n");
+    if (replayed > 0) {
+        qsort(latencies, replayed, sizeof(uint32_t), compare_latency);
+        printf("Command latency (us): min %u / p50 %u / p90 %u / p99 %u / max %u\n", latencies[0], latencies[replayed / 2],
+               latencies[replayed * 90 / 100], latencies[replayed * 99 / 100], latencies[replayed - 1]);
+    }
+
+    const Sched_Snapshot* snapshot = sched_snapshot_read_begin(SCHED_READER_QUERY);
+    if (snapshot != NULL) printf("Final state: %d loads, %u events scheduled.\n", snapshot->numberOfLoads, snapshot->numberOfEvents);
+    sched_snapshot_read_end(SCHED_READER_QUERY);
+#if CONFIG_SCHED_WEAR_STATS
+    printf("NVS written during the replay: %u bytes / %u entries.\n", bytesAfter - bytesBefore, entriesAfter - entriesBefore);
+#else
+    printf("NVS written during the replay: not measured, the wear counters are disabled (CONFIG_SCHED_WEAR_STATS).\n");
+#endif
+
+    free(latencies);
+    free(command);
+}
+
+#else
+
+void sched_recorder_record(const char* command)
+{
+}
+
+void sched_recorder_dump(void)
+{
+    printf("The command recorder is disabled (CONFIG_SCHED_RECORDER).\n");
+}
+
+void sched_recorder_clear(void)
+{
+}
+
+void sched_recorder_replay(uint8_t speed)
+{
+    sched_recorder_dump();
+}
+
+#endif
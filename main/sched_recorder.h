@@ -0,0 +1,24 @@
+#ifndef SCHED_RECORDER_H_
+#define SCHED_RECORDER_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#define RECORDER_REPLAY_ORIGINAL_SPEED 0
+#define RECORDER_REPLAY_MAX_SPEED 1
+
+#if CONFIG_SCHED_RECORDER
+#define SCHED_RECORDER_RAM_BYTES CONFIG_SCHED_RECORDER_SIZE
+#else
+#define SCHED_RECORDER_RAM_BYTES 0
+#endif
+
+/* Records the commands received over BLE, with the time they arrived, so a
+   field session can be dumped and replayed. Only the command task uses it.
+ */
+void sched_recorder_record(const char* command);
+void sched_recorder_dump(void);
+void sched_recorder_clear(void);
+void sched_recorder_replay(uint8_t speed);
+
+#endif
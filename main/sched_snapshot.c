@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "sched_snapshot.h"
+
+// Replaced snapshots waiting for their readers, each reader pins at most one
+#define SCHED_SNAPSHOT_MAX_RETIRED (SCHED_SNAPSHOT_READERS + 2)
+
+static Sched_Snapshot emptySnapshot = { .windowEnd = UINT64_MAX };
+static _Atomic(Sched_Snapshot*) currentSnapshot = &emptySnapshot;
+// Snapshot each reader is using (hazard pointer), NULL when the reader is idle
+static _Atomic(Sched_Snapshot*) readerSnapshot[SCHED_SNAPSHOT_READERS];
+
+// Only accessed with the write lock held
+static SemaphoreHandle_t writeLock = NULL;
+static Sched_Snapshot* retiredSnapshots[SCHED_SNAPSHOT_MAX_RETIRED];
+static uint32_t lastVersion = 0;
+static StaticSemaphore_t writeLockBuffer;
+static uint8_t snapshotPool[SCHED_SNAPSHOT_POOL_SLOTS][SCHED_SNAPSHOT_SLOT_BYTES] __attribute__((aligned(8)));
+static uint8_t snapshotSlotInUse[SCHED_SNAPSHOT_POOL_SLOTS];
+
+void sched_snapshot_init(void)
+{
+    writeLock = xSemaphoreCreateMutexStatic(&writeLockBuffer);
+}
+
+/* Pin the current snapshot for this reader. Lock free: it only retries
+   if a writer published a new snapshot in the middle of the call. */
+const Sched_Snapshot* sched_snapshot_read_begin(Sched_Reader reader)
+{
+    Sched_Snapshot* snapshot;
+    do {
+        snapshot = atomic_load(&currentSnapshot);
+        atomic_store(&readerSnapshot[reader], snapshot);
+    } while (snapshot != atomic_load(&currentSnapshot));
+    return snapshot;
+}
+
+void sched_snapshot_read_end(Sched_Reader reader)
+{
+    atomic_store(&readerSnapshot[reader], NULL);
+}
+
+void sched_snapshot_write_lock(void)
+{
+    xSemaphoreTake(writeLock, portMAX_DELAY);
+}
+
+void sched_snapshot_write_unlock(void)
+{
+    xSemaphoreGive(writeLock);
+}
+
+/* Current snapshot for writers, which hold the write lock so it cannot be replaced or freed */
+const Sched_Snapshot* sched_snapshot_current(void)
+{
+    return atomic_load(&currentSnapshot);
+}
+
+/* Free the retired snapshots no reader is holding anymore (grace period over) */
+static void reclaim_retired_snapshots(void)
+{
+    for (int i = 0; i < SCHED_SNAPSHOT_MAX_RETIRED; i++) {
+        if (retiredSnapshots[i] == NULL) continue;
+        uint8_t inUse = 0;
+        for (int r = 0; r < SCHED_SNAPSHOT_READERS; r++) {
+            if (atomic_load(&readerSnapshot[r]) == retiredSnapshots[i]) inUse = 1;
+        }
+        if (!inUse) {
+            sched_snapshot_free(retiredSnapshots[i]);
+            retiredSnapshots[i] = NULL;
+        }
+    }
+}
+
+/* Make "snapshot" the current one, taking ownership of it.
+   Must be called with the write lock held. */
+esp_err_t sched_snapshot_publish(Sched_Snapshot* snapshot)
+{
+    if (snapshot == NULL) {
+        printf("No memory to publish the schedule table, scheduler keeps version %d.\n", lastVersion);
+        return ESP_ERR_NO_MEM;
+    }
+    snapshot->version = ++lastVersion;
+
+    Sched_Snapshot* oldSnapshot = atomic_exchange(&currentSnapshot, snapshot);
+    reclaim_retired_snapshots();
+    if (oldSnapshot != &emptySnapshot) {
+        for (int i = 0; i < SCHED_SNAPSHOT_MAX_RETIRED; i++) {
+            if (retiredSnapshots[i] == NULL) {
+                retiredSnapshots[i] = oldSnapshot;
+                oldSnapshot = NULL;
+                break;
+            }
+        }
+        // Cannot happen while each reader pins at most one snapshot
+        if (oldSnapshot != NULL) printf("Retired snapshot list full, snapshot leaked!\n");
+    }
+    reclaim_retired_snapshots();
+    return ESP_OK;
+}
+
+/* Take a pool slot for a snapshot and all its arrays, released with
+   sched_snapshot_free. Must be called with the write lock held. */
+Sched_Snapshot* sched_snapshot_alloc(uint8_t numberOfLoads, uint32_t numberOfEvents)
+{
+    uint8_t* buffer = NULL;
+    if (numberOfLoads > CONFIG_SCHED_MAX_LOADS || numberOfEvents > SCHED_MAX_EVENTS) {
+        printf("Schedule table of %d loads and %d events exceeds CONFIG_SCHED_MAX_LOADS / CONFIG_SCHED_MAX_EVENTS_PER_LOAD!\n",
+               numberOfLoads, numberOfEvents);
+        return NULL;
+    }
+    // Slots of snapshots the readers released since the last publish
+    reclaim_retired_snapshots();
+    for (int i = 0; i < SCHED_SNAPSHOT_POOL_SLOTS; i++) {
+        if (!snapshotSlotInUse[i]) {
+            snapshotSlotInUse[i] = 1;
+            buffer = snapshotPool[i];
+            break;
+        }
+    }
+    if (buffer == NULL) return NULL;
+
+    Sched_Snapshot* snapshot = (Sched_Snapshot*) buffer;
+    buffer += SCHED_SNAPSHOT_ALIGN(sizeof(Sched_Snapshot));
+    memset(snapshot, 0, sizeof(Sched_Snapshot));
+    snapshot->windowEnd = UINT64_MAX;
+    snapshot->numberOfLoads = numberOfLoads;
+    snapshot->numberOfEvents = numberOfEvents;
+    snapshot->loads = (Sched_Load*) buffer;
+    buffer += SCHED_SNAPSHOT_ALIGN(numberOfLoads * sizeof(Sched_Load));
+    snapshot->dates = (uint64_t*) buffer;
+    buffer += SCHED_SNAPSHOT_ALIGN(numberOfEvents * sizeof(uint64_t));
+    snapshot->loadEvents = (uint32_t*) buffer;
+    buffer += SCHED_SNAPSHOT_ALIGN(numberOfEvents * sizeof(uint32_t));
+    snapshot->reps = buffer;
+    buffer += SCHED_SNAPSHOT_ALIGN(numberOfEvents * sizeof(uint8_t));
+    snapshot->loadId = buffer;
+    buffer += SCHED_SNAPSHOT_ALIGN(numberOfEvents * sizeof(uint8_t));
+    snapshot->direction = buffer;
+    return snapshot;
+}
+
+void sched_snapshot_free(Sched_Snapshot* snapshot)
+{
+    for (int i = 0; i < SCHED_SNAPSHOT_POOL_SLOTS; i++) {
+        if ((uint8_t*) snapshot == snapshotPool[i]) snapshotSlotInUse[i] = 0;
+    }
+}
+
+/* Derive the per-load view from the date-sorted arrays (counting sort by
+   load, stable, so each load's events stay in date order) */
+void sched_snapshot_build_load_view(Sched_Snapshot* snapshot)
+{
+    uint32_t position = 0;
+    snapshot->windowEnd = UINT64_MAX;
+    for (int l = 0; l < snapshot->numberOfLoads; l++) {
+        snapshot->loads[l].numOfEvents = 0;
+        if (snapshot->loads[l].windowEnd < snapshot->windowEnd) snapshot->windowEnd = snapshot->loads[l].windowEnd;
+    }
+    for (uint32_t e = 0; e < snapshot->numberOfEvents; e++) snapshot->loads[snapshot->loadId[e]].numOfEvents++;
+    for (int l = 0; l < snapshot->numberOfLoads; l++) {
+        snapshot->loads[l].firstEvent = position;
+        position += snapshot->loads[l].numOfEvents;
+        snapshot->loads[l].numOfEvents = 0;
+    }
+    for (uint32_t e = 0; e < snapshot->numberOfEvents; e++) {
+        Sched_Load* load = &snapshot->loads[snapshot->loadId[e]];
+        snapshot->loadEvents[load->firstEvent + load->numOfEvents++] = e;
+    }
+}
+
+/* How much of a load's sorted ON and OFF lists is resident: the first
+   SCHED_WINDOW_EVENTS events by date, or all of them without a window.
+   The window never ends between two events of the same date, so every
+   event up to windowEnd is resident. Ties go to OFF first, as in the merge
+   of sched_snapshot_from_loads. */
+void sched_snapshot_load_window(const LoadEvent* load, uint16_t* numON, uint16_t* numOFF, uint64_t* windowEnd)
+{
+    *numON = 0;
+    *numOFF = 0;
+    *windowEnd = UINT64_MAX;
+    while (*numON < load->numOfEventsON || *numOFF < load->numOfEventsOFF) {
+        uint8_t isON = *numOFF == load->numOfEventsOFF
+            || (*numON < load->numOfEventsON && load->eventsON[*numON].date < load->eventsOFF[*numOFF].date);
+        uint64_t date = isON ? load->eventsON[*numON].date : load->eventsOFF[*numOFF].date;
+        if (SCHED_WINDOW_EVENTS > 0 && *numON + *numOFF == SCHED_WINDOW_EVENTS) {
+            // An OFF and an ON at the same date stay together out of the window
+            if (isON && *numOFF > 0 && load->eventsOFF[*numOFF - 1].date == date) (*numOFF)--;
+            *windowEnd = date > 0 ? date - 1 : 0;
+            return;
+        }
+        if (isON) (*numON)++;
+        else (*numOFF)++;
+    }
+}
+
+/* Build a snapshot from per-load lists sorted by date, merging them */
+Sched_Snapshot* sched_snapshot_from_loads(const LoadEvent* loads, uint8_t numberOfLoads)
+{
+    // Events of each ON and OFF list taken, within the window of its load
+    static uint16_t counts[2 * CONFIG_SCHED_MAX_LOADS];
+    static uint64_t windowEnds[CONFIG_SCHED_MAX_LOADS];
+    uint32_t numberOfEvents = 0;
+    for (int l = 0; l < numberOfLoads; l++) {
+        sched_snapshot_load_window(&loads[l], &counts[2 * l + 1], &counts[2 * l], &windowEnds[l]);
+        numberOfEvents += counts[2 * l] + counts[2 * l + 1];
+    }
+
+    Sched_Snapshot* snapshot = sched_snapshot_alloc(numberOfLoads, numberOfEvents);
+    if (snapshot == NULL) return NULL;
+    // Position reached in each ON and OFF list by the merge
+    static uint16_t cursors[2 * CONFIG_SCHED_MAX_LOADS];
+    memset(cursors, 0, sizeof(cursors));
+    for (int l = 0; l < numberOfLoads; l++) {
+        strcpy(snapshot->loads[l].loadName, loads[l].loadName);
+        snapshot->loads[l].loadNumber = loads[l].loadNumber;
+        snapshot->loads[l].pinNumber = loads[l].pinNumber;
+        snapshot->loads[l].windowEnd = windowEnds[l];
+    }
+    // Repeatedly take the earliest list head; linear in the number of lists,
+    // which is small next to the number of events
+    for (uint32_t e = 0; e < numberOfEvents; e++) {
+        int best = -1;
+        uint64_t bestDate = 0;
+        for (int c = 0; c < 2 * numberOfLoads; c++) {
+            const LoadEvent* load = &loads[c / 2];
+            const Date_and_Reps* list = (c % 2) ? load->eventsON : load->eventsOFF;
+            if (cursors[c] < counts[c] && (best == -1 || list[cursors[c]].date < bestDate)) {
+                best = c;
+                bestDate = list[cursors[c]].date;
+            }
+        }
+        const LoadEvent* load = &loads[best / 2];
+        const Date_and_Reps* event = (best % 2) ? &load->eventsON[cursors[best]] : &load->eventsOFF[cursors[best]];
+        snapshot->dates[e] = event->date;
+        snapshot->reps[e] = event->repetions;
+        snapshot->loadId[e] = best / 2;
+        snapshot->direction[e] = best % 2;
+        cursors[best]++;
+    }
+    sched_snapshot_build_load_view(snapshot);
+    return snapshot;
+}
+
+static void copy_event(Sched_Snapshot* to, uint32_t toEvent, const Sched_Snapshot* from, uint32_t fromEvent)
+{
+    to->dates[toEvent] = from->dates[fromEvent];
+    to->reps[toEvent] = from->reps[fromEvent];
+    to->loadId[toEvent] = from->loadId[fromEvent];
+    to->direction[toEvent] = from->direction[fromEvent];
+}
+
+/* Whether a filtering change drops the event or keeps it (possibly changed) */
+static uint8_t event_is_dropped(const Sched_Snapshot* current, uint32_t e, int loadId, const Sched_Delta* delta)
+{
+    if (current->loadId[e] != loadId) return 0;
+    if (delta->type == SCHED_DELTA_PURGE) return current->dates[e] <= delta->date;
+    if (delta->type == SCHED_DELTA_DELETE_EVENT) return current->dates[e] == delta->date;
+    return 0;
+}
+
+/* Keep at most SCHED_WINDOW_EVENTS events of a load after one was added,
+   dropping every event at or after the date of the first one beyond */
+static void trim_window(Sched_Snapshot* snapshot, int loadId)
+{
+    Sched_Load* load = &snapshot->loads[loadId];
+    if (SCHED_WINDOW_EVENTS == 0 || load->numOfEvents <= SCHED_WINDOW_EVENTS) return;
+    uint64_t cut = snapshot->dates[snapshot->loadEvents[load->firstEvent + SCHED_WINDOW_EVENTS]];
+    uint32_t kept = 0;
+    for (uint32_t e = 0; e < snapshot->numberOfEvents; e++) {
+        if (snapshot->loadId[e] == loadId && snapshot->dates[e] >= cut) continue;
+        if (kept != e) copy_event(snapshot, kept, snapshot, e);
+        kept++;
+    }
+    snapshot->numberOfEvents = kept;
+    load->windowEnd = cut - 1;
+    sched_snapshot_build_load_view(snapshot);
+}
+
+/* Replace the resident events of a load by the window of its full lists
+   (delta->loads[0]), merging them with the events of the other loads */
+static Sched_Snapshot* refill_window(const Sched_Snapshot* current, int loadId, const Sched_Delta* delta)
+{
+    const LoadEvent* lists = &delta->loads[0];
+    uint16_t numON, numOFF;
+    uint64_t windowEnd;
+    sched_snapshot_load_window(lists, &numON, &numOFF, &windowEnd);
+    uint32_t numberOfEvents = current->numberOfEvents - current->loads[loadId].numOfEvents + numON + numOFF;
+    Sched_Snapshot* snapshot = sched_snapshot_alloc(current->numberOfLoads, numberOfEvents);
+    if (snapshot == NULL) return NULL;
+    memcpy(snapshot->loads, current->loads, current->numberOfLoads * sizeof(Sched_Load));
+    snapshot->loads[loadId].windowEnd = windowEnd;
+
+    uint32_t e = 0;
+    uint16_t on = 0;
+    uint16_t off = 0;
+    for (uint32_t n = 0; n < numberOfEvents; n++) {
+        while (e < current->numberOfEvents && current->loadId[e] == loadId) e++;
+        // Ties: the events already resident first, then OFF before ON
+        uint8_t isON = off == numOFF || (on < numON && lists->eventsON[on].date < lists->eventsOFF[off].date);
+        const Date_and_Reps* event = NULL;
+        if (on < numON || off < numOFF) event = isON ? &lists->eventsON[on] : &lists->eventsOFF[off];
+        if (e < current->numberOfEvents && (event == NULL || current->dates[e] <= event->date)) {
+            copy_event(snapshot, n, current, e++);
+            continue;
+        }
+        snapshot->dates[n] = event->date;
+        snapshot->reps[n] = event->repetions;
+        snapshot->loadId[n] = loadId;
+        snapshot->direction[n] = isON;
+        if (isON) on++;
+        else off++;
+    }
+    sched_snapshot_build_load_view(snapshot);
+    return snapshot;
+}
+
+/* Build the snapshot that results from applying a change already
+   committed to NVS to the current one. Returns NULL if out of memory,
+   or if the change is beyond the load's window (it reaches the
+   snapshot when the window is refilled). */
+Sched_Snapshot* sched_snapshot_apply(const Sched_Snapshot* current, const Sched_Delta* delta)
+{
+    if (delta->type == SCHED_DELTA_RELOAD) return sched_snapshot_from_loads(delta->loads, delta->numberOfLoads);
+
+    Sched_Snapshot* snapshot;
+    int loadId = sched_snapshot_find_load(current, delta->loadNumber);
+    if (delta->type == SCHED_DELTA_ADD_LOAD) {
+        uint8_t numberOfLoads = current->numberOfLoads + (loadId < 0 ? 1 : 0);
+        if (loadId < 0 && current->numberOfLoads >= CONFIG_SCHED_MAX_LOADS) {
+            printf("Load table full, %s not loaded.\n", delta->loadName);
+            return NULL;
+        }
+        snapshot = sched_snapshot_alloc(numberOfLoads, current->numberOfEvents);
+        if (snapshot == NULL) return NULL;
+        if (current->numberOfLoads > 0) memcpy(snapshot->loads, current->loads, current->numberOfLoads * sizeof(Sched_Load));
+        for (uint32_t e = 0; e < current->numberOfEvents; e++) copy_event(snapshot, e, current, e);
+        if (loadId < 0) {
+            loadId = current->numberOfLoads;
+            memset(&snapshot->loads[loadId], 0, sizeof(Sched_Load));
+            strcpy(snapshot->loads[loadId].loadName, delta->loadName);
+            snapshot->loads[loadId].loadNumber = delta->loadNumber;
+            snapshot->loads[loadId].windowEnd = UINT64_MAX;
+        }
+        snapshot->loads[loadId].pinNumber = delta->pinNumber;
+    } else if (loadId < 0) {
+        printf("Load %s not loaded, schedule change ignored.\n", delta->loadName);
+        return NULL;
+    } else if (delta->type == SCHED_DELTA_WINDOW) {
+        return refill_window(current, loadId, delta);
+    } else if (delta->type == SCHED_DELTA_ADD_EVENT) {
+        if (delta->date > current->loads[loadId].windowEnd) return NULL;
+        // Same position save_schedule_time uses: after the events with the same date
+        uint32_t position = sched_count_due(current->dates, current->numberOfEvents, delta->date);
+        snapshot = sched_snapshot_alloc(current->numberOfLoads, current->numberOfEvents + 1);
+        if (snapshot == NULL) return NULL;
+        memcpy(snapshot->loads, current->loads, current->numberOfLoads * sizeof(Sched_Load));
+        for (uint32_t e = 0; e < position; e++) copy_event(snapshot, e, current, e);
+        snapshot->dates[position] = delta->date;
+        snapshot->reps[position] = delta->repetions;
+        snapshot->loadId[position] = loadId;
+        snapshot->direction[position] = delta->loadState;
+        for (uint32_t e = position; e < current->numberOfEvents; e++) copy_event(snapshot, e + 1, current, e);
+        sched_snapshot_build_load_view(snapshot);
+        trim_window(snapshot, loadId);
+        return snapshot;
+    } else {
+        uint32_t kept = 0;
+        for (uint32_t e = 0; e < current->numberOfEvents; e++) {
+            if (!event_is_dropped(current, e, loadId, delta)) kept++;
+        }
+        snapshot = sched_snapshot_alloc(current->numberOfLoads, kept);
+        if (snapshot == NULL) return NULL;
+        memcpy(snapshot->loads, current->loads, current->numberOfLoads * sizeof(Sched_Load));
+        kept = 0;
+        for (uint32_t e = 0; e < current->numberOfEvents; e++) {
+            if (event_is_dropped(current, e, loadId, delta)) continue;
+            copy_event(snapshot, kept, current, e);
+            if (delta->type == SCHED_DELTA_CHANGE_REPS && current->loadId[e] == loadId && current->dates[e] == delta->date)
+                snapshot->reps[kept] = delta->repetions;
+            kept++;
+        }
+    }
+    sched_snapshot_build_load_view(snapshot);
+    return snapshot;
+}
+
+/* Number of dates <= now in a sorted array, i.e. how many events are due */
+uint32_t sched_count_due(const uint64_t* dates, uint32_t numberOfEvents, uint64_t now)
+{
+    uint32_t low = 0;
+    uint32_t high = numberOfEvents;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (dates[middle] <= now) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+/* Index of a load in the snapshot, -1 if it is not there */
+int sched_snapshot_find_load(const Sched_Snapshot* snapshot, uint8_t loadNumber)
+{
+    for (int l = 0; l < snapshot->numberOfLoads; l++) {
+        if (snapshot->loads[l].loadNumber == loadNumber) return l;
+    }
+    return -1;
+}
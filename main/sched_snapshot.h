@@ -0,0 +1,103 @@
+#ifndef SCHED_SNAPSHOT_H_
+#define SCHED_SNAPSHOT_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+#include "nvs_blob_example_main.h"
+
+typedef struct
+{
+    char loadName[20];
+    uint8_t loadNumber;     // number in the load registry
+    uint8_t pinNumber;
+    uint32_t firstEvent;    // position of the load's first entry in loadEvents
+    uint32_t numOfEvents;
+    uint64_t windowEnd;     // every event of the load up to this date is resident, UINT64_MAX when all are
+} Sched_Load;
+
+/* Immutable, versioned schedule table. Every event of every load is kept
+   in one contiguous structure of arrays sorted by date, so finding the due
+   events is a binary search over dates[] alone. The per-load view lists,
+   for each load, the positions of its events in date order.
+
+   Writers build a new snapshot and swap it in; readers never block and
+   never see a table being modified. A replaced snapshot is freed once no
+   reader holds it. Snapshots come from a static pool of slots sized for
+   CONFIG_SCHED_MAX_LOADS loads of CONFIG_SCHED_MAX_EVENTS_PER_LOAD events.
+
+   With CONFIG_SCHED_WINDOW_EVENTS only the next SCHED_WINDOW_EVENTS
+   events of each load are resident, the slots are sized for those. The
+   rest stays in NVS, sorted, and the command task refills a window
+   (SCHED_DELTA_WINDOW) once it has drained to half. Until then a load
+   whose windowEnd has passed is held on its own: its events after
+   windowEnd are fired late, once resident, rather than skipped, and the
+   other loads keep firing on time.
+ */
+typedef struct
+{
+    uint32_t version;
+    uint8_t numberOfLoads;
+    uint32_t numberOfEvents;
+    uint64_t windowEnd;     // earliest windowEnd of the loads
+    Sched_Load* loads;
+    uint64_t* dates;
+    uint8_t* reps;
+    uint8_t* loadId;        // index in loads[]
+    uint8_t* direction;     // 1 = ON, 0 = OFF
+    uint32_t* loadEvents;   // per-load view
+} Sched_Snapshot;
+
+/* Each reading task owns one slot */
+typedef enum
+{
+    SCHED_READER_SCHEDULER,
+    SCHED_READER_QUERY,
+    SCHED_SNAPSHOT_READERS
+} Sched_Reader;
+
+#define SCHED_SNAPSHOT_ALIGN(size) (((size) + 7) & ~7)
+#if CONFIG_SCHED_WINDOW_EVENTS >= 4 && CONFIG_SCHED_WINDOW_EVENTS < CONFIG_SCHED_MAX_EVENTS_PER_LOAD
+#define SCHED_WINDOW_EVENTS CONFIG_SCHED_WINDOW_EVENTS
+// One more: an event is added before the window is trimmed back
+#define SCHED_MAX_EVENTS (CONFIG_SCHED_MAX_LOADS * SCHED_WINDOW_EVENTS + 1)
+// The loader keeps the window of each list and the first event after it
+#define SCHED_LOADED_EVENTS_PER_LIST (SCHED_WINDOW_EVENTS + 1)
+#define SCHED_LOADED_EVENTS (CONFIG_SCHED_MAX_LOADS * 2 * SCHED_LOADED_EVENTS_PER_LIST)
+#else
+#define SCHED_WINDOW_EVENTS 0      // every event is resident
+#define SCHED_MAX_EVENTS (CONFIG_SCHED_MAX_LOADS * CONFIG_SCHED_MAX_EVENTS_PER_LOAD)
+#define SCHED_LOADED_EVENTS SCHED_MAX_EVENTS
+#endif
+
+// The current snapshot, one pinned by each reader and the one being built
+#define SCHED_SNAPSHOT_POOL_SLOTS (SCHED_SNAPSHOT_READERS + 2)
+#define SCHED_SNAPSHOT_SLOT_BYTES (SCHED_SNAPSHOT_ALIGN(sizeof(Sched_Snapshot)) \
+                                 + SCHED_SNAPSHOT_ALIGN(CONFIG_SCHED_MAX_LOADS * sizeof(Sched_Load)) \
+                                 + SCHED_SNAPSHOT_ALIGN(SCHED_MAX_EVENTS * sizeof(uint64_t)) \
+                                 + SCHED_SNAPSHOT_ALIGN(SCHED_MAX_EVENTS * sizeof(uint32_t)) \
+                                 + 3 * SCHED_SNAPSHOT_ALIGN(SCHED_MAX_EVENTS * sizeof(uint8_t)))
+#define SCHED_SNAPSHOT_RAM_BYTES (SCHED_SNAPSHOT_POOL_SLOTS * SCHED_SNAPSHOT_SLOT_BYTES)
+
+void sched_snapshot_init(void);
+
+const Sched_Snapshot* sched_snapshot_read_begin(Sched_Reader reader);
+void sched_snapshot_read_end(Sched_Reader reader);
+
+void sched_snapshot_write_lock(void);
+void sched_snapshot_write_unlock(void);
+const Sched_Snapshot* sched_snapshot_current(void);
+esp_err_t sched_snapshot_publish(Sched_Snapshot* snapshot);
+
+Sched_Snapshot* sched_snapshot_alloc(uint8_t numberOfLoads, uint32_t numberOfEvents);
+void sched_snapshot_free(Sched_Snapshot* snapshot);
+void sched_snapshot_build_load_view(Sched_Snapshot* snapshot);
+Sched_Snapshot* sched_snapshot_from_loads(const LoadEvent* loads, uint8_t numberOfLoads);
+Sched_Snapshot* sched_snapshot_apply(const Sched_Snapshot* current, const Sched_Delta* delta);
+void sched_snapshot_load_window(const LoadEvent* load, uint16_t* numON, uint16_t* numOFF, uint64_t* windowEnd);
+
+uint32_t sched_count_due(const uint64_t* dates, uint32_t numberOfEvents, uint64_t now);
+int sched_snapshot_find_load(const Sched_Snapshot* snapshot, uint8_t loadNumber);
+
+#endif
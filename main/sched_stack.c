@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "sched_stack.h"
+
+// Commands 0..15 have their own statistics, the others are counted together
+#define STACK_COMMAND_SLOTS 16
+// Byte FreeRTOS fills new stacks with, uxTaskGetStackHighWaterMark counts it
+#define STACK_FILL_BYTE 0xA5
+// Left untouched below the frame that repaints the stack
+#define STACK_PAINT_MARGIN 256
+
+typedef struct
+{
+    TaskHandle_t task;
+    const char* name;
+    const char* option;
+    uint8_t* stack;             // lowest address, the stacks grow down towards it
+    uint32_t stackBytes;
+    uint32_t worstUsed;
+} Stack_Task;
+
+typedef struct
+{
+    uint32_t commands;
+    uint16_t worstUsed;
+    uint16_t lastUsed;
+} Stack_Command_Stats;
+
+#if CONFIG_SCHED_STACK_MONITOR
+
+static Stack_Task stackTasks[SCHED_STACK_MAX_TASKS];
+static uint8_t numberOfTasks = 0;
+static Stack_Command_Stats commandStats[STACK_COMMAND_SLOTS + 1];
+static Stack_Task* commandTask = NULL;
+static uint8_t commandDepth = 0;
+static uint8_t commandPainted = 0;
+_Static_assert(sizeof(stackTasks) + sizeof(commandStats) <= SCHED_STACK_RAM_BYTES, "SCHED_STACK_RAM_BYTES is too small");
+
+void sched_stack_register_task(TaskHandle_t task, const char* name, const char* option,
+                               StackType_t* stack, uint32_t stackBytes)
+{
+    if (task == NULL || numberOfTasks == SCHED_STACK_MAX_TASKS) return;
+    Stack_Task* entry = &stackTasks[numberOfTasks++];
+    entry->task = task;
+    entry->name = name;
+    entry->option = option;
+    entry->stack = (uint8_t*) stack;
+    entry->stackBytes = stackBytes;
+    entry->worstUsed = 0;
+}
+
+static Stack_Task* find_task(TaskHandle_t task)
+{
+    for (uint8_t i = 0; i < numberOfTasks; i++) {
+        if (stackTasks[i].task == task) return &stackTasks[i];
+    }
+    return NULL;
+}
+
+// Bytes of stack used at the deepest point since boot (or since the last repaint)
+static uint32_t sample_high_water(Stack_Task* entry)
+{
+    uint32_t freeBytes = uxTaskGetStackHighWaterMark(entry->task) * sizeof(StackType_t);
+    uint32_t used = freeBytes < entry->stackBytes ? entry->stackBytes - freeBytes : 0;
+    if (used > entry->worstUsed) entry->worstUsed = used;
+    return used;
+}
+
+/* Repaint the unused part of the command task stack, so the scan in
+   sched_stack_command_end finds the deepest point of this command alone.
+   Interrupts and context switches only write below the stack pointer and
+   are done with that area when they return, so repainting it is safe. A
+   plain loop is used because a call to memset would put its own frame in
+   the area being painted. When the stack is not known (host builds) the
+   high-water mark of the task is used instead. */
+void sched_stack_command_begin(void)
+{
+    if (commandDepth++ > 0) return;
+    commandTask = find_task(xTaskGetCurrentTaskHandle());
+    commandPainted = 0;
+    if (commandTask == NULL) return;
+    sample_high_water(commandTask);     // keep what ran since the last repaint
+    if (commandTask->stack == NULL) return;
+
+    uint8_t* frame = __builtin_frame_address(0);
+    if (frame < commandTask->stack + STACK_PAINT_MARGIN || frame >= commandTask->stack + commandTask->stackBytes) return;
+    volatile uint8_t* paint = commandTask->stack;
+    while (paint < frame - STACK_PAINT_MARGIN) *paint++ = STACK_FILL_BYTE;
+    commandPainted = 1;
+}
+
+void sched_stack_command_end(uint8_t command)
+{
+    if (--commandDepth > 0) return;
+    if (commandTask == NULL) return;
+    uint32_t used;
+    if (commandPainted) {
+        uint32_t untouched = 0;
+        while (untouched < commandTask->stackBytes && commandTask->stack[untouched] == STACK_FILL_BYTE) untouched++;
+        used = commandTask->stackBytes - untouched;
+        if (used > commandTask->worstUsed) commandTask->worstUsed = used;
+    }
+    else used = sample_high_water(commandTask);
+
+    Stack_Command_Stats* stats = &commandStats[command < STACK_COMMAND_SLOTS ? command : STACK_COMMAND_SLOTS];
+    stats->commands++;
+    stats->lastUsed = used;
+    if (used > stats->worstUsed) stats->worstUsed = used;
+}
+
+/* Worst use plus CONFIG_SCHED_STACK_HEADROOM percent, rounded up to 256 bytes */
+static uint32_t recommended_stack(uint32_t worstUsed)
+{
+    uint32_t size = worstUsed * (100 + CONFIG_SCHED_STACK_HEADROOM) / 100;
+    return (size + 255) & ~255;
+}
+
+void sched_stack_print_report(void)
+{
+    int32_t reclaimable = 0;
+    printf("Task                      stack  worst used   free  recommended  option\n");
+    for (uint8_t i = 0; i < numberOfTasks; i++) {
+        Stack_Task* entry = &stackTasks[i];
+        sample_high_water(entry);
+        uint32_t recommended = recommended_stack(entry->worstUsed);
+        reclaimable += (int32_t) entry->stackBytes - (int32_t) recommended;
+        printf("%-24s  %5u  %10u  %5u  %11u  %s\n", entry->name, entry->stackBytes, entry->worstUsed,
+               entry->stackBytes - entry->worstUsed, recommended, entry->option);
+    }
+    printf("Stack that the recommended sizes would reclaim: %d bytes\n", reclaimable);
+    printf("Command  count  worst B  last B  recommended\n");
+    for (uint8_t i = 0; i <= STACK_COMMAND_SLOTS; i++) {
+        const Stack_Command_Stats* stats = &commandStats[i];
+        if (stats->commands == 0) continue;
+        if (i < STACK_COMMAND_SLOTS) printf("%7d", i);
+        else printf("  other");
+        printf("  %5u  %7u  %6u  %11u\n", stats->commands, stats->worstUsed, stats->lastUsed, recommended_stack(stats->worstUsed));
+    }
+}
+
+void sched_stack_reset_stats(void)
+{
+    memset(commandStats, 0, sizeof(commandStats));
+}
+
+#else
+
+void sched_stack_register_task(TaskHandle_t task, const char* name, const char* option,
+                               StackType_t* stack, uint32_t stackBytes)
+{
+}
+
+void sched_stack_command_begin(void)
+{
+}
+
+void sched_stack_command_end(uint8_t command)
+{
+}
+
+void sched_stack_print_report(void)
+{
+    printf("The stack monitor is disabled (CONFIG_SCHED_STACK_MONITOR).\n");
+}
+
+void sched_stack_reset_stats(void)
+{
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef SCHED_STACK_H_
+#define SCHED_STACK_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* Stack usage monitor. Every registered task reports its high-water mark
+   (uxTaskGetStackHighWaterMark). The command task's stack is also repainted
+   before each command and scanned after it, giving the worst stack use per
+   command type. Command 14 prints both with a recommended stack size.
+ */
+#define SCHED_STACK_MAX_TASKS 4
+
+#if CONFIG_SCHED_STACK_MONITOR
+#define SCHED_STACK_RAM_BYTES 320
+#else
+#define SCHED_STACK_RAM_BYTES 0
+#endif
+
+/* "stack" is the static stack of the task, or NULL when it is not known;
+   "option" is the Kconfig option that sizes it, for the report */
+void sched_stack_register_task(TaskHandle_t task, const char* name, const char* option,
+                               StackType_t* stack, uint32_t stackBytes);
+void sched_stack_command_begin(void);
+void sched_stack_command_end(uint8_t command);
+void sched_stack_print_report(void);
+void sched_stack_reset_stats(void);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+#include "sched_trace.h"
+
+// Bucket i counts durations below 2^i us, the last one everything above
+#define TRACE_BUCKETS 24
+
+typedef struct
+{
+    uint32_t start;
+    uint32_t duration;
+    uint8_t phase;
+} Trace_Record;
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t histogram[TRACE_BUCKETS];
+} Trace_Stats;
+
+static const char* phaseNames[TRACE_PHASES] = {
+    "ble receive", "json parse", "nvs open", "nvs read", "nvs write", "nvs commit", "print", "command"
+};
+
+static volatile uint32_t receivedAt = 0;
+
+#if CONFIG_SCHED_TRACE
+_Static_assert((CONFIG_SCHED_TRACE_LEN & (CONFIG_SCHED_TRACE_LEN - 1)) == 0, "trace length must be a power of two");
+static Trace_Record traceRing[CONFIG_SCHED_TRACE_LEN];
+static uint32_t traceNext = 0;
+static Trace_Stats traceStats[TRACE_PHASES];
+_Static_assert(sizeof(traceRing) + sizeof(traceStats) <= SCHED_TRACE_RAM_BYTES, "SCHED_TRACE_RAM_BYTES is too small");
+#endif
+
+void sched_trace_mark_received(void)
+{
+    receivedAt = (uint32_t) esp_timer_get_time();
+}
+
+uint32_t sched_trace_received_at(void)
+{
+    return receivedAt;
+}
+
+#if CONFIG_SCHED_TRACE
+
+void sched_trace_record(Trace_Phase phase, uint32_t start)
+{
+    uint32_t duration = (uint32_t) esp_timer_get_time() - start;
+    Trace_Stats* stats = &traceStats[phase];
+    uint8_t bucket = 0;
+
+    Trace_Record* record = &traceRing[traceNext++ & (CONFIG_SCHED_TRACE_LEN - 1)];
+    record->start = start;
+    record->duration = duration;
+    record->phase = phase;
+
+    if (stats->count == 0 || duration < stats->min) stats->min = duration;
+    if (duration > stats->max) stats->max = duration;
+    stats->sum += duration;
+    stats->count++;
+    while (bucket < TRACE_BUCKETS - 1 && duration >= (1UL << bucket)) bucket++;
+    stats->histogram[bucket]++;
+}
+
+// Upper bound of the bucket holding the 99th percentile, capped to the maximum
+static uint32_t percentile_99(const Trace_Stats* stats)
+{
+    uint32_t rank = stats->count - stats->count / 100;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < TRACE_BUCKETS - 1; i++) {
+        seen += stats->histogram[i];
+        if (seen >= rank) return (1UL << i) < stats->max ? (1UL << i) : stats->max;
+    }
+    return stats->max;
+}
+
+void sched_trace_print(void)
+{
+    printf("Phase latency (us):       count      min      avg      p99      max\n");
+    for (uint8_t i = 0; i < TRACE_PHASES; i++) {
+        const Trace_Stats* stats = &traceStats[i];
+        if (stats->count == 0) continue;
+        printf("  %-16s %12u %8u %8u %8u %8u\n", phaseNames[i], stats->count, stats->min,
+               (uint32_t)(stats->sum / stats->count), percentile_99(stats), stats->max);
+    }
+}
+
+/* One CSV line per record, oldest first, so a console log can be
+   loaded on the host: trace,<start us>,<phase>,<duration us>
+ */
+void sched_trace_dump(void)
+{
+    uint32_t first = traceNext > CONFIG_SCHED_TRACE_LEN ? traceNext - CONFIG_SCHED_TRACE_LEN : 0;
+    for (uint32_t i = first; i < traceNext; i++) {
+        const Trace_Record* record = &traceRing[i & (CONFIG_SCHED_TRACE_LEN - 1)];
+        printf("trace,%u,%s,%u\n", record->start, phaseNames[record->phase], record->duration);
+    }
+}
+
+void sched_trace_reset(void)
+{
+    memset(traceStats, 0, sizeof(traceStats));
+    traceNext = 0;
+}
+
+#else
+
+void sched_trace_record(Trace_Phase phase, uint32_t start)
+{
+}
+
+void sched_trace_print(void)
+{
+    printf("Latency tracing is disabled (CONFIG_SCHED_TRACE).\n");
+}
+
+void sched_trace_dump(void)
+{
+}
+
+void sched_trace_reset(void)
+{
+}
+
+#endif
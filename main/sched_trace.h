@@ -0,0 +1,43 @@
+#ifndef SCHED_TRACE_H_
+#define SCHED_TRACE_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+typedef enum
+{
+    TRACE_BLE_RECEIVE,      // BLE write callback -> command task
+    TRACE_PARSE,            // cJSON_Parse
+    TRACE_NVS_OPEN,
+    TRACE_NVS_READ,
+    TRACE_NVS_WRITE,        // nvs_set_* and nvs_erase_key
+    TRACE_NVS_COMMIT,
+    TRACE_PRINT,            // NVS statistics and command prints
+    TRACE_COMMAND,          // whole process_command
+    TRACE_PHASES
+} Trace_Phase;
+
+/* Per-phase latency tracing. Durations are measured with esp_timer and kept
+   in 32 bits of microseconds, so a single phase may last up to 71 minutes.
+   Phases are recorded only by the command task.
+ */
+#if CONFIG_SCHED_TRACE
+#define TRACE_START(start) uint32_t start = (uint32_t) esp_timer_get_time()
+#define TRACE_END(phase, start) sched_trace_record((phase), (start))
+// Static RAM of the ring (12 bytes per record) and the per-phase statistics
+#define SCHED_TRACE_RAM_BYTES (CONFIG_SCHED_TRACE_LEN * 12 + TRACE_PHASES * 120)
+#else
+#define TRACE_START(start)
+#define TRACE_END(phase, start)
+#define SCHED_TRACE_RAM_BYTES 0
+#endif
+
+void sched_trace_record(Trace_Phase phase, uint32_t start);
+void sched_trace_mark_received(void);
+uint32_t sched_trace_received_at(void);
+void sched_trace_print(void);
+void sched_trace_dump(void);
+void sched_trace_reset(void);
+
+#endif
@@ -0,0 +1,751 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "nvs.h"
+#include "esp_timer.h"
+
+#include "sched_transfer.h"
+#include "nvs_storage.h"
+#include "sched_loads.h"
+#include "sched_log.h"
+#include "sched_snapshot.h"
+
+#define TRANSFER_VERSION 1
+// Root object, loads array, load object, ON/OFF list, [date, reps] pair
+#define IMPORT_MAX_DEPTH 5
+#define IMPORT_TOKEN_LEN SCHED_LOAD_NAME_LEN
+#define IMPORT_TIMEOUT_US (CONFIG_SCHED_IMPORT_TIMEOUT_S * 1000000LL)
+
+/* Undo of an import. Before the lists of a load are replaced, the old ones
+   are copied to UNDO_NAMESPACE under the same keys, then a marker under the
+   load's record key holding its old pin (UNDO_NEW_LOAD for a load the import
+   registered). UNDO_IMPORT_KEY, written before any of them, says there is
+   something to undo after a reset. */
+#define UNDO_NAMESPACE "schedUndo"
+#define UNDO_IMPORT_KEY "import"
+#define UNDO_NEW_LOAD 0xFF
+
+/* Export */
+
+typedef struct
+{
+    Sched_Transfer_Write write;
+    void* context;
+    size_t used;
+    uint32_t total;
+} Export_Writer;
+
+static char exportChunk[SCHED_TRANSFER_CHUNK];
+
+static void put_text(Export_Writer* writer, const char* text, size_t length)
+{
+    while (length > 0) {
+        size_t room = sizeof(exportChunk) - writer->used;
+        size_t part = length < room ? length : room;
+        memcpy(&exportChunk[writer->used], text, part);
+        writer->used += part;
+        writer->total += part;
+        text += part;
+        length -= part;
+        if (writer->used == sizeof(exportChunk)) {
+            writer->write(exportChunk, writer->used, writer->context);
+            writer->used = 0;
+        }
+    }
+}
+
+static void put_string(Export_Writer* writer, const char* text)
+{
+    put_text(writer, text, strlen(text));
+}
+
+// Names are user input: quotes, backslashes and control characters are escaped
+static void put_name(Export_Writer* writer, const char* name)
+{
+    char escaped[8];
+    put_text(writer, "\"", 1);
+    for (; *name; name++) {
+        uint8_t c = *name;
+        if (c == '"' || c == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = c;
+            put_text(writer, escaped, 2);
+        }
+        else if (c < 0x20) put_text(writer, escaped, sprintf(escaped, "\\u%04x", c));
+        else put_text(writer, (const char*) name, 1);
+    }
+    put_text(writer, "\"", 1);
+}
+
+static void put_list(Export_Writer* writer, const Sched_Snapshot* snapshot, const Sched_Load* load, uint8_t direction)
+{
+    char pair[48];
+    uint8_t first = 1;
+    put_text(writer, "[", 1);
+    for (uint32_t i = 0; i < load->numOfEvents; i++) {
+        uint32_t event = snapshot->loadEvents[load->firstEvent + i];
+        if (snapshot->direction[event] != direction) continue;
+        put_text(writer, pair, sprintf(pair, "%s[%llu,%u]", first ? "" : ",",
+                                       (unsigned long long) snapshot->dates[event], snapshot->reps[event]));
+        first = 0;
+    }
+    put_text(writer, "]", 1);
+}
+
+// A list read from NVS, for the loads only partly resident (see CONFIG_SCHED_WINDOW_EVENTS)
+static void put_events(Export_Writer* writer, const Date_and_Reps* events, uint16_t numOfEvents)
+{
+    char pair[48];
+    put_text(writer, "[", 1);
+    for (uint16_t i = 0; i < numOfEvents; i++) {
+        put_text(writer, pair, sprintf(pair, "%s[%llu,%u]", i == 0 ? "" : ",",
+                                       (unsigned long long) events[i].date, events[i].repetions));
+    }
+    put_text(writer, "]", 1);
+}
+
+uint32_t sched_transfer_export(Sched_Transfer_Write write, void* context)
+{
+    char field[32];
+    Export_Writer writer = { .write = write, .context = context, .used = 0, .total = 0 };
+    const Sched_Snapshot* snapshot = sched_snapshot_read_begin(SCHED_READER_QUERY);
+    put_text(&writer, field, sprintf(field, "{\"v\":%d,\"loads\":[", TRANSFER_VERSION));
+    for (int l = 0; snapshot != NULL && l < snapshot->numberOfLoads; l++) {
+        const Sched_Load* load = &snapshot->loads[l];
+        put_string(&writer, l == 0 ? "\n{\"l\":" : ",\n{\"l\":");
+        put_name(&writer, load->loadName);
+        put_text(&writer, field, sprintf(field, ",\"p\":%u,\"on\":", load->pinNumber));
+        LoadEvent lists;
+        if (load->windowEnd != UINT64_MAX && read_load_lists(load->loadNumber, &lists) == ESP_OK) {
+            put_events(&writer, lists.eventsON, lists.numOfEventsON);
+            put_string(&writer, ",\"off\":");
+            put_events(&writer, lists.eventsOFF, lists.numOfEventsOFF);
+        } else {
+            put_list(&writer, snapshot, load, 1);
+            put_string(&writer, ",\"off\":");
+            put_list(&writer, snapshot, load, 0);
+        }
+        put_string(&writer, "}");
+    }
+    put_string(&writer, "]}\n");
+    sched_snapshot_read_end(SCHED_READER_QUERY);
+    if (writer.used > 0) write(exportChunk, writer.used, context);
+    return writer.total;
+}
+
+/* Import */
+
+typedef enum
+{
+    EXPECT_VALUE,
+    EXPECT_KEY,
+    EXPECT_COLON,
+    EXPECT_NEXT,        // ',' or the end of the container
+    IN_STRING,
+    IN_ESCAPE,
+    IN_UNICODE,
+    IN_NUMBER
+} Import_Parse_State;
+
+typedef enum
+{
+    KEY_UNKNOWN,
+    KEY_VERSION,
+    KEY_LOADS,
+    KEY_NAME,
+    KEY_PIN,
+    KEY_ON,
+    KEY_OFF
+} Import_Key;
+
+/* The load being read. Both lists share one buffer of
+   CONFIG_SCHED_MAX_EVENTS_PER_LOAD events, the limit of ON and OFF
+   together: ON grows from the start, OFF from the end. */
+typedef struct
+{
+    char name[SCHED_LOAD_NAME_LEN];
+    uint8_t hasName;
+    uint8_t hasPin;
+    uint8_t pinNumber;
+    uint16_t numON;
+    uint16_t numOFF;
+    Date_and_Reps events[CONFIG_SCHED_MAX_EVENTS_PER_LOAD];
+} Import_Load;
+
+static struct
+{
+    uint8_t active;
+    uint8_t state;
+    uint8_t depth;
+    char containers[IMPORT_MAX_DEPTH];
+    uint8_t justOpened;         // an empty container may close right away
+    uint8_t stringIsKey;
+    char token[IMPORT_TOKEN_LEN];
+    uint8_t tokenLength;
+    uint8_t tokenTruncated;
+    uint8_t unicodeDigits;
+    uint16_t unicode;
+    uint64_t number;
+    uint8_t rootKey;
+    uint8_t loadKey;
+    uint64_t pair[2];
+    uint8_t pairValues;
+    uint32_t offset;            // bytes read, to locate errors
+    uint32_t loadsApplied;
+    uint32_t eventsApplied;
+    int64_t lastChunkAt;
+    uint8_t undoStarted;
+    uint8_t undoSaved[CONFIG_SCHED_MAX_LOADS];
+    const char* error;
+} import;
+
+static Import_Load importLoad;
+
+_Static_assert(sizeof(exportChunk) + sizeof(import) + sizeof(importLoad) <= SCHED_TRANSFER_RAM_BYTES,
+               "SCHED_TRANSFER_RAM_BYTES is too small");
+
+static Import_Key key_id(const char* key)
+{
+    if (strcmp(key, "v") == 0) return KEY_VERSION;
+    if (strcmp(key, "loads") == 0) return KEY_LOADS;
+    if (strcmp(key, "l") == 0) return KEY_NAME;
+    if (strcmp(key, "p") == 0) return KEY_PIN;
+    if (strcmp(key, "on") == 0) return KEY_ON;
+    if (strcmp(key, "off") == 0) return KEY_OFF;
+    return KEY_UNKNOWN;
+}
+
+static uint8_t fail(const char* error)
+{
+    if (import.error == NULL) import.error = error;
+    return 0;
+}
+
+static void reverse_events(Date_and_Reps* events, uint16_t numOfEvents)
+{
+    for (uint16_t i = 0; i < numOfEvents / 2; i++) {
+        Date_and_Reps aux = events[i];
+        events[i] = events[numOfEvents - 1 - i];
+        events[numOfEvents - 1 - i] = aux;
+    }
+}
+
+#if CONFIG_SCHED_VALIDATE_SCHEDULES
+// The load must alternate between ON and OFF, as save_schedule_time requires of a new date
+static uint8_t timeline_alternates(const Date_and_Reps* on, uint16_t numON, const Date_and_Reps* off, uint16_t numOFF)
+{
+    uint16_t i = 0, j = 0;
+    int lastState = -1;
+    uint64_t lastDate = 0;
+    while (i < numON || j < numOFF) {
+        uint8_t isON = j == numOFF || (i < numON && on[i].date < off[j].date);
+        uint64_t date = isON ? on[i++].date : off[j++].date;
+        if (lastState == isON || (lastState != -1 && date == lastDate)) return 0;
+        lastState = isON;
+        lastDate = date;
+    }
+    return 1;
+}
+#endif
+
+// Keeps the lists and pin of a load aside, once per import, before it changes
+static esp_err_t undo_save(uint8_t loadNumber, uint8_t isNew)
+{
+    if (import.undoSaved[loadNumber]) return ESP_OK;
+    char key[SCHED_LOAD_KEY_LEN];
+    nvs_handle_t handle;
+    LoadEvent old;
+    memset(&old, 0, sizeof(old));
+    esp_err_t err = isNew ? ESP_OK : read_load_lists(loadNumber, &old);
+    if (err == ESP_OK) err = storage_open(UNDO_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    uint8_t marker = 1;
+    if (!import.undoStarted) err = storage_set_blob(handle, UNDO_IMPORT_KEY, &marker, sizeof(marker));
+    if (err == ESP_OK) import.undoStarted = 1;
+    for (uint8_t loadState = 0; loadState < 2 && err == ESP_OK; loadState++) {
+        const Date_and_Reps* events = loadState ? old.eventsON : old.eventsOFF;
+        uint16_t numOfEvents = loadState ? old.numOfEventsON : old.numOfEventsOFF;
+        sched_loads_sched_key(loadNumber, loadState, key);
+        if (numOfEvents == 0) {
+            err = storage_erase_key(handle, key);
+            if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+        }
+        else err = storage_set_blob(handle, key, events, numOfEvents * sizeof(Date_and_Reps));
+    }
+    // The marker goes last: a load without it was not changed yet
+    marker = isNew ? UNDO_NEW_LOAD : old.pinNumber;
+    sched_loads_record_key(loadNumber, key);
+    if (err == ESP_OK) err = storage_set_blob(handle, key, &marker, sizeof(marker));
+    if (err == ESP_OK) err = storage_commit(handle);
+    storage_close(handle);
+    if (err == ESP_OK) import.undoSaved[loadNumber] = 1;
+    return err;
+}
+
+// Puts back the lists and pin kept by undo_save, if the load has them
+static esp_err_t undo_restore(nvs_handle_t undoHandle, uint8_t loadNumber)
+{
+    char key[SCHED_LOAD_KEY_LEN];
+    uint8_t marker;
+    size_t length = sizeof(marker);
+    sched_loads_record_key(loadNumber, key);
+    esp_err_t err = storage_get_blob(undoHandle, key, &marker, &length);
+    if (err == ESP_ERR_NVS_NOT_FOUND) return ESP_OK;
+    if (err != ESP_OK) return err;
+    const Load_Record* record = sched_loads_get(loadNumber);
+    if (record == NULL) return ESP_OK;
+    if (marker == UNDO_NEW_LOAD) return sched_loads_remove(loadNumber);
+
+    // Both old lists fit the buffer of the import, the limit is for ON and OFF together
+    Date_and_Reps* events = importLoad.events;
+    size_t lengths[2];
+    size_t used = 0;
+    for (uint8_t loadState = 0; loadState < 2 && err == ESP_OK; loadState++) {
+        sched_loads_sched_key(loadNumber, loadState, key);
+        lengths[loadState] = sizeof(importLoad.events) - used;
+        err = storage_get_blob(undoHandle, key, (uint8_t*)events + used, &lengths[loadState]);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            lengths[loadState] = 0;
+            err = ESP_OK;
+        }
+        used += lengths[loadState];
+    }
+    if (err != ESP_OK) return err;
+
+    nvs_handle_t handle;
+    err = storage_open(SCHEDULES_STORAGE_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    storage_txn_begin(handle);
+    used = 0;
+    for (uint8_t loadState = 0; loadState < 2 && err == ESP_OK; loadState++) {
+        sched_loads_sched_key(loadNumber, loadState, key);
+        if (lengths[loadState] == 0) {
+            err = storage_erase_key(handle, key);
+            if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+        }
+        else err = storage_set_blob(handle, key, (uint8_t*)events + used, lengths[loadState]);
+        used += lengths[loadState];
+    }
+    if (err == ESP_OK) err = storage_txn_commit(handle);
+    else storage_txn_abort(handle);
+    storage_close(handle);
+
+    if (err == ESP_OK && record->pinNumber != marker) {
+        char name[SCHED_LOAD_NAME_LEN];
+        uint8_t number;
+        strcpy(name, record->name);
+        err = sched_loads_register(name, marker, &number);
+    }
+    return err;
+}
+
+// Drops the undo data of the loads saved, of every load when "all"
+static void undo_clear(nvs_handle_t handle, uint8_t all)
+{
+    char key[SCHED_LOAD_KEY_LEN];
+    for (uint8_t loadNumber = 0; loadNumber < CONFIG_SCHED_MAX_LOADS; loadNumber++) {
+        if (!all && !import.undoSaved[loadNumber]) continue;
+        sched_loads_record_key(loadNumber, key);
+        storage_erase_key(handle, key);
+        for (uint8_t loadState = 0; loadState < 2; loadState++) {
+            sched_loads_sched_key(loadNumber, loadState, key);
+            storage_erase_key(handle, key);
+        }
+    }
+    storage_erase_key(handle, UNDO_IMPORT_KEY);
+    storage_commit(handle);
+}
+
+/* Puts back every load the import changed. After a reset nothing in RAM
+   says which, so "all" checks each load for a marker. The undo data is only
+   dropped once every load is back, otherwise the next boot tries again. */
+static esp_err_t undo_rollback(uint8_t all)
+{
+    nvs_handle_t handle;
+    esp_err_t err = storage_open(UNDO_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    for (uint8_t loadNumber = 0; loadNumber < CONFIG_SCHED_MAX_LOADS; loadNumber++) {
+        if (!all && !import.undoSaved[loadNumber]) continue;
+        esp_err_t loadErr = undo_restore(handle, loadNumber);
+        if (loadErr != ESP_OK) {
+            printf("Error (%s) restoring load %u after the import!\n", esp_err_to_name(loadErr), loadNumber);
+            err = loadErr;
+        }
+    }
+    if (err == ESP_OK) undo_clear(handle, all);
+    storage_close(handle);
+    return err;
+}
+
+// The object of a load closed: its lists replace the ones in NVS
+static uint8_t apply_load(void)
+{
+    Import_Load* load = &importLoad;
+    Date_and_Reps* eventsON = load->events;
+    Date_and_Reps* eventsOFF = &load->events[CONFIG_SCHED_MAX_EVENTS_PER_LOAD - load->numOFF];
+    if (!load->hasName) return fail("load without \"l\"");
+
+    // Exports are sorted already, so this is linear for them
+    reverse_events(eventsOFF, load->numOFF);
+    sort_sched_list(eventsON, load->numON);
+    sort_sched_list(eventsOFF, load->numOFF);
+    for (uint16_t i = 1; i < load->numON; i++) {
+        if (eventsON[i].date == eventsON[i - 1].date) return fail("date repeated in \"on\"");
+    }
+    for (uint16_t i = 1; i < load->numOFF; i++) {
+        if (eventsOFF[i].date == eventsOFF[i - 1].date) return fail("date repeated in \"off\"");
+    }
+#if CONFIG_SCHED_VALIDATE_SCHEDULES
+    if (!timeline_alternates(eventsON, load->numON, eventsOFF, load->numOFF)) return fail("ON and OFF dates do not alternate");
+#endif
+
+    int loadNumber = sched_loads_find(load->name);
+    const Load_Record* record = loadNumber >= 0 ? sched_loads_get(loadNumber) : NULL;
+    if (record == NULL && !load->hasPin) return fail("new load without \"p\"");
+    if (record != NULL && undo_save(loadNumber, 0) != ESP_OK) return fail("load not saved for the undo");
+    if (record == NULL || (load->hasPin && record->pinNumber != load->pinNumber)) {
+        uint8_t number;
+        if (sched_loads_register(load->name, load->pinNumber, &number) != ESP_OK) return fail("load not registered");
+        if (record == NULL && undo_save(number, 1) != ESP_OK) {
+            sched_loads_remove(number);
+            return fail("load not saved for the undo");
+        }
+        loadNumber = number;
+    }
+
+    char loadKey[SCHED_LOAD_KEY_LEN];
+    nvs_handle_t handle;
+    esp_err_t err = storage_open(SCHEDULES_STORAGE_NAMESPACE, &handle);
+    if (err != ESP_OK) return fail("schedules not opened");
+    storage_txn_begin(handle);
+    for (uint8_t loadState = 0; loadState < 2 && err == ESP_OK; loadState++) {
+        const Date_and_Reps* events = loadState ? eventsON : eventsOFF;
+        uint16_t numOfEvents = loadState ? load->numON : load->numOFF;
+        sched_loads_sched_key(loadNumber, loadState, loadKey);
+        if (numOfEvents == 0) {
+            err = storage_erase_key(handle, loadKey);
+            if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+        }
+        else err = storage_set_blob(handle, loadKey, events, numOfEvents * sizeof(Date_and_Reps));
+    }
+    if (err == ESP_OK) err = storage_txn_commit(handle);
+    else storage_txn_abort(handle);
+    storage_close(handle);
+    if (err != ESP_OK) return fail("schedules not written");
+
+    import.loadsApplied++;
+    import.eventsApplied += load->numON + load->numOFF;
+    SCHED_LOG("Load %s imported, %d events ON, %d events OFF.\n", load->name, load->numON, load->numOFF);
+    return 1;
+}
+
+static uint8_t on_open(char container)
+{
+    if (import.depth == IMPORT_MAX_DEPTH) return fail("nested too deep");
+    import.containers[import.depth++] = container;
+    import.justOpened = 1;
+    switch (import.depth) {
+    case 1:
+        return container == '{' ? 1 : fail("document is not an object");
+    case 2:
+        return container == '[' && import.rootKey == KEY_LOADS ? 1 : fail("unexpected container");
+    case 3:
+        if (container != '{') return fail("load is not an object");
+        memset(&importLoad, 0, offsetof(Import_Load, events));
+        import.loadKey = KEY_UNKNOWN;
+        return 1;
+    case 4:
+        return container == '[' && (import.loadKey == KEY_ON || import.loadKey == KEY_OFF) ? 1 : fail("unexpected container");
+    default:
+        import.pairValues = 0;
+        return container == '[' ? 1 : fail("event is not a [date, reps] pair");
+    }
+}
+
+static uint8_t on_close(void)
+{
+    uint8_t depth = import.depth--;
+    if (depth == 3) return apply_load();
+    if (depth != 5) return 1;
+
+    if (import.pairValues != 2) return fail("event is not a [date, reps] pair");
+    if (import.pair[1] > UINT8_MAX) return fail("repetitions above 255");
+    Import_Load* load = &importLoad;
+    if (load->numON + load->numOFF == CONFIG_SCHED_MAX_EVENTS_PER_LOAD) return fail("more events than CONFIG_SCHED_MAX_EVENTS_PER_LOAD");
+    Date_and_Reps* event = import.loadKey == KEY_ON ? &load->events[load->numON++]
+                                                    : &load->events[CONFIG_SCHED_MAX_EVENTS_PER_LOAD - ++load->numOFF];
+    event->date = import.pair[0];
+    event->repetions = import.pair[1];
+    return 1;
+}
+
+static uint8_t on_key(void)
+{
+    Import_Key key = import.tokenTruncated ? KEY_UNKNOWN : key_id(import.token);
+    if (import.depth == 1) import.rootKey = key;
+    else if (import.depth == 3) import.loadKey = key;
+    else return fail("unexpected key");
+    return 1;
+}
+
+// Scalars under keys of other versions are skipped
+static uint8_t on_string(void)
+{
+    if (import.depth == 3 && import.loadKey == KEY_NAME) {
+        if (import.tokenTruncated || import.tokenLength == 0) return fail("load name length");
+        strcpy(importLoad.name, import.token);
+        importLoad.hasName = 1;
+        return 1;
+    }
+    if ((import.depth == 1 && import.rootKey == KEY_UNKNOWN) || (import.depth == 3 && import.loadKey == KEY_UNKNOWN)) return 1;
+    return fail("unexpected string");
+}
+
+static uint8_t on_number(void)
+{
+    if (import.depth == 5) {
+        if (import.pairValues == 2) return fail("event is not a [date, reps] pair");
+        import.pair[import.pairValues++] = import.number;
+        return 1;
+    }
+    if (import.depth == 1 && import.rootKey == KEY_VERSION) {
+        return import.number == TRANSFER_VERSION ? 1 : fail("unsupported version");
+    }
+    if (import.depth == 3 && import.loadKey == KEY_PIN) {
+        if (import.number > UINT8_MAX) return fail("pin above 255");
+        importLoad.pinNumber = import.number;
+        importLoad.hasPin = 1;
+        return 1;
+    }
+    if ((import.depth == 1 && import.rootKey == KEY_UNKNOWN) || (import.depth == 3 && import.loadKey == KEY_UNKNOWN)) return 1;
+    return fail("unexpected number");
+}
+
+static uint8_t is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static void token_append(char c)
+{
+    if (import.tokenLength + 1 < sizeof(import.token)) {
+        import.token[import.tokenLength++] = c;
+        import.token[import.tokenLength] = '\0';
+    }
+    else import.tokenTruncated = 1;
+}
+
+static uint8_t hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0xff;
+}
+
+// One byte of the document; returns 0 on an error
+static uint8_t parse_byte(char c)
+{
+    switch (import.state) {
+    case IN_STRING:
+        if (c == '"') {
+            import.state = import.stringIsKey ? EXPECT_COLON : EXPECT_NEXT;
+            return import.stringIsKey ? on_key() : on_string();
+        }
+        if (c == '\\') import.state = IN_ESCAPE;
+        else if ((uint8_t) c < 0x20) return fail("control character in a string");
+        else token_append(c);
+        return 1;
+    case IN_ESCAPE:
+        import.state = IN_STRING;
+        if (c == '"' || c == '\\' || c == '/') token_append(c);
+        else if (c == 'n') token_append('\n');
+        else if (c == 't') token_append('\t');
+        else if (c == 'r') token_append('\r');
+        else if (c == 'u') {
+            import.state = IN_UNICODE;
+            import.unicodeDigits = 0;
+            import.unicode = 0;
+        }
+        else return fail("unsupported escape");
+        return 1;
+    case IN_UNICODE:
+        if (hex_value(c) == 0xff) return fail("bad \\u escape");
+        import.unicode = import.unicode << 4 | hex_value(c);
+        if (++import.unicodeDigits < 4) return 1;
+        // Names are stored as bytes, only ASCII escapes are taken
+        if (import.unicode >= 0x80) return fail("non-ASCII \\u escape");
+        token_append(import.unicode);
+        import.state = IN_STRING;
+        return 1;
+    case IN_NUMBER:
+        if (c >= '0' && c <= '9') {
+            if (import.number > (UINT64_MAX - (c - '0')) / 10) return fail("number too large");
+            import.number = import.number * 10 + (c - '0');
+            return 1;
+        }
+        if (c == '.' || c == 'e' || c == 'E') return fail("only whole numbers are accepted");
+        // The number ended, "c" belongs to what follows it
+        import.state = EXPECT_NEXT;
+        if (!on_number()) return 0;
+        return parse_byte(c);
+    default:
+        break;
+    }
+
+    if (is_space(c)) return 1;
+    char top = import.depth > 0 ? import.containers[import.depth - 1] : 0;
+    uint8_t closes = (c == '}' && top == '{') || (c == ']' && top == '[');
+    switch (import.state) {
+    case EXPECT_VALUE:
+        if (c == '{' || c == '[') {
+            import.state = c == '{' ? EXPECT_KEY : EXPECT_VALUE;
+            return on_open(c);
+        }
+        if (c == '"') {
+            import.state = IN_STRING;
+            import.stringIsKey = 0;
+            import.tokenLength = 0;
+            import.tokenTruncated = 0;
+            import.token[0] = '\0';
+            return 1;
+        }
+        if (c >= '0' && c <= '9') {
+            import.state = IN_NUMBER;
+            import.number = c - '0';
+            return 1;
+        }
+        if (c == ']' && closes && import.justOpened) break;
+        if (c == '-') return fail("negative number");
+        return fail("value expected");
+    case EXPECT_KEY:
+        if (c == '"') {
+            import.state = IN_STRING;
+            import.stringIsKey = 1;
+            import.tokenLength = 0;
+            import.tokenTruncated = 0;
+            import.token[0] = '\0';
+            return 1;
+        }
+        if (c == '}' && import.justOpened) break;
+        return fail("key expected");
+    case EXPECT_COLON:
+        if (c != ':') return fail("':' expected");
+        import.state = EXPECT_VALUE;
+        import.justOpened = 0;
+        return 1;
+    default:
+        if (import.depth == 0) return fail("data after the document");
+        if (c == ',') {
+            import.state = top == '{' ? EXPECT_KEY : EXPECT_VALUE;
+            import.justOpened = 0;
+            return 1;
+        }
+        if (closes) break;
+        return fail("',' or the end of the container expected");
+    }
+
+    // Closing the innermost container
+    import.state = EXPECT_NEXT;
+    import.justOpened = 0;
+    return on_close();
+}
+
+esp_err_t sched_transfer_recover(void)
+{
+    nvs_handle_t handle;
+    uint8_t marker;
+    size_t length = sizeof(marker);
+    esp_err_t err = storage_open(UNDO_NAMESPACE, &handle);
+    if (err != ESP_OK) return err;
+    err = storage_get_blob(handle, UNDO_IMPORT_KEY, &marker, &length);
+    storage_close(handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND) return ESP_OK;
+    if (err != ESP_OK) return err;
+    printf("Rolling back an import cut short.\n");
+    memset(&import, 0, sizeof(import));
+    return undo_rollback(1);
+}
+
+void sched_transfer_import_begin(void)
+{
+    // Undo data left by a rollback that failed is used before it is overwritten
+    esp_err_t err = sched_transfer_recover();
+    if (err != ESP_OK) printf("Error (%s) rolling back the last import!\n", esp_err_to_name(err));
+    memset(&import, 0, sizeof(import));
+    import.active = 1;
+    import.state = EXPECT_VALUE;
+    import.lastChunkAt = esp_timer_get_time();
+}
+
+uint8_t sched_transfer_import_active(void)
+{
+    return import.active;
+}
+
+uint32_t sched_transfer_import_loads(void)
+{
+    return import.loadsApplied;
+}
+
+static void import_end(Sched_Import_State state)
+{
+    import.active = 0;
+    if (state == SCHED_IMPORT_FAILED) {
+        printf("Import failed at byte %u: %s. %u loads imported before it are restored.\n", import.offset, import.error, import.loadsApplied);
+        esp_err_t err = import.undoStarted ? undo_rollback(0) : ESP_OK;
+        if (err != ESP_OK) printf("Error (%s) restoring the loads, tried again at the next import or boot!\n", esp_err_to_name(err));
+    }
+    else {
+        SCHED_LOG("Import done: %u bytes, %u loads, %u events.\n", import.offset, import.loadsApplied, import.eventsApplied);
+        nvs_handle_t handle;
+        if (import.undoStarted && storage_open(UNDO_NAMESPACE, &handle) == ESP_OK) {
+            undo_clear(handle, 0);
+            storage_close(handle);
+        }
+    }
+    if (!import.undoStarted) return;
+
+    // The scheduler gets every imported load at once
+    Sched_Delta delta;
+    memset(&delta, 0, sizeof(delta));
+    delta.type = SCHED_DELTA_RELOAD;
+    delta.loads = return_sched_from_NVS(&delta.numberOfLoads);
+    if (delta.loads != NULL) commit_sched_change(&delta);
+}
+
+void sched_transfer_import_cancel(const char* reason)
+{
+    if (!import.active) return;
+    fail(reason);
+    import_end(SCHED_IMPORT_FAILED);
+}
+
+void sched_transfer_import_poll(void)
+{
+    if (import.active && esp_timer_get_time() - import.lastChunkAt > IMPORT_TIMEOUT_US) {
+        sched_transfer_import_cancel("no chunk for CONFIG_SCHED_IMPORT_TIMEOUT_S seconds");
+    }
+}
+
+Sched_Import_State sched_transfer_import_feed(const char* chunk, size_t length)
+{
+    if (!import.active) return SCHED_IMPORT_FAILED;
+    import.lastChunkAt = esp_timer_get_time();
+    for (size_t i = 0; i < length; i++, import.offset++) {
+        if (import.depth == 0 && import.state == EXPECT_NEXT) {
+            // Only whitespace may follow the document
+            if (!is_space(chunk[i])) fail("data after the document");
+            else continue;
+        }
+        if (import.error != NULL || !parse_byte(chunk[i])) {
+            import_end(SCHED_IMPORT_FAILED);
+            return SCHED_IMPORT_FAILED;
+        }
+    }
+    if (import.depth == 0 && import.state == EXPECT_NEXT) {
+        import_end(SCHED_IMPORT_DONE);
+        return SCHED_IMPORT_DONE;
+    }
+    return SCHED_IMPORT_MORE;
+}
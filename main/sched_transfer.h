@@ -0,0 +1,55 @@
+#ifndef SCHED_TRANSFER_H_
+#define SCHED_TRANSFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+#include "nvs_blob_example_main.h"
+
+/* Bulk export and import of the schedule table as one JSON document:
+     {"v":1,"loads":[{"l":"lamp","p":4,"on":[[date,reps],...],"off":[...]},...]}
+   The export walks the current snapshot (reading from NVS the loads only
+   partly resident) and hands the document out in chunks of at most
+   SCHED_TRANSFER_CHUNK bytes, no cJSON tree is built.
+   The import is a parser fed with the chunks as they arrive, split
+   anywhere, even inside a token. It holds only the load being read: when
+   the load's object closes, its lists replace the ones in NVS (both keys
+   in one transaction) and, once the document closes, the scheduler gets
+   the new table in one reload. Loads not in the document are kept, a load
+   not registered yet is registered on pin "p".
+   The journal of a transaction holds one load, so the document is not one
+   transaction: the old lists and pin of each load are copied aside before
+   it changes, and an import that fails, is cancelled or is cut by a reset
+   (sched_transfer_recover, at boot) puts them back. The document is thus
+   applied whole or not at all.
+ */
+#define SCHED_TRANSFER_CHUNK CONFIG_SCHED_MAX_COMMAND_LEN
+
+#define SCHED_TRANSFER_RAM_BYTES (SCHED_TRANSFER_CHUNK + CONFIG_SCHED_MAX_EVENTS_PER_LOAD * sizeof(Date_and_Reps) + CONFIG_SCHED_MAX_LOADS + 160)
+
+typedef void (*Sched_Transfer_Write)(const char* chunk, size_t length, void* context);
+
+typedef enum
+{
+    SCHED_IMPORT_MORE,      // the document is not complete yet
+    SCHED_IMPORT_DONE,
+    SCHED_IMPORT_FAILED     // the loads applied before the error are restored
+} Sched_Import_State;
+
+// Returns the size of the document
+uint32_t sched_transfer_export(Sched_Transfer_Write write, void* context);
+
+// Rolls back an import cut by a reset, one lookup otherwise
+esp_err_t sched_transfer_recover(void);
+void sched_transfer_import_begin(void);
+Sched_Import_State sched_transfer_import_feed(const char* chunk, size_t length);
+// Ends the import as failed, restoring the loads it changed
+void sched_transfer_import_cancel(const char* reason);
+// Cancels an import without a chunk for CONFIG_SCHED_IMPORT_TIMEOUT_S
+void sched_transfer_import_poll(void);
+uint8_t sched_transfer_import_active(void);
+uint32_t sched_transfer_import_loads(void);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+#include "nvs_blob_example_main.h"
+#include "sched_loads.h"
+#include "sched_log.h"
+#include "sched_snapshot.h"
+#include "sched_window.h"
+
+#if SCHED_WINDOW_EVENTS
+
+static uint32_t refills = 0;
+static int64_t refillTimeSum = 0;
+static int64_t refillTimeMax = 0;
+
+esp_err_t sched_window_refill(uint8_t loadNumber)
+{
+    int64_t start = esp_timer_get_time();
+    LoadEvent lists;
+    // NVS has no partial reads: the whole list is read, sorted, and its next events kept
+    esp_err_t err = read_load_lists(loadNumber, &lists);
+    if (err != ESP_OK) return err;
+
+    Sched_Delta delta;
+    memset(&delta, 0, sizeof(delta));
+    delta.type = SCHED_DELTA_WINDOW;
+    delta.loadNumber = loadNumber;
+    strcpy(delta.loadName, lists.loadName);
+    delta.loads = &lists;
+    delta.numberOfLoads = 1;
+    commit_sched_change(&delta);
+
+    int64_t elapsed = esp_timer_get_time() - start;
+    refills++;
+    refillTimeSum += elapsed;
+    if (elapsed > refillTimeMax) refillTimeMax = elapsed;
+    SCHED_LOG("Window of load %s refilled from %d events in NVS in %lld us.\n", lists.loadName,
+              lists.numOfEventsON + lists.numOfEventsOFF, elapsed);
+    return ESP_OK;
+}
+
+void sched_window_step(void)
+{
+    uint8_t drained[CONFIG_SCHED_MAX_LOADS];
+    uint8_t numberOfDrained = 0;
+    // Only this task changes the table, so the loads found stay drained until refilled
+    const Sched_Snapshot* snapshot = sched_snapshot_read_begin(SCHED_READER_QUERY);
+    for (int l = 0; l < snapshot->numberOfLoads; l++) {
+        const Sched_Load* load = &snapshot->loads[l];
+        if (load->windowEnd != UINT64_MAX && load->numOfEvents <= SCHED_WINDOW_EVENTS / 2)
+            drained[numberOfDrained++] = load->loadNumber;
+    }
+    sched_snapshot_read_end(SCHED_READER_QUERY);
+
+    for (int i = 0; i < numberOfDrained; i++) {
+        esp_err_t err = sched_window_refill(drained[i]);
+        if (err != ESP_OK) SCHED_LOG("Error (%s) refilling the window of load %d!\n", esp_err_to_name(err), drained[i]);
+    }
+}
+
+void sched_window_print_stats(void)
+{
+    printf("Windows: %d events per load resident, %u refills", SCHED_WINDOW_EVENTS, refills);
+    if (refills > 0) printf(" (avg %lld / max %lld us)", refillTimeSum / refills, refillTimeMax);
+    printf(".\n");
+}
+
+#else
+
+void sched_window_step(void)
+{
+}
+
+esp_err_t sched_window_refill(uint8_t loadNumber)
+{
+    return ESP_OK;
+}
+
+void sched_window_print_stats(void)
+{
+    printf("Windows are disabled (CONFIG_SCHED_WINDOW_EVENTS), every event is resident.\n");
+}
+
+#endif
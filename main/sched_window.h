@@ -0,0 +1,20 @@
+#ifndef SCHED_WINDOW_H_
+#define SCHED_WINDOW_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+/* Refill of the schedule windows (CONFIG_SCHED_WINDOW_EVENTS, see
+   sched_snapshot.h). The scheduler asks for a refill with the purge of a
+   load whose resident events drained to half the window, or whose window
+   ended, and the command task refills it right after that purge: the
+   lists are read back and the next SCHED_WINDOW_EVENTS events published
+   in one snapshot change. sched_window_step, after the purges, refills
+   any other drained window.
+ */
+void sched_window_step(void);
+esp_err_t sched_window_refill(uint8_t loadNumber);
+void sched_window_print_stats(void);
+
+#endif
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "time_service.h"
+#include "nvs_storage.h"
+
+#define STORAGE_NAMESPACE "Storage"
+#define TIME_BASE_KEY "timeBase"
+#define TIME_SYNCED_KEY "timeSynced"
+
+/* Epoch time in microseconds is kept as an offset over esp_timer, which
+   counts microseconds since boot. The offset is seeded by the "set time"
+   command and, since esp_timer restarts from zero on every reset, the clock
+   is checkpointed in NVS so after a reset it resumes from the last saved
+   time instead of going back to 1970.
+ */
+static int64_t epochOffsetUs = 0;
+static uint8_t timeSynced = 0;
+static uint64_t lastCheckpointUs = 0;
+
+static esp_err_t save_time_base(uint64_t epochUs)
+{
+    nvs_handle_t my_handle;
+    esp_err_t err = storage_open(STORAGE_NAMESPACE, &my_handle);
+    if (err != ESP_OK) return err;
+    err = storage_set_u64(my_handle, TIME_BASE_KEY, epochUs);
+    if (err == ESP_OK) err = storage_set_u8(my_handle, TIME_SYNCED_KEY, timeSynced);
+    if (err == ESP_OK) err = storage_commit(my_handle);
+    storage_close(my_handle);
+    if (err == ESP_OK) lastCheckpointUs = epochUs;
+    return err;
+}
+
+void time_service_init(void)
+{
+    nvs_handle_t my_handle;
+    uint64_t timeBase = 0;
+    esp_err_t err = storage_open(STORAGE_NAMESPACE, &my_handle);
+    if (err != ESP_OK) {
+        printf("Error (%s) opening Storage NVS handle, clock starts at 0!\n", esp_err_to_name(err));
+        return;
+    }
+    err = nvs_get_u64(my_handle, TIME_BASE_KEY, &timeBase);
+    if (err == ESP_OK) nvs_get_u8(my_handle, TIME_SYNCED_KEY, &timeSynced);
+    storage_close(my_handle);
+
+    if (err == ESP_OK) {
+        epochOffsetUs = timeBase - esp_timer_get_time();
+        lastCheckpointUs = timeBase;
+        printf("Clock resumed from checkpoint %lld us (%s).\n", timeBase, timeSynced ? "synced before reset" : "never synced");
+    } else {
+        printf("No time checkpoint saved yet, clock starts at 0. Send the \"set time\" command.\n");
+    }
+}
+
+/* Seed the clock with the current epoch time, in microseconds */
+esp_err_t time_service_set_time(uint64_t epochUs)
+{
+    epochOffsetUs = epochUs - esp_timer_get_time();
+    timeSynced = 1;
+    printf("Time set to %lld us.\n", epochUs);
+    return save_time_base(epochUs);
+}
+
+uint64_t time_service_now_us(void)
+{
+    return esp_timer_get_time() + epochOffsetUs;
+}
+
+uint64_t time_service_now_s(void)
+{
+    return time_service_now_us() / USEC_PER_SEC;
+}
+
+uint8_t time_service_is_synced(void)
+{
+    return timeSynced;
+}
+
+/* Persist the current time if the last checkpoint is older than
+   CONFIG_SCHED_TIME_CHECKPOINT_S, bounding how far the clock falls
+   behind after a reset.
+ */
+void time_service_checkpoint(void)
+{
+    uint64_t now = time_service_now_us();
+    if (now - lastCheckpointUs < CONFIG_SCHED_TIME_CHECKPOINT_S * USEC_PER_SEC) return;
+    esp_err_t err = save_time_base(now);
+    if (err != ESP_OK) printf("Error (%s) saving time checkpoint!\n", esp_err_to_name(err));
+}
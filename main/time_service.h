@@ -0,0 +1,16 @@
+#ifndef TIME_SERVICE_H_
+#define TIME_SERVICE_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define USEC_PER_SEC 1000000ULL
+
+void time_service_init(void);
+esp_err_t time_service_set_time(uint64_t epochUs);
+uint64_t time_service_now_us(void);
+uint64_t time_service_now_s(void);
+uint8_t time_service_is_synced(void);
+void time_service_checkpoint(void);
+
+#endif
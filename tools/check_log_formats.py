@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+"""Fail the build on SCHED_LOG formats the deferred logger cannot record.
+
+sched_log copies the arguments of a call by walking its format, so every
+conversion must give the size of its argument: floating point conversions
+and '*' widths or precisions are refused (see main/sched_log.h).
+
+    check_log_formats.py main
+"""
+
+import pathlib
+import re
+import sys
+
+CALL = re.compile(r'\b(?:SCHED_LOG|sched_log)\s*\(\s*((?:"(?:[^"\\]|\\.)*"\s*)+)')
+LITERAL = re.compile(r'"((?:[^"\\]|\\.)*)"')
+CONVERSION = re.compile(r'%[-+ #0]*(\*|\d*)(?:\.(\*|\d*))?(?:hh|h|ll|l|z)?([a-zA-Z%])')
+UNSUPPORTED = set('fFeEgGaA')
+
+
+def check(path):
+    errors = []
+    source = path.read_text(errors='replace')
+    for call in CALL.finditer(source):
+        fmt = ''.join(LITERAL.findall(call.group(1)))
+        for conversion in CONVERSION.finditer(fmt):
+            width, precision, kind = conversion.groups()
+            if kind in UNSUPPORTED or width == '*' or precision == '*':
+                line = source.count('\n', 0, call.start()) + 1
+                errors.append(f'{path}:{line}: SCHED_LOG cannot record "{conversion.group(0)}"')
+    return errors
+
+
+def main():
+    directory = pathlib.Path(sys.argv[1] if len(sys.argv) > 1 else 'main')
+    errors = []
+    for path in sorted(directory.glob('*.c')):
+        errors += check(path)
+    for error in errors:
+        print(error, file=sys.stderr)
+    return 1 if errors else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+"""Fail the build when nvs_image.py no longer matches the firmware.
+
+The layouts nvs_image.py writes are checked against the sources: the
+namespaces and journal key, the "L<number>" key formats of sched_loads.c,
+Load_Record and Date_and_Reps laid out as the compiler does, and the
+limits taken without sdkconfig against the Kconfig defaults. Then
+documents are built into images and inspected back, which must give the
+same loads: lists spanning pages, names and pins at their limits, 64-bit
+dates, and dumps of older firmware (u8 pins, "<name>ON" keys, a pending
+"~txn"). The firmware reading an image is only checked on a device.
+
+    check_nvs_image.py main
+"""
+
+import pathlib
+import re
+import struct
+import sys
+
+sys.path.insert(0, str(pathlib.Path(__file__).resolve().parent))
+import nvs_image  # noqa: E402
+
+C_TYPES = {'char': ('s', 1), 'uint8_t': ('B', 1), 'uint16_t': ('H', 2), 'uint32_t': ('I', 4), 'uint64_t': ('Q', 8)}
+FIELD = re.compile(r'^\s*(\w+)\s+(\w+)(?:\[(\w+)\])?\s*;', re.MULTILINE)
+
+
+def define(source, name):
+    match = re.search(r'#define\s+%s\s+("(?:[^"\\]|\\.)*"|\w+)' % name, source)
+    if match is None:
+        raise AssertionError('%s not defined' % name)
+    value = match.group(1)
+    return value.strip('"') if value.startswith('"') else int(value, 0)
+
+
+def struct_format(source, name, defines):
+    """Format of a typedef'd struct with the padding of natural alignment"""
+    match = re.search(r'typedef struct\s*\w*\s*\{([^}]*)\}\s*%s\s*;' % name, source)
+    if match is None:
+        raise AssertionError('struct %s not found' % name)
+    fmt, offset, alignment = '<', 0, 1
+    for ctype, _, length in FIELD.findall(match.group(1)):
+        code, size = C_TYPES[ctype]
+        if -offset % size:
+            fmt += '%dx' % (-offset % size)
+            offset += -offset % size
+        count = int(defines.get(length, length)) if length else 1
+        fmt += ('%d%s' % (count, code)) if count > 1 or code == 's' else code
+        offset += size * count
+        alignment = max(alignment, size)
+    if -offset % alignment:
+        fmt += '%dx' % (-offset % alignment)
+    return fmt
+
+
+def check_layouts(main):
+    errors = []
+    header = (main / 'nvs_blob_example_main.h').read_text()
+    loads_header = (main / 'sched_loads.h').read_text()
+    storage = (main / 'nvs_storage.c').read_text()
+    loads = (main / 'sched_loads.c').read_text()
+
+    name_len = define(loads_header, 'SCHED_LOAD_NAME_LEN')
+    expected = [
+        ('SCHEDULES_NAMESPACE', nvs_image.SCHEDULES_NAMESPACE, define(header, 'SCHEDULES_STORAGE_NAMESPACE')),
+        ('LOADS_NAMESPACE', nvs_image.LOADS_NAMESPACE, define(header, 'LOADS_STORAGE_NAMESPACE')),
+        ('TXN_KEY', nvs_image.TXN_KEY, define(storage, 'STORAGE_TXN_KEY')),
+        ('LOAD_NAME_LEN', nvs_image.LOAD_NAME_LEN, name_len),
+        ('LOAD_RECORD', nvs_image.LOAD_RECORD.format,
+         struct_format(loads_header, 'Load_Record', {'SCHED_LOAD_NAME_LEN': name_len})),
+        ('EVENT', nvs_image.EVENT.format, struct_format(header, 'Date_and_Reps', {})),
+    ]
+    for name, tool, firmware in expected:
+        if tool != firmware:
+            errors.append('nvs_image.py %s is %r, the firmware uses %r' % (name, tool, firmware))
+    # Without sdkconfig the tool takes the Kconfig defaults
+    kconfig = (main / 'Kconfig.projbuild').read_text()
+    for name, value in nvs_image.read_limits(None).items():
+        match = re.search(r'config %s\n(?:[ \t]+[^\n]*\n)*?[ \t]+default (\w+)' % name[len('CONFIG_'):], kconfig)
+        default = None if match is None else match.group(1) == 'y' if isinstance(value, bool) else int(match.group(1), 0)
+        if default != value:
+            errors.append('nvs_image.py takes %s=%r without sdkconfig, Kconfig gives %r' % (name, value, default))
+    # build_image writes 'L%03u' and 'L%03u%s' % (number, 'ON' / 'OFF')
+    keys = set(re.findall(r'sprintf\(key,\s*"([^"]*)"', loads))
+    if keys != {'L%03u', 'L%03u%s'} or '"ON" : "OFF"' not in loads:
+        errors.append('sched_loads.c names keys %s, nvs_image.py writes L%%03u and L%%03u%%s' % sorted(keys))
+    return errors
+
+
+def inspect(image):
+    reader = nvs_image.ImageReader(image)
+    document, pending = nvs_image.read_document(reader)
+    return reader, document, pending
+
+
+def expected_loads(document):
+    return [{'l': load['l'], 'p': load['p'],
+             'on': sorted([date, reps] for date, reps in load.get('on', [])),
+             'off': sorted([date, reps] for date, reps in load.get('off', []))} for load in document['loads']]
+
+
+def check_round_trip(name, document, limits):
+    errors = []
+    reader, read, pending = inspect(nvs_image.build_image(document, limits))
+    errors += ['%s: %s' % (name, error) for error in reader.errors]
+    loads = [{key: load[key] for key in ('l', 'p', 'on', 'off')} for load in read['loads']]
+    if loads != expected_loads(document):
+        errors.append('%s: the image reads back different loads' % name)
+    if [load.get('number') for load in read['loads']] != list(range(len(document['loads']))):
+        errors.append('%s: loads not numbered in document order' % name)
+    if pending:
+        errors.append('%s: a journal was found in a built image' % name)
+    return errors, reader
+
+
+def check_images(limits):
+    errors = []
+    cases = [
+        ('empty', {'v': 1, 'loads': []}),
+        ('no events', {'v': 1, 'loads': [{'l': 'lamp', 'p': 4}]}),
+        ('limits', {'v': 1, 'loads': [
+            {'l': 'n' * (nvs_image.LOAD_NAME_LEN - 1), 'p': 255, 'on': [[(1 << 64) - 1, 255], [0, 0]]},
+            {'l': 'fan', 'p': 0, 'on': [[2200000000, 1]], 'off': [[4102444800, 7]]}]}),
+    ]
+    # Lists of more than a page of entries are split in chunks over pages
+    long_list = [[1700000000 + 60 * n, n % 256] for n in range(600)]
+    cases.append(('multi-page', {'v': 1, 'loads': [{'l': 'load%02d' % n, 'p': n, 'on': long_list[n::2],
+                                                    'off': long_list[n + 1::2]} for n in range(3)]}))
+    wide = dict(limits, CONFIG_SCHED_MAX_EVENTS_PER_LOAD=len(long_list), CONFIG_SCHED_VALIDATE_SCHEDULES=False)
+    for name, document in cases:
+        case_errors, reader = check_round_trip(name, document, wide)
+        errors += case_errors
+        if name == 'multi-page' and not any(count > 1 for _, count, _ in reader.indexes.values()):
+            errors.append('multi-page: no list was split over pages')
+
+    refused = [
+        ('too many events', {'loads': [{'l': 'lamp', 'p': 4, 'on': long_list}]}, limits),
+        ('repeated date', {'loads': [{'l': 'lamp', 'p': 4, 'on': [[5, 1], [5, 2]]}]}, wide),
+        ('long name', {'loads': [{'l': 'n' * nvs_image.LOAD_NAME_LEN, 'p': 4}]}, wide),
+        ('repeated load', {'loads': [{'l': 'lamp', 'p': 4}, {'l': 'lamp', 'p': 5}]}, wide),
+    ]
+    for name, document, case_limits in refused:
+        try:
+            nvs_image.build_image(document, case_limits)
+            errors.append('%s: image built, should be refused' % name)
+        except nvs_image.ImageError:
+            pass
+
+    # A dump of older firmware: pin stored as u8 under the name, "<name>ON" list, pending journal
+    writer = nvs_image.ImageWriter(3 * nvs_image.PAGE_SIZE)
+    writer.namespace(nvs_image.SCHEDULES_NAMESPACE)
+    entry = writer.header(writer.namespace(nvs_image.LOADS_NAMESPACE), nvs_image.TYPE_U8, 1, nvs_image.CHUNK_ANY, 'lamp')
+    entry[24] = 4
+    writer.write_entry(entry)
+    writer.blob(nvs_image.SCHEDULES_NAMESPACE, 'lampON', nvs_image.EVENT.pack(3, 1700000000))
+    writer.blob(nvs_image.SCHEDULES_NAMESPACE, nvs_image.TXN_KEY, b'\0')
+    reader, read, pending = inspect(writer.finish())
+    legacy = read['loads'][0] if len(read['loads']) == 1 else {}
+    if reader.errors or not legacy.get('legacy') or legacy.get('p') != 4 or legacy.get('on') != [[1700000000, 3]]:
+        errors.append('older firmware: u8 pin and "<name>ON" list not read back')
+    if not pending:
+        errors.append('older firmware: pending journal not reported')
+
+    # A damaged blob (the first byte of the load name) must be reported, not read as a value
+    image = bytearray(nvs_image.build_image(cases[1][1], wide))
+    struct.pack_into('<B', image, nvs_image.FIRST_ENTRY_OFFSET + 3 * nvs_image.ENTRY_SIZE, 0)
+    if not inspect(image)[0].errors:
+        errors.append('damaged blob: not reported')
+    return errors
+
+
+def main():
+    main_directory = pathlib.Path(sys.argv[1] if len(sys.argv) > 1 else 'main')
+    limits = nvs_image.read_limits(main_directory / '..' / 'sdkconfig')
+    errors = check_layouts(main_directory) + check_images(limits)
+    for error in errors:
+        print('check_nvs_image: %s' % error, file=sys.stderr)
+    return 1 if errors else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,414 @@
+#!/usr/bin/env python3
+"""Build and inspect images of the MyNvs partition offline.
+
+The schedules are described with the document of the export / import
+commands (17 / 18):
+
+    {"v":1,"loads":[{"l":"lamp","p":4,"on":[[date,reps],...],"off":[...]},...]}
+
+build    writes a flashable MyNvs image holding those loads, in the layout
+         the firmware reads: loadList "L<number>" records (name and pin) and
+         schedList "L<number>ON" / "L<number>OFF" lists sorted by date.
+         Loads are numbered in document order, as the firmware would.
+batch    builds one image per line of a JSON lines file, for provisioning.
+inspect  maps a dumped image and prints its loads and schedules, or with
+         --json the document above, which build and command 18 accept.
+
+The limits (CONFIG_SCHED_MAX_LOADS, CONFIG_SCHED_MAX_EVENTS_PER_LOAD,
+CONFIG_SCHED_VALIDATE_SCHEDULES) come from the project's sdkconfig.
+
+    nvs_image.py build schedules.json mynvs.bin
+    parttool.py write_partition --partition-name MyNvs --input mynvs.bin
+    parttool.py read_partition --partition-name MyNvs --output dump.bin
+    nvs_image.py inspect dump.bin
+
+Images use NVS format version 2 (multi-page blobs), as ESP-IDF v4 does.
+check_nvs_image.py checks the tool against the firmware sources on every build.
+"""
+
+import argparse
+import json
+import mmap
+import os
+import struct
+import sys
+import time
+import zlib
+
+PAGE_SIZE = 4096
+ENTRY_SIZE = 32
+ENTRIES_PER_PAGE = 126
+FIRST_ENTRY_OFFSET = 64
+PAGE_ACTIVE = 0xFFFFFFFE
+PAGE_FULL = 0xFFFFFFFC
+PAGE_VERSION = 0xFE
+
+TYPE_U8 = 0x01
+TYPE_BLOB = 0x41            # format version 1 blobs, read only
+TYPE_BLOB_DATA = 0x42
+TYPE_BLOB_IDX = 0x48
+CHUNK_ANY = 0xFF
+
+ENTRY_EMPTY = 3
+ENTRY_WRITTEN = 2
+
+SCHEDULES_NAMESPACE = 'schedList'
+LOADS_NAMESPACE = 'loadList'
+TXN_KEY = '~txn'
+
+LOAD_NAME_LEN = 20          # SCHED_LOAD_NAME_LEN, including the terminator
+LOAD_RECORD = struct.Struct('<20sB')        # Load_Record
+EVENT = struct.Struct('<B7xQ')              # Date_and_Reps: reps, padding, date
+PARTITION_SIZE = 0x100000                   # partitions.csv
+
+DEFAULT_SDKCONFIG = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'sdkconfig')
+
+
+class ImageError(Exception):
+    pass
+
+
+def crc32(data):
+    return zlib.crc32(data, 0xFFFFFFFF) & 0xFFFFFFFF
+
+
+def entry_crc(entry):
+    return crc32(bytes(entry[0:4]) + bytes(entry[8:32]))
+
+
+def read_limits(path):
+    # The Kconfig defaults, for a project without sdkconfig
+    limits = {'CONFIG_SCHED_MAX_LOADS': 16, 'CONFIG_SCHED_MAX_EVENTS_PER_LOAD': 64,
+              'CONFIG_SCHED_VALIDATE_SCHEDULES': True}
+    if path and os.path.exists(path):
+        with open(path) as sdkconfig:
+            for line in sdkconfig:
+                name, _, value = line.strip().partition('=')
+                if name in limits:
+                    limits[name] = value == 'y' if isinstance(limits[name], bool) else int(value, 0)
+    return limits
+
+
+# Build
+
+class ImageWriter:
+    """Writes entries to consecutive pages, as nvs_partition_gen.py does"""
+
+    def __init__(self, size):
+        if size % PAGE_SIZE or size < 3 * PAGE_SIZE:
+            raise ImageError('image size must be a multiple of %d, at least 3 pages' % PAGE_SIZE)
+        self.image = bytearray(b'\xff') * size
+        # NVS needs one free page to move entries when a page fills up
+        self.pages = size // PAGE_SIZE - 1
+        self.page = -1
+        self.entry = ENTRIES_PER_PAGE
+        self.namespaces = {}
+
+    def new_page(self):
+        if self.page >= 0:
+            struct.pack_into('<I', self.image, self.page * PAGE_SIZE, PAGE_FULL)
+        self.page += 1
+        if self.page == self.pages:
+            raise ImageError('the schedules do not fit the partition')
+        header = bytearray(b'\xff') * 32
+        struct.pack_into('<IIB', header, 0, PAGE_ACTIVE, self.page, PAGE_VERSION)
+        struct.pack_into('<I', header, 28, crc32(bytes(header[4:28])))
+        self.image[self.page * PAGE_SIZE:self.page * PAGE_SIZE + 32] = header
+        self.entry = 0
+
+    def room(self):
+        return ENTRIES_PER_PAGE - self.entry
+
+    def write_entry(self, entry, data_entries=b''):
+        span = 1 + len(data_entries) // ENTRY_SIZE
+        if self.room() < span:
+            self.new_page()
+        offset = self.page * PAGE_SIZE + FIRST_ENTRY_OFFSET + self.entry * ENTRY_SIZE
+        struct.pack_into('<I', entry, 4, entry_crc(entry))
+        self.image[offset:offset + ENTRY_SIZE] = entry
+        self.image[offset + ENTRY_SIZE:offset + span * ENTRY_SIZE] = data_entries
+        bitmap = self.page * PAGE_SIZE + 32
+        for n in range(self.entry, self.entry + span):
+            self.image[bitmap + n // 4] &= ~(1 << (n % 4) * 2) & 0xFF
+        self.entry += span
+
+    @staticmethod
+    def header(namespace, entry_type, span, chunk, key):
+        if len(key) > 15:
+            raise ImageError('key %s longer than 15 characters' % key)
+        entry = bytearray(b'\xff') * ENTRY_SIZE
+        struct.pack_into('<BBBB', entry, 0, namespace, entry_type, span, chunk)
+        entry[8:24] = key.encode().ljust(16, b'\0')
+        return entry
+
+    def namespace(self, name):
+        if name not in self.namespaces:
+            index = len(self.namespaces) + 1
+            entry = self.header(0, TYPE_U8, 1, CHUNK_ANY, name)
+            entry[24] = index
+            self.write_entry(entry)
+            self.namespaces[name] = index
+        return self.namespaces[name]
+
+    def blob(self, namespace, key, value):
+        index = self.namespace(namespace)
+        chunks = 0
+        position = 0
+        while position < len(value) or chunks == 0:
+            # A chunk takes the rest of the page, and at least one data entry
+            if self.room() < 2:
+                self.new_page()
+            data = value[position:position + (self.room() - 1) * ENTRY_SIZE]
+            padded = data + b'\xff' * (-len(data) % ENTRY_SIZE)
+            entry = self.header(index, TYPE_BLOB_DATA, 1 + len(padded) // ENTRY_SIZE, chunks, key)
+            struct.pack_into('<H', entry, 24, len(data))
+            struct.pack_into('<I', entry, 28, crc32(data))
+            self.write_entry(entry, padded)
+            position += len(data)
+            chunks += 1
+        entry = self.header(index, TYPE_BLOB_IDX, 1, CHUNK_ANY, key)
+        struct.pack_into('<IBB', entry, 24, len(value), chunks, 0)
+        self.write_entry(entry)
+
+    def finish(self):
+        return bytes(self.image)
+
+
+def check_events(name, events, limits):
+    events = sorted((int(date), int(reps)) for date, reps in events)
+    for (date, reps), previous in zip(events, [None] + events[:-1]):
+        if date < 0 or date >= 1 << 64 or reps < 0 or reps > 255:
+            raise ImageError('load %s: event [%d, %d] out of range' % (name, date, reps))
+        if previous is not None and previous[0] == date:
+            raise ImageError('load %s: date %d repeated' % (name, date))
+    return events
+
+
+def check_load(load, limits):
+    name = load.get('l')
+    if not isinstance(name, str) or not 0 < len(name.encode()) < LOAD_NAME_LEN:
+        raise ImageError('load names must have 1 to %d characters: %r' % (LOAD_NAME_LEN - 1, name))
+    pin = load.get('p')
+    if not isinstance(pin, int) or not 0 <= pin <= 255:
+        raise ImageError('load %s: pin "p" missing or above 255' % name)
+    on = check_events(name, load.get('on', []), limits)
+    off = check_events(name, load.get('off', []), limits)
+    if len(on) + len(off) > limits['CONFIG_SCHED_MAX_EVENTS_PER_LOAD']:
+        raise ImageError('load %s: more events than CONFIG_SCHED_MAX_EVENTS_PER_LOAD' % name)
+    if limits['CONFIG_SCHED_VALIDATE_SCHEDULES']:
+        timeline = sorted([(date, 1) for date, _ in on] + [(date, 0) for date, _ in off])
+        for (date, state), (previousDate, previousState) in zip(timeline[1:], timeline):
+            if state == previousState or date == previousDate:
+                raise ImageError('load %s: ON and OFF dates do not alternate at %d' % (name, date))
+    return name, pin, on, off
+
+
+def build_image(document, limits, size=PARTITION_SIZE):
+    if document.get('v', 1) != 1:
+        raise ImageError('unsupported document version %r' % document.get('v'))
+    loads = [check_load(load, limits) for load in document.get('loads', [])]
+    if len(loads) > limits['CONFIG_SCHED_MAX_LOADS']:
+        raise ImageError('%d loads, more than CONFIG_SCHED_MAX_LOADS' % len(loads))
+    if len(set(name for name, _, _, _ in loads)) != len(loads):
+        raise ImageError('load names repeated')
+
+    writer = ImageWriter(size)
+    writer.namespace(SCHEDULES_NAMESPACE)
+    writer.namespace(LOADS_NAMESPACE)
+    for number, (name, pin, on, off) in enumerate(loads):
+        writer.blob(LOADS_NAMESPACE, 'L%03u' % number, LOAD_RECORD.pack(name.encode(), pin))
+        for state, events in (('ON', on), ('OFF', off)):
+            # The firmware keeps no key for an empty list
+            if events:
+                writer.blob(SCHEDULES_NAMESPACE, 'L%03u%s' % (number, state),
+                            b''.join(EVENT.pack(reps, date) for date, reps in events))
+    return writer.finish()
+
+
+# Inspect
+
+class ImageReader:
+    """Collects the written entries of every valid page, checking their CRCs"""
+
+    def __init__(self, image):
+        self.namespaces = {}
+        self.values = {}
+        self.chunks = {}
+        self.indexes = {}
+        self.errors = []
+        pages = []
+        for offset in range(0, len(image) - PAGE_SIZE + 1, PAGE_SIZE):
+            state, sequence, version = struct.unpack_from('<IIB', image, offset)
+            if state not in (PAGE_ACTIVE, PAGE_FULL):
+                continue
+            if struct.unpack_from('<I', image, offset + 28)[0] != crc32(bytes(image[offset + 4:offset + 28])):
+                self.errors.append('page at 0x%x: header CRC' % offset)
+                continue
+            if version != PAGE_VERSION:
+                self.errors.append('page at 0x%x: format version 0x%02x' % (offset, version))
+            pages.append((sequence, offset))
+        # Later pages hold the newer copy of a key
+        for _, offset in sorted(pages):
+            self.read_page(image, offset)
+
+    def read_page(self, image, offset):
+        bitmap = image[offset + 32:offset + 64]
+        n = 0
+        while n < ENTRIES_PER_PAGE:
+            if (bitmap[n // 4] >> (n % 4) * 2) & 3 != ENTRY_WRITTEN:
+                n += 1
+                continue
+            start = offset + FIRST_ENTRY_OFFSET + n * ENTRY_SIZE
+            entry = image[start:start + ENTRY_SIZE]
+            namespace, entry_type, span, chunk = struct.unpack_from('<BBBB', entry, 0)
+            span = max(1, min(span, ENTRIES_PER_PAGE - n))
+            key = bytes(entry[8:24]).split(b'\0')[0].decode(errors='replace')
+            if struct.unpack_from('<I', entry, 4)[0] != entry_crc(entry):
+                self.errors.append('entry %s at 0x%x: CRC' % (key, start))
+            elif namespace == 0 and entry_type == TYPE_U8:
+                self.namespaces[entry[24]] = key
+            elif entry_type in (TYPE_BLOB, TYPE_BLOB_DATA):
+                size, data_crc = struct.unpack_from('<H2xI', entry, 24)
+                data = bytes(image[start + ENTRY_SIZE:start + ENTRY_SIZE + size])
+                if crc32(data) != data_crc:
+                    self.errors.append('blob %s at 0x%x: data CRC' % (key, start))
+                elif entry_type == TYPE_BLOB:
+                    self.values[(namespace, key)] = data
+                else:
+                    self.chunks[(namespace, key, chunk)] = data
+            elif entry_type == TYPE_BLOB_IDX:
+                self.indexes[(namespace, key)] = struct.unpack_from('<IBB', entry, 24)
+            else:
+                size = entry_type & 0x0F
+                self.values[(namespace, key)] = int.from_bytes(entry[24:24 + size], 'little',
+                                                               signed=bool(entry_type & 0x10))
+            n += span
+
+    def namespace(self, name):
+        """Keys and values of one namespace, blobs assembled from their chunks"""
+        indexes = [index for index, namespace in self.namespaces.items() if namespace == name]
+        if not indexes:
+            return {}
+        values = {key: value for (namespace, key), value in self.values.items() if namespace == indexes[0]}
+        for (namespace, key), (size, count, start) in self.indexes.items():
+            if namespace != indexes[0]:
+                continue
+            parts = [self.chunks.get((namespace, key, start + c)) for c in range(count)]
+            if None in parts or sum(len(part) for part in parts) != size:
+                self.errors.append('blob %s: chunks missing' % key)
+                continue
+            values[key] = b''.join(parts)
+        return values
+
+
+def unpack_events(data):
+    events = [EVENT.unpack_from(data, offset) for offset in range(0, len(data) - EVENT.size + 1, EVENT.size)]
+    return sorted([date, reps] for reps, date in events)
+
+
+def read_document(reader):
+    """The loads of an image, registered ones by number then those of older firmware"""
+    records = reader.namespace(LOADS_NAMESPACE)
+    schedules = reader.namespace(SCHEDULES_NAMESPACE)
+    loads = []
+    for key in sorted(records):
+        record = records[key]
+        if isinstance(record, bytes) and len(record) == LOAD_RECORD.size and key[1:].isdigit():
+            name, pin = LOAD_RECORD.unpack(record)
+            loads.append({'l': name.split(b'\0')[0].decode(errors='replace'), 'p': pin, 'number': int(key[1:])})
+        elif isinstance(record, int):
+            # Pin stored under the name, migrated by sched_loads_init at boot
+            loads.append({'l': key, 'p': record, 'legacy': True})
+        else:
+            reader.errors.append('load record %s: unexpected value' % key)
+            continue
+        # "L<number>ON" for a registered load, "<name>ON" for one of older firmware
+        loads[-1]['on'] = unpack_events(schedules.get(key + 'ON', b''))
+        loads[-1]['off'] = unpack_events(schedules.get(key + 'OFF', b''))
+    return {'v': 1, 'loads': loads}, TXN_KEY in schedules
+
+
+def print_document(document, pending):
+    loads = document['loads']
+    for load in loads:
+        label = 'legacy' if load.get('legacy') else 'number %d' % load['number']
+        print('Load %s (%s) on pin %d: %d events ON, %d events OFF' % (load['l'], label, load['p'],
+                                                                       len(load['on']), len(load['off'])))
+        timeline = sorted([(date, 'ON', reps) for date, reps in load['on']]
+                          + [(date, 'OFF', reps) for date, reps in load['off']])
+        for date, state, reps in timeline:
+            print('  %d  %-3s  reps %d' % (date, state, reps))
+    print('%d loads, %d events.' % (len(loads), sum(len(l['on']) + len(l['off']) for l in loads)))
+    if pending:
+        print('A schedule transaction is pending, the firmware completes it at boot.')
+
+
+def inspect(path, as_json):
+    with open(path, 'rb') as image_file:
+        with mmap.mmap(image_file.fileno(), 0, access=mmap.ACCESS_READ) as image:
+            reader = ImageReader(image)
+            document, pending = read_document(reader)
+    if as_json:
+        for load in document['loads']:
+            load.pop('number', None)
+            load.pop('legacy', None)
+        json.dump(document, sys.stdout, separators=(',', ':'))
+        print()
+    else:
+        print_document(document, pending)
+    for error in reader.errors:
+        print('Warning: %s' % error, file=sys.stderr)
+    return 1 if reader.errors else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--sdkconfig', default=DEFAULT_SDKCONFIG, help='limits of the firmware (default: %(default)s)')
+    parser.add_argument('--size', type=lambda value: int(value, 0), default=PARTITION_SIZE,
+                        help='size of the MyNvs partition (default: 0x%(default)x)')
+    commands = parser.add_subparsers(dest='command', required=True)
+    build = commands.add_parser('build', help='image from a schedules document')
+    build.add_argument('document')
+    build.add_argument('image')
+    batch = commands.add_parser('batch', help='one image per line of a JSON lines file')
+    batch.add_argument('documents')
+    batch.add_argument('directory')
+    show = commands.add_parser('inspect', help='print the loads and schedules of an image')
+    show.add_argument('image')
+    show.add_argument('--json', action='store_true', help='print the schedules document instead')
+    args = parser.parse_args()
+
+    limits = read_limits(args.sdkconfig)
+    try:
+        if args.command == 'build':
+            with open(args.document) as document:
+                image = build_image(json.load(document), limits, args.size)
+            with open(args.image, 'wb') as output:
+                output.write(image)
+        elif args.command == 'batch':
+            os.makedirs(args.directory, exist_ok=True)
+            start = time.monotonic()
+            devices = 0
+            with open(args.documents) as documents:
+                for line, document in enumerate(documents, 1):
+                    if not document.strip():
+                        continue
+                    try:
+                        image = build_image(json.loads(document), limits, args.size)
+                    except (ImageError, ValueError) as error:
+                        raise ImageError('line %d: %s' % (line, error))
+                    with open(os.path.join(args.directory, 'mynvs-%05d.bin' % devices), 'wb') as output:
+                        output.write(image)
+                    devices += 1
+            elapsed = time.monotonic() - start
+            print('%d images in %.2f s, %.2f ms per device.' % (devices, elapsed, elapsed * 1000 / max(devices, 1)))
+        else:
+            return inspect(args.image, args.json)
+    except (ImageError, OSError, ValueError) as error:
+        print('Error: %s' % error, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())